@@ -21,6 +21,10 @@
  * Follow the provided guidelines in overrides.ld and your Makefile to set the flash length.
  *
  * During the boot phase, call flash_set_latency() once.
+ * If the firmware switches clocks at runtime, use flash_set_latency_for_clock() instead:
+ * 1. Call flash_latency_before_clock_change() with the new HCLK frequency; it adds a wait state now if the new clock needs one.
+ * 2. Switch the clock.
+ * 3. Call flash_latency_after_clock_change(); it reads the clock back from RCC and drops to zero wait states at 24 MHz or below.
  *
  * Read operations (getter functions) can be performed at any time and do not require unlocking.
  *
@@ -30,6 +34,9 @@
  * 3. Program all desired values to the pages.
  * 4. Lock the flash.
  *
+ * When several helpers alter the flash as part of one batch, wrap the batch in flash_session_begin() and flash_session_end() instead.
+ * Sessions nest: only the outermost one unlocks and locks, and flash_lock() does nothing while a session is open, so a nested helper cannot relock the flash under its caller.
+ *
  * To alter option bytes data1 and data0, follow these steps:
  * 1. Unlock the flash.
  * 2. Unlock option bytes.
@@ -42,6 +49,60 @@
  * - To write a byte (8 bits), the write needs to be 16 bits (uint16_t), with the upper 16 bits (I) replaced with the inverted bit pattern of D.
  * - Use provided functions for reading and writing data1 and data0 bytes or manipulate OB->Data1 yourself if you require raw speed.
  *
+ * @section write_protection Write Protection
+ * The WRPR0 and WRPR1 option bytes hold one bit per 1K sector (16 pages) of main flash: WRPR0 covers sectors 0-7, WRPR1 sectors 8-15.
+ * A cleared bit means the sector is write protected; erase and program attempts on it are rejected by the controller and flag WRPRTERR.
+ * - Reserve a sector-aligned calibration partition and turn its range into a sector mask with flash_calculate_WRPR_sector_mask().
+ * - Apply the mask with flash_write_protect_sectors(); all option bytes are rewritten in a single update.
+ * - For a controlled recalibration, lift it with flash_write_unprotect_sectors(), reset, rewrite the calibration and protect it again.
+ * - Option bytes are only loaded at reset, so flash_is_write_protected() reports the protection currently enforced, not what was just written.
+ *
+ * Because the hardware enforces the protection, code writing to the remaining (unprotected) pages does not need to range-check every address against the calibration partition.
+ *
+ * @section trace Operation Trace
+ * Define FLASH_USE_TRACE (e.g. in funconfig.h) to record every erase and program operation in a RAM ring buffer of FLASH_TRACE_DEPTH entries.
+ * Each entry holds the operation, address, length, SysTick->CNT at start and end and the resulting FLASH_STATUS_* code.
+ * Call flash_trace_dump() to print the buffer over the debug printf channel. Without FLASH_USE_TRACE the hooks compile to nothing.
+ *
+ * @section status Error Reporting
+ * flash_erase_page() and flash_program_16() give no feedback. Their flash_erase_page_checked() and flash_program_16_checked() variants return a FLASH_STATUS_* code instead:
+ * - FLASH_STATUS_LOCKED: the flash was not unlocked, nothing was started.
+ * - FLASH_STATUS_WRITE_PROTECTED: the controller rejected the operation (WRPRTERR), the sector is write protected.
+ * - FLASH_STATUS_VERIFY_FAILED: the programmed data does not read back as written, e.g. it was not erased. Half-word programs are only read back with FLASH_USE_VERIFY, page programs always.
+ * - FLASH_STATUS_TIMEOUT: the controller stayed busy for longer than FLASH_TIMEOUT_TICKS SysTick ticks.
+ * - FLASH_STATUS_LOW_VOLTAGE and FLASH_STATUS_ABORTED: see Supply Voltage Gating below.
+ * The status flags are cleared before and after every operation, so a stale WRPRTERR is never reported against a later operation.
+ * flash_program_16_checked() reads the half-word first and skips the program if it already holds the data; this load is much cheaper than the program it saves.
+ *
+ * @section erase_granularity Erase Granularity
+ * flash_erase_page() uses the fast page erase (CR_PAGE_ER), which erases one 64-byte page. The standard erase (CR_PER_Set) would erase a whole 1K sector on the CH32V003
+ * and take the code or data next to the reserved region with it. The fast page erase needs the fast page mode unlocked as well, so flash_unlock() also writes the mode keys
+ * and flash_lock() locks both. Code that unlocks with its own key writes has to write FLASH->MODEKEYR too, or the erase returns FLASH_STATUS_LOCKED.
+ *
+ * @section verify Program Verify
+ * flash_program_16_verified() and flash_program_buffer_verified() read every programmed half-word back and program it again when bits that should be cleared are still set (a marginal cell or a program cut short by a brown-out).
+ * A half-word holding cleared bits that should be set can only be fixed by an erase; it is reported as FLASH_STATUS_VERIFY_FAILED together with its address so the caller can relocate the data.
+ * Define FLASH_USE_VERIFY to make flash_program_16() and the helpers built on it retry up to FLASH_VERIFY_RETRIES times as well, and flash_program_16_checked() read every half-word back once.
+ * Without it flash_program_16_checked() costs no extra load after the program, but a program onto cells that were not erased goes unnoticed. With FLASH_USE_COUNTERS the retries and failures are counted.
+ *
+ * @section pvd Supply Voltage Gating
+ * Erasing or programming on a sagging supply leaves half-written pages behind. Define FLASH_USE_PVD_GATE and call flash_pvd_init() during boot to gate the checked primitives on the programmable voltage detector:
+ * - A page erase is not started while the supply is below the PVD threshold; it returns FLASH_STATUS_LOW_VOLTAGE so the commit can be deferred.
+ * - Call flash_request_abort() from your PVD_IRQHandler (after flash_pvd_enable_interrupt()). Every following erase or program returns FLASH_STATUS_ABORTED without starting, so a multi-page commit stops at the page it is on.
+ * - Once the supply is back, flash_clear_abort() re-enables the primitives.
+ *
+ * @section pipelined Pipelined Page Programming
+ * A fast page program keeps the controller busy for milliseconds. flash_program_page_start() returns as soon as the program is running and flash_program_page_finish() collects the result,
+ * so the CPU can prepare the next page in between. flash_erase_page_start() and flash_erase_page_finish() do the same for an erase. flash_program_pages() builds a multi-page commit on this: a fill callback encodes and checksums page N+1 while page N programs.
+ * The CPU stalls on any flash access while the controller is busy, so the code running in between must execute from RAM: flash_program_pages() is placed there with FLASH_RAM_FUNC,
+ * and the fill callback should be a static FLASH_RAM_FUNC function as well (an inline function would be inlined into flash code). Everything those two call is FLASH_RAM_INLINE, so it is inlined into the RAM copy:
+ * the page start, finish and erase helpers, the status polling, flash_is_page_erased() and flash_crc16(). The fill callback must not call any other function that lives in flash, memcpy() included,
+ * and must not read from flash either, or the overlap is lost (it still works, just serially).
+ *
+ * @section counters Performance Counters
+ * Define FLASH_USE_COUNTERS to count erases, programs, skipped no-op programs (the half-word already held the value) and the SysTick ticks spent busy-waiting on the controller since boot, along with the slowest single operation.
+ * Read them with flash_get_counters(); flash_reset_counters() starts a new measurement window.
+ *
  * @section address_calculations Address Calculations
  * To calculate the address for storing variables in the main flash, use the following formula:
  * \f$ \text{address of byte nonvolatile}[n] = \text{FLASH_BASE} + \text{N_BYTES} + [n] \f$
@@ -59,6 +120,14 @@
 #define CH32V003_FLASH_H
 #include <stdint.h>    // for uintN_t type support
 #include "../ch32v003fun/ch32v003fun/ch32v003fun.h"
+struct flash_counters; // defined with the internal variables below
+typedef uint8_t (*flash_fill_page_fn)(void *context, uint8_t page, uint32_t *buffer); // page source of flash_program_pages()
+#ifndef FLASH_RAM_FUNC
+#define FLASH_RAM_FUNC __attribute__((section(".srodata.flash_ram_func"), noinline, unused)) // linked into .data, copied to RAM at startup
+#endif
+#ifndef FLASH_RAM_INLINE
+#define FLASH_RAM_INLINE __attribute__((always_inline)) // always inlined, so it runs from RAM when a FLASH_RAM_FUNC calls it
+#endif
 /**
  * @brief Calculate the runtime address for nonvolatile storage.
  * 
@@ -76,10 +145,42 @@ static inline uint32_t flash_calculate_runtime_address(uint16_t byte_number);
  * It should be called during the boot phase.
  */
 static inline void flash_set_latency();
+/**
+ * @brief Set the flash controller latency for a given clock.
+ *
+ * This function sets the minimum safe number of wait states for the HCLK frequency: zero up to 24 MHz, one above.
+ *
+ * @param hclk The HCLK frequency in Hz.
+ */
+static inline void flash_set_latency_for_clock(uint32_t hclk);
+/**
+ * @brief Read the current HCLK frequency from RCC.
+ *
+ * This function decodes the active clock source (HSI, HSE or the 2x PLL) and the AHB prescaler.
+ * The HSE frequency is taken from FLASH_HSE_VALUE.
+ *
+ * @return uint32_t The HCLK frequency in Hz.
+ */
+static inline uint32_t flash_get_hclk();
+/**
+ * @brief Prepare the flash latency for a clock change.
+ *
+ * This function raises the wait states before switching to a faster clock; it never lowers them, as the current clock may still need them.
+ *
+ * @param new_hclk The HCLK frequency in Hz after the change.
+ */
+static inline void flash_latency_before_clock_change(uint32_t new_hclk);
+/**
+ * @brief Adjust the flash latency after a clock change.
+ *
+ * This function sets the latency for the clock read back from RCC, dropping wait states no longer needed.
+ */
+static inline void flash_latency_after_clock_change();
 /**
  * @brief Unlock the main flash for altering.
  *
  * This function unlocks the main flash memory to allow modifications such as erase or program operations.
+ * The keys are only written if the flash is actually locked.
  */
 static inline void flash_unlock();
 /**
@@ -93,8 +194,27 @@ static inline void flash_unlock_option_bytes();
  * @brief Lock the flash after modifications.
  *
  * This function locks the flash memory after completing modifications to prevent unintended writes.
+ * It does nothing while a session opened with flash_session_begin() is active; the session locks the flash when it ends.
  */
 static inline void flash_lock();
+/**
+ * @brief Open a flash unlock session.
+ *
+ * This function unlocks the flash when the outermost session is opened and only counts nested sessions, so they cost no key writes.
+ */
+static inline void flash_session_begin();
+/**
+ * @brief Close a flash unlock session.
+ *
+ * This function locks the flash when the outermost session is closed. Unbalanced calls are ignored.
+ */
+static inline void flash_session_end();
+/**
+ * @brief Check if a flash unlock session is open.
+ *
+ * @return uint8_t The session nesting depth, zero if no session is open.
+ */
+static inline uint8_t flash_session_depth();
 /**
  * @brief Erase a 64-byte page in flash memory.
  *
@@ -103,6 +223,31 @@ static inline void flash_lock();
  * @param start_addr The start address of the page to be erased.
  */
 static inline void flash_erase_page(uint32_t start_addr);
+/**
+ * @brief Erase a 64-byte page in flash memory and report the result.
+ *
+ * This function erases a page like flash_erase_page() and tells whether it worked.
+ *
+ * @param start_addr The start address of the page to be erased.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_LOCKED, FLASH_STATUS_WRITE_PROTECTED or FLASH_STATUS_TIMEOUT; with FLASH_USE_PVD_GATE also FLASH_STATUS_LOW_VOLTAGE or FLASH_STATUS_ABORTED.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_checked(uint32_t start_addr);
+/**
+ * @brief Start erasing a 64-byte page and return while the controller is busy.
+ *
+ * Do not access the flash until flash_erase_page_finish() was called; poll flash_is_busy() to find out when it can be called without waiting.
+ *
+ * @param start_addr The start address of the page to be erased.
+ * @return uint8_t FLASH_STATUS_OK if the erase is running, FLASH_STATUS_LOCKED or FLASH_STATUS_TIMEOUT; with FLASH_USE_PVD_GATE also FLASH_STATUS_LOW_VOLTAGE or FLASH_STATUS_ABORTED.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_start(uint32_t start_addr);
+/**
+ * @brief Wait for a page erase started by flash_erase_page_start().
+ *
+ * @param start_addr The start address of the page.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_WRITE_PROTECTED or FLASH_STATUS_TIMEOUT.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_finish(uint32_t start_addr);
 /**
  * @brief Program 16 bits of data into flash memory.
  *
@@ -113,6 +258,114 @@ static inline void flash_erase_page(uint32_t start_addr);
  * @param data The 16-bit data to be programmed.
  */
 static inline void flash_program_16(uint32_t addr, uint16_t data);
+/**
+ * @brief Program 16 bits of data into flash memory and report the result.
+ *
+ * This function programs a half-word like flash_program_16() and tells whether it worked.
+ * With FLASH_USE_VERIFY the half-word is read back once, which also catches programs onto cells that were not erased.
+ *
+ * @param addr The address where the data will be programmed.
+ * @param data The 16-bit data to be programmed.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_LOCKED, FLASH_STATUS_WRITE_PROTECTED, FLASH_STATUS_VERIFY_FAILED or FLASH_STATUS_TIMEOUT; with FLASH_USE_PVD_GATE also FLASH_STATUS_ABORTED.
+ */
+static inline uint8_t flash_program_16_checked(uint32_t addr, uint16_t data);
+/**
+ * @brief Program 16 bits of data into flash memory, retrying until it reads back correctly.
+ *
+ * This function programs a half-word and, while the read-back still has bits set that should be cleared, programs it again up to retries times.
+ *
+ * @param addr The address where the data will be programmed.
+ * @param data The 16-bit data to be programmed.
+ * @param retries The number of additional programs allowed.
+ * @return uint8_t FLASH_STATUS_OK or the status of the last failed attempt, FLASH_STATUS_VERIFY_FAILED if the data needs to be relocated.
+ */
+static inline uint8_t flash_program_16_verified(uint32_t addr, uint16_t data, uint8_t retries);
+/**
+ * @brief Program a buffer of half-words into flash memory with read-back verification.
+ *
+ * This function programs count half-words with flash_program_16_verified() using FLASH_VERIFY_RETRIES and stops at the first half-word that cannot be fixed.
+ *
+ * @param addr The address where the data will be programmed, half-word aligned.
+ * @param data The half-words to be programmed.
+ * @param count The number of half-words.
+ * @param failed_addr If not NULL, receives the address of the half-word that failed so the caller can relocate the data.
+ * @return uint8_t FLASH_STATUS_OK or the status of the failed half-word.
+ */
+static inline uint8_t flash_program_buffer_verified(uint32_t addr, const uint16_t *data, uint16_t count, uint32_t *failed_addr);
+/**
+ * @brief Program a whole erased 64-byte page at once.
+ *
+ * This function loads the page into the controller's page buffer and programs it with a single fast page program, which takes about as long as programming one half-word.
+ * The page must be erased. The flash and its fast page mode must be unlocked (flash_unlock() does both).
+ *
+ * @param addr The start address of the page, page aligned.
+ * @param data The 16 words to be programmed.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_LOCKED, FLASH_STATUS_WRITE_PROTECTED, FLASH_STATUS_VERIFY_FAILED or FLASH_STATUS_TIMEOUT; with FLASH_USE_PVD_GATE also FLASH_STATUS_ABORTED.
+ */
+static inline uint8_t flash_program_page_checked(uint32_t addr, const uint32_t *data);
+/**
+ * @brief Start programming a whole erased 64-byte page and return while the controller is busy.
+ *
+ * This function loads the page buffer and starts the fast page program. Do not access the flash until flash_program_page_finish() was called;
+ * poll flash_is_busy() to find out when it can be called without waiting.
+ *
+ * @param addr The start address of the page, page aligned.
+ * @param data The 16 words to be programmed.
+ * @return uint8_t FLASH_STATUS_OK if the program is running, FLASH_STATUS_LOCKED or FLASH_STATUS_TIMEOUT; with FLASH_USE_PVD_GATE also FLASH_STATUS_ABORTED.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_program_page_start(uint32_t addr, const uint32_t *data);
+/**
+ * @brief Wait for a page program started by flash_program_page_start() and verify it.
+ *
+ * @param addr The start address of the page.
+ * @param data The 16 words that were programmed.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_WRITE_PROTECTED, FLASH_STATUS_VERIFY_FAILED or FLASH_STATUS_TIMEOUT.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_program_page_finish(uint32_t addr, const uint32_t *data);
+/**
+ * @brief Program consecutive pages, preparing each page while the previous one programs.
+ *
+ * This function asks fill for page 0, then starts each page and calls fill for the next one before waiting for the controller.
+ * Pages that are not erased are erased first. See Pipelined Page Programming.
+ *
+ * @param addr The start address of the first page, page aligned.
+ * @param n_pages The number of pages.
+ * @param fill Writes the 16 words of page n into buffer; a non-zero return value stops the commit and is returned.
+ * @param context Passed to fill.
+ * @return uint8_t FLASH_STATUS_OK, the failed flash status or the return value of fill.
+ */
+static FLASH_RAM_FUNC uint8_t flash_program_pages(uint32_t addr, uint8_t n_pages, flash_fill_page_fn fill, void *context);
+/**
+ * @brief Enable the programmable voltage detector.
+ *
+ * This function enables the PWR clock and the PVD with the given threshold. Call it during boot when using FLASH_USE_PVD_GATE.
+ *
+ * @param level The PVD threshold (PLS), 0 for the lowest to 7 for the highest voltage.
+ */
+static inline void flash_pvd_init(uint8_t level);
+/**
+ * @brief Enable the PVD interrupt on a falling supply.
+ *
+ * This function routes the PVD output to EXTI line 8 (rising edge of PVDO, i.e. the supply falling below the threshold) and enables PVD_IRQn.
+ * The application provides PVD_IRQHandler, which should call flash_request_abort() and clear EXTI line 8.
+ */
+static inline void flash_pvd_enable_interrupt();
+/**
+ * @brief Check if the supply is above the PVD threshold.
+ *
+ * @return uint8_t Non-zero if the supply is fine or the PVD is disabled, zero if it is below the threshold.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_supply_is_ok();
+/**
+ * @brief Stop all further erase and program operations.
+ *
+ * This function is safe to call from an interrupt handler. The operation in progress finishes, every later checked primitive returns FLASH_STATUS_ABORTED.
+ */
+static inline void flash_request_abort();
+/**
+ * @brief Allow erase and program operations again after flash_request_abort().
+ */
+static inline void flash_clear_abort();
 /**
  * @brief Program two 8-bit values into flash memory.
  *
@@ -160,6 +413,26 @@ static inline uint8_t flash_read_8_bits(uint32_t addr);
  * @return float The float value read from the specified address.
  */
 static inline float flash_read_float_value(uint32_t addr);
+/**
+ * @brief Check if a 64-byte page is erased.
+ *
+ * This function tests the page with 32-bit loads, it is a cheap way to tell whether a page can be programmed without an erase.
+ *
+ * @param addr The start address of the page.
+ * @return uint8_t Non-zero if every byte of the page reads 0xFF, zero otherwise.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_is_page_erased(uint32_t addr);
+/**
+ * @brief Calculate a CRC-16/CCITT over a block of data.
+ *
+ * This function is used by the storage helpers to validate the images they write. Pass 0xFFFF to start a new CRC, or the result of a previous call to continue it over another block.
+ *
+ * @param crc The initial value.
+ * @param data The data.
+ * @param length The number of bytes.
+ * @return uint16_t The CRC.
+ */
+static inline FLASH_RAM_INLINE uint16_t flash_crc16(uint16_t crc, const void *data, uint16_t length);
 /**
  * @brief Write 16 bits of data to the option bytes.
  *
@@ -235,6 +508,81 @@ static inline uint8_t flash_read_option_byte_DATA0();
  * @return uint16_t The combined 16-bit value of DATA1 and DATA0 option bytes.
  */
 static inline uint16_t flash_read_option_byte_DATA_16();
+/**
+ * @brief Read both WRPR option bytes as a 16-bit sector mask.
+ *
+ * This function combines WRPR1 (sectors 8-15) and WRPR0 (sectors 0-7) and inverts them, so a set bit means the 1K sector is write protected.
+ * The value reflects the option bytes as programmed, which take effect after the next reset.
+ *
+ * @return uint16_t The mask of write protected sectors, bit n for sector n.
+ */
+static inline uint16_t flash_read_option_byte_WRPR_16();
+/**
+ * @brief Calculate the write protection sector mask covering an address range.
+ *
+ * This function returns a mask with one bit for every 1K sector touched by the range, suitable for flash_write_protect_sectors().
+ * Keep protected partitions sector-aligned, otherwise the neighbouring pages in the same sector are protected as well.
+ *
+ * @param start_addr The first address of the partition.
+ * @param length The length of the partition in bytes.
+ * @return uint16_t The mask of sectors covering the range, bit n for sector n.
+ */
+static inline uint16_t flash_calculate_WRPR_sector_mask(uint32_t start_addr, uint32_t length);
+/**
+ * @brief Write protect flash sectors.
+ *
+ * This function adds the sectors in the mask to the current write protection using a single option byte update; other option bytes are kept intact.
+ * The flash and the option bytes must be unlocked, and the protection is enforced from the next reset on.
+ *
+ * @param sector_mask The sectors to protect, bit n for sector n.
+ */
+static inline void flash_write_protect_sectors(uint16_t sector_mask);
+/**
+ * @brief Lift the write protection of flash sectors.
+ *
+ * This function removes the sectors in the mask from the current write protection using a single option byte update; other option bytes are kept intact.
+ * The flash and the option bytes must be unlocked, and the sectors become writable from the next reset on.
+ *
+ * @param sector_mask The sectors to unprotect, bit n for sector n.
+ */
+static inline void flash_write_unprotect_sectors(uint16_t sector_mask);
+/**
+ * @brief Check if the sector holding an address is currently write protected.
+ *
+ * This function reads the protection loaded by the controller at reset, which is what erase and program operations are checked against.
+ *
+ * @param addr An address within main flash.
+ * @return uint8_t Non-zero if the sector is write protected, zero otherwise.
+ */
+static inline uint8_t flash_is_write_protected(uint32_t addr);
+/**
+ * @brief Print the flash operation trace.
+ *
+ * This function prints the recorded operations, oldest first, with their duration in SysTick ticks.
+ * It does nothing unless FLASH_USE_TRACE is defined.
+ */
+static inline void flash_trace_dump();
+/**
+ * @brief Clear the flash operation trace.
+ *
+ * This function empties the trace ring buffer. It does nothing unless FLASH_USE_TRACE is defined.
+ */
+static inline void flash_trace_clear();
+/**
+ * @brief Read the flash performance counters.
+ *
+ * This function copies the counters accumulated since boot or the last flash_reset_counters() call.
+ * Without FLASH_USE_COUNTERS all counters read as zero.
+ *
+ * @param counters Where to store the counters.
+ */
+static inline void flash_get_counters(struct flash_counters *counters);
+/**
+ * @brief Reset the flash performance counters.
+ *
+ * This function zeroes all counters. It does nothing unless FLASH_USE_COUNTERS is defined.
+ */
+static inline void flash_reset_counters();
 // Internal Function Declarations
 /**
  * @brief Check if the flash is currently busy.
@@ -243,7 +591,7 @@ static inline uint16_t flash_read_option_byte_DATA_16();
  *
  * @return uint8_t Non-zero if the flash is busy, zero otherwise.
  */
-static inline uint8_t flash_is_busy();
+static inline FLASH_RAM_INLINE uint8_t flash_is_busy();
 /**
  * @brief Check if the last flash operation has completed.
  *
@@ -266,12 +614,33 @@ static inline uint8_t flash_is_ERR_WRPRT();
  * This function clears the End Of Programming (EOP) bit in the flash status register.
  */
 static inline void flash_is_done_clear();
+/**
+ * @brief Clear the EOP and WRPRTERR flags.
+ *
+ * This function clears both write-one-to-clear status flags without touching anything else.
+ */
+static inline FLASH_RAM_INLINE void flash_clear_status_flags();
+/**
+ * @brief Wait until the flash is no longer busy, giving up after a number of SysTick ticks.
+ *
+ * @param ticks The number of SysTick ticks to wait at most.
+ * @return uint8_t Non-zero if the flash became idle, zero on timeout.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_wait_until_not_busy_timeout(uint32_t ticks);
+/**
+ * @brief Wait for a started operation and turn the status flags into a FLASH_STATUS_* code.
+ *
+ * This function waits with FLASH_TIMEOUT_TICKS, checks WRPRTERR and clears the status flags.
+ *
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_WRITE_PROTECTED or FLASH_STATUS_TIMEOUT.
+ */
+static inline FLASH_RAM_INLINE uint8_t flash_wait_for_result();
 /**
  * @brief Wait until the flash is no longer busy.
  *
  * This function blocks execution until the flash memory is no longer busy with an ongoing operation.
  */
-static inline void flash_wait_until_not_busy();
+static inline FLASH_RAM_INLINE void flash_wait_until_not_busy();
 /**
  * @brief Wait until the last flash operation is done.
  *
@@ -293,6 +662,47 @@ static inline uint8_t flash_dechecksum(uint16_t input);
  * This function erases the option byte in flash memory.
  */
 static inline void flash_OB_erase();
+/**
+ * @brief Rewrite all option bytes.
+ *
+ * This function erases the option bytes and programs the given values in one update.
+ * USER and RDPR are passed as read from the option bytes; the WRPR and data bytes are passed as plain values.
+ *
+ * @param user The USER option byte as read from OB->USER.
+ * @param rdpr The RDPR option byte as read from OB->RDPR.
+ * @param wrpr_mask The write protection mask, bit n set for sector n protected.
+ * @param data The DATA1 (high byte) and DATA0 (low byte) values.
+ */
+static inline void flash_OB_program(uint16_t user, uint16_t rdpr, uint16_t wrpr_mask, uint16_t data);
+#ifdef FLASH_USE_TRACE
+/**
+ * @brief Add a finished operation to the trace ring buffer.
+ *
+ * This function overwrites the oldest entry once the buffer is full. It is only available with FLASH_USE_TRACE.
+ *
+ * @param op The operation, one of FLASH_OP_*.
+ * @param addr The address the operation targeted.
+ * @param length The number of bytes affected.
+ * @param start SysTick->CNT when the operation started.
+ * @param end SysTick->CNT when the operation finished.
+ * @param status The FLASH_STATUS_* result of the operation.
+ */
+static inline FLASH_RAM_INLINE void flash_trace_record(uint8_t op, uint32_t addr, uint16_t length, uint32_t start, uint32_t end, uint8_t status);
+#endif
+#if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+/**
+ * @brief Account a finished operation in the trace and the counters.
+ *
+ * This function is called at the end of every primitive through FLASH_OP_END() when FLASH_USE_TRACE or FLASH_USE_COUNTERS is defined.
+ *
+ * @param op The operation, one of FLASH_OP_*.
+ * @param addr The address the operation targeted.
+ * @param length The number of bytes affected.
+ * @param start SysTick->CNT when the operation started.
+ * @param status The FLASH_STATUS_* result of the operation.
+ */
+static inline FLASH_RAM_INLINE void flash_op_finish(uint8_t op, uint32_t addr, uint16_t length, uint32_t start, uint8_t status);
+#endif
 // Internal variables
 extern char FLASH_LENGTH_OVERRIDE[]; // import from .ld, halal by https://sourceware.org/binutils/docs/ld/Source-Code-Reference.html
 union float_uint32t {
@@ -307,7 +717,84 @@ union uint16t_2xuint8t {
 	uint16_t u16;
 	uint8_t u8[2];
 };
+enum flash_status {
+	FLASH_STATUS_OK = 0,
+	FLASH_STATUS_LOCKED,
+	FLASH_STATUS_WRITE_PROTECTED,
+	FLASH_STATUS_VERIFY_FAILED,
+	FLASH_STATUS_TIMEOUT,
+	FLASH_STATUS_LOW_VOLTAGE,
+	FLASH_STATUS_ABORTED,
+	FLASH_STATUS_FULL,     // no room left in the partition
+	FLASH_STATUS_EMPTY,    // nothing to read
+	FLASH_STATUS_INVALID,  // argument out of range
+};
+enum flash_op {
+	FLASH_OP_ERASE_PAGE,
+	FLASH_OP_PROGRAM_16,
+	FLASH_OP_OB_ERASE,
+	FLASH_OP_OB_PROGRAM,
+	FLASH_OP_PROGRAM_PAGE,
+};
+struct flash_counters {
+	uint32_t erases;             // pages erased
+	uint32_t programs;           // half-words programmed
+	uint32_t skipped_programs;   // programs skipped because the half-word already held the value
+	uint32_t option_byte_writes; // option byte erase/program cycles
+	uint32_t verify_retries;     // half-words programmed again after a failed read-back
+	uint32_t verify_failures;    // half-words that could not be fixed by programming again
+	uint32_t busy_wait_ticks;    // SysTick ticks spent waiting for the controller
+	uint32_t worst_op_ticks;     // duration of the slowest single operation
+};
+#ifdef FLASH_USE_TRACE
+#include <stdio.h>     // for printf in flash_trace_dump()
+#ifndef FLASH_TRACE_DEPTH
+#define FLASH_TRACE_DEPTH 16
+#endif
+struct flash_trace_entry {
+	uint32_t start;  // SysTick->CNT when the operation started
+	uint32_t end;    // SysTick->CNT when the operation finished
+	uint32_t addr;
+	uint16_t length;
+	uint8_t op;      // enum flash_op
+	uint8_t status;  // enum flash_status
+};
+static struct flash_trace_entry flash_trace_buffer[FLASH_TRACE_DEPTH];
+static uint32_t flash_trace_count; // total operations recorded since the last clear
+#endif
+#ifdef FLASH_USE_COUNTERS
+static struct flash_counters flash_counters;
+#endif
+static uint8_t flash_session_nesting; // open flash_session_begin() calls
+#if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+static uint32_t flash_async_op_start; // SysTick->CNT when flash_erase_page_start() or flash_program_page_start() was called
+#endif
+static volatile uint8_t flash_abort_requested; // set by flash_request_abort(), usually from the PVD interrupt
+#if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+// Open and close an accounted section inside a primitive.
+#define FLASH_OP_START() uint32_t flash_op_start = SysTick->CNT
+#define FLASH_OP_END(op, addr, length, status) flash_op_finish((op), (addr), (length), flash_op_start, (status))
+#else
+#define FLASH_OP_START()
+#define FLASH_OP_END(op, addr, length, status)
+#endif
 // Preprocessor Macros
+#define FLASH_PAGE_SIZE 64 // smallest erasable unit
+#define FLASH_WRPR_SECTOR_SIZE 1024 // each WRPR bit covers 16 pages
+#ifndef FLASH_TIMEOUT_TICKS
+#define FLASH_TIMEOUT_TICKS (FUNCONF_SYSTEM_CORE_CLOCK / 100) // >= 10 ms whatever the SysTick clock, erase and program take ~3 ms
+#endif
+#ifndef FLASH_HSE_VALUE
+#define FLASH_HSE_VALUE 24000000 // external oscillator frequency used by flash_get_hclk()
+#endif
+#define FLASH_HSI_VALUE 24000000
+#define FLASH_ZERO_WAIT_MAX_HCLK 24000000 // highest HCLK running with zero wait states
+#ifndef FLASH_VERIFY_RETRIES
+#define FLASH_VERIFY_RETRIES 2
+#endif
+#ifndef FLASH_CTLR_FLOCK
+#define FLASH_CTLR_FLOCK ((uint32_t)0x00008000) // fast page mode lock
+#endif
 #define FLASH_VOLATILE_CAPACITY (FLASH_BASE-FLASH_LENGTH_OVERRIDE)
 // use this to define main flash nonvolatile addresses at compile time!
 #define FLASH_PRECALCULATE_NONVOLATILE_ADDR(n) FLASH_BASE+(uint32_t)(uintptr_t)(FLASH_LENGTH_OVERRIDE)+n 
@@ -327,11 +814,52 @@ static inline void flash_set_latency() {
         FLASH->ACTLR = FLASH_Latency_1;
     #endif
 }
+static inline void flash_set_latency_for_clock(uint32_t hclk) {
+    // Zero wait states are enough up to 24 MHz, one is needed above.
+    FLASH->ACTLR = (hclk <= FLASH_ZERO_WAIT_MAX_HCLK) ? FLASH_Latency_0 : FLASH_Latency_1;
+}
+static inline uint32_t flash_get_hclk() {
+    // AHB prescaler for HPRE values 0-15, values 8 and up are powers of two.
+    static const uint16_t hpre_divider[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 2, 4, 8, 16, 32, 64, 128, 256 };
+    uint32_t cfgr0 = RCC->CFGR0;
+    uint32_t sysclk;
+    // Decode the clock source that is actually in use.
+    switch(cfgr0 & RCC_SWS) {
+        case RCC_SWS_HSE:
+            sysclk = FLASH_HSE_VALUE;
+            break;
+        case RCC_SWS_PLL:
+            // The PLL doubles either HSI or HSE.
+            sysclk = 2 * ((cfgr0 & RCC_PLLSRC) ? FLASH_HSE_VALUE : FLASH_HSI_VALUE);
+            break;
+        default:
+            sysclk = FLASH_HSI_VALUE;
+            break;
+    }
+    return sysclk / hpre_divider[(cfgr0 & RCC_HPRE) >> 4];
+}
+static inline void flash_latency_before_clock_change(uint32_t new_hclk) {
+    // Only raise the latency, the current clock may still need the wait state.
+    if(new_hclk > FLASH_ZERO_WAIT_MAX_HCLK) {
+        flash_set_latency_for_clock(new_hclk);
+    }
+}
+static inline void flash_latency_after_clock_change() {
+    flash_set_latency_for_clock(flash_get_hclk());
+}
 static inline void flash_unlock() {
-    // Write the first key to the flash key register for unlocking.
-    FLASH->KEYR = FLASH_KEY1;
-    // Write the second key to completely unlock the flash.
-    FLASH->KEYR = FLASH_KEY2;
+    // Keys written to an already unlocked controller are a wrong sequence, so only unlock what is locked.
+    if(FLASH->CTLR & FLASH_CTLR_LOCK) {
+        // Write the first key to the flash key register for unlocking.
+        FLASH->KEYR = FLASH_KEY1;
+        // Write the second key to completely unlock the flash.
+        FLASH->KEYR = FLASH_KEY2;
+    }
+    if(FLASH->CTLR & FLASH_CTLR_FLOCK) {
+        // Repeat the keys on the mode key register to unlock the 64-byte fast page mode.
+        FLASH->MODEKEYR = FLASH_KEY1;
+        FLASH->MODEKEYR = FLASH_KEY2;
+    }
 }
 static inline void flash_unlock_option_bytes() {
     // Write the first key to the option bytes key register for unlocking.
@@ -340,44 +868,288 @@ static inline void flash_unlock_option_bytes() {
     FLASH->OBKEYR = FLASH_KEY2;
 }
 static inline void flash_lock() {
-    // Set the lock bit in the flash control register to lock the flash.
-    FLASH->CTLR |= FLASH_CTLR_LOCK;
+    // Leave the flash unlocked while a session is open, its outermost end locks it.
+    if(flash_session_nesting) {
+        return;
+    }
+    // Set the lock bits in the flash control register to lock the flash and its fast page mode.
+    FLASH->CTLR |= FLASH_CTLR_LOCK | FLASH_CTLR_FLOCK;
 }
-static inline void flash_erase_page(uint32_t start_addr) {
-    // Check if the flash is locked.
-    if(FLASH->CTLR & FLASH_CTLR_LOCK) {
-        // If locked, exit the function.
+static inline void flash_session_begin() {
+    // Only the outermost session unlocks.
+    if(flash_session_nesting++ == 0) {
+        flash_unlock();
+    }
+}
+static inline void flash_session_end() {
+    // Ignore an end without a begin rather than wrapping the counter.
+    if(flash_session_nesting == 0) {
         return;
     }
+    // The outermost end locks the flash.
+    if(--flash_session_nesting == 0) {
+        flash_lock();
+    }
+}
+static inline uint8_t flash_session_depth() {
+    return flash_session_nesting;
+}
+static inline void flash_erase_page(uint32_t start_addr) {
+    // Erase the page, the status is only of interest to flash_erase_page_checked() callers.
+    (void)flash_erase_page_checked(start_addr);
+}
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_checked(uint32_t start_addr) {
+    uint8_t status = flash_erase_page_start(start_addr);
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    return flash_erase_page_finish(start_addr);
+}
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_start(uint32_t start_addr) {
+    // Check if the flash or its fast page mode is locked.
+    if(FLASH->CTLR & (FLASH_CTLR_LOCK | FLASH_CTLR_FLOCK)) {
+        // If locked, report it without starting anything.
+        return FLASH_STATUS_LOCKED;
+    }
+    #ifdef FLASH_USE_PVD_GATE
+    // Do not start an erase after an abort request or on a sagging supply, the page would be left half-erased.
+    if(flash_abort_requested) {
+        return FLASH_STATUS_ABORTED;
+    }
+    if(!flash_supply_is_ok()) {
+        return FLASH_STATUS_LOW_VOLTAGE;
+    }
+    #endif
+    #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+    flash_async_op_start = SysTick->CNT;
+    #endif
     // Wait until the flash is not busy before starting the erase operation.
-    flash_wait_until_not_busy();
-    // Set the page erase bit in the control register.
-    FLASH->CTLR |= CR_PER_Set;
+    if(!flash_wait_until_not_busy_timeout(FLASH_TIMEOUT_TICKS)) {
+        #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+        flash_op_finish(FLASH_OP_ERASE_PAGE, start_addr, FLASH_PAGE_SIZE, flash_async_op_start, FLASH_STATUS_TIMEOUT);
+        #endif
+        return FLASH_STATUS_TIMEOUT;
+    }
+    // Clear flags left over by earlier operations.
+    flash_clear_status_flags();
+    // Set the fast page erase bit, the plain PER bit would erase a whole 1K sector.
+    FLASH->CTLR |= CR_PAGE_ER;
     // Set the address of the page to be erased.
-    FLASH->ADDR = start_addr; 
-    // Start the erase operation.
+    FLASH->ADDR = start_addr;
+    // Start the erase operation, flash_erase_page_finish() collects the result.
     FLASH->CTLR |= CR_STRT_Set;
-    // Wait until the flash is not busy again after the erase.
-    flash_wait_until_not_busy();
+    return FLASH_STATUS_OK;
+}
+static inline FLASH_RAM_INLINE uint8_t flash_erase_page_finish(uint32_t start_addr) {
+    // Wait until the erase is done and collect its result.
+    uint8_t status = flash_wait_for_result();
     // Reset the page erase bit.
-    FLASH->CTLR &= CR_PER_Reset;
+    FLASH->CTLR &= ~CR_PAGE_ER;
+    #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+    flash_op_finish(FLASH_OP_ERASE_PAGE, start_addr, FLASH_PAGE_SIZE, flash_async_op_start, status);
+    #else
+    (void)start_addr;
+    #endif
+    return status;
 }
 static inline void flash_program_16(uint32_t addr, uint16_t data) {
+    // Program the half-word, the status is only of interest to flash_program_16_checked() callers.
+    #ifdef FLASH_USE_VERIFY
+    (void)flash_program_16_verified(addr, data, FLASH_VERIFY_RETRIES);
+    #else
+    (void)flash_program_16_checked(addr, data);
+    #endif
+}
+static inline uint8_t flash_program_16_checked(uint32_t addr, uint16_t data) {
     // Check if the flash is locked.
     if(FLASH->CTLR & FLASH_CTLR_LOCK) {
-        // If locked, exit the function.
-        return;
+        // If locked, report it without starting anything.
+        return FLASH_STATUS_LOCKED;
+    }
+    #ifdef FLASH_USE_PVD_GATE
+    // Do not start another program once an abort was requested.
+    if(flash_abort_requested) {
+        return FLASH_STATUS_ABORTED;
     }
+    #endif
+    // Skip the program if the half-word already holds the data, it would not change anything.
+    if(flash_read_16_bits(addr) == data) {
+        #ifdef FLASH_USE_COUNTERS
+        flash_counters.skipped_programs++;
+        #endif
+        return FLASH_STATUS_OK;
+    }
+    FLASH_OP_START();
     // Wait until the flash is not busy before starting the program operation.
-    flash_wait_until_not_busy();
+    if(!flash_wait_until_not_busy_timeout(FLASH_TIMEOUT_TICKS)) {
+        FLASH_OP_END(FLASH_OP_PROGRAM_16, addr, 2, FLASH_STATUS_TIMEOUT);
+        return FLASH_STATUS_TIMEOUT;
+    }
+    // Clear flags left over by earlier operations.
+    flash_clear_status_flags();
     // Enable the flash programming by setting the PG bit in the control register.
     FLASH->CTLR |= CR_PG_Set;
     // Program the 16-bit data at the specified address.
     *(uint16_t*)(uintptr_t)addr = data;
-    // Wait until the flash is not busy again after programming.
-    flash_wait_until_not_busy();
+    // Wait until the program is done and collect its result.
+    uint8_t status = flash_wait_for_result();
     // Reset the PG bit to disable flash programming.
     FLASH->CTLR &= CR_PG_Reset;
+    #ifdef FLASH_USE_VERIFY
+    // Read the half-word back, a single load that catches cells which were not erased.
+    if(status == FLASH_STATUS_OK && flash_read_16_bits(addr) != data) {
+        status = FLASH_STATUS_VERIFY_FAILED;
+    }
+    #endif
+    FLASH_OP_END(FLASH_OP_PROGRAM_16, addr, 2, status);
+    return status;
+}
+static inline uint8_t flash_program_16_verified(uint32_t addr, uint16_t data, uint8_t retries) {
+    while(1) {
+        uint8_t status = flash_program_16_checked(addr, data);
+        // Read back here, flash_program_16_checked() only does so with FLASH_USE_VERIFY.
+        if(status != FLASH_STATUS_OK && status != FLASH_STATUS_VERIFY_FAILED) {
+            return status;
+        }
+        uint16_t read = flash_read_16_bits(addr);
+        if(read == data) {
+            return FLASH_STATUS_OK;
+        }
+        // Another program can only clear bits, so retrying only helps if every cleared bit is also clear in the data.
+        if((read & data) != data || retries == 0) {
+            #ifdef FLASH_USE_COUNTERS
+            flash_counters.verify_failures++;
+            #endif
+            return FLASH_STATUS_VERIFY_FAILED;
+        }
+        retries--;
+        #ifdef FLASH_USE_COUNTERS
+        flash_counters.verify_retries++;
+        #endif
+    }
+}
+static inline uint8_t flash_program_buffer_verified(uint32_t addr, const uint16_t *data, uint16_t count, uint32_t *failed_addr) {
+    for(uint16_t n = 0; n < count; n++) {
+        uint8_t status = flash_program_16_verified(addr + 2 * n, data[n], FLASH_VERIFY_RETRIES);
+        if(status != FLASH_STATUS_OK) {
+            // Hand the failing address out so the caller can move the data elsewhere.
+            if(failed_addr) {
+                *failed_addr = addr + 2 * n;
+            }
+            return status;
+        }
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_program_page_checked(uint32_t addr, const uint32_t *data) {
+    uint8_t status = flash_program_page_start(addr, data);
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    return flash_program_page_finish(addr, data);
+}
+static inline FLASH_RAM_INLINE uint8_t flash_program_page_start(uint32_t addr, const uint32_t *data) {
+    // Check if the flash or its fast page mode is locked.
+    if(FLASH->CTLR & (FLASH_CTLR_LOCK | FLASH_CTLR_FLOCK)) {
+        // If locked, report it without starting anything.
+        return FLASH_STATUS_LOCKED;
+    }
+    #ifdef FLASH_USE_PVD_GATE
+    // Do not start another program once an abort was requested.
+    if(flash_abort_requested) {
+        return FLASH_STATUS_ABORTED;
+    }
+    #endif
+    #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+    flash_async_op_start = SysTick->CNT;
+    #endif
+    // Wait until the flash is not busy before starting the program operation.
+    if(!flash_wait_until_not_busy_timeout(FLASH_TIMEOUT_TICKS)) {
+        #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+        flash_op_finish(FLASH_OP_PROGRAM_PAGE, addr, FLASH_PAGE_SIZE, flash_async_op_start, FLASH_STATUS_TIMEOUT);
+        #endif
+        return FLASH_STATUS_TIMEOUT;
+    }
+    // Clear flags left over by earlier operations.
+    flash_clear_status_flags();
+    // Enter fast page program mode and reset the page buffer.
+    FLASH->CTLR |= CR_PAGE_PG;
+    FLASH->CTLR |= CR_BUF_RST;
+    flash_wait_until_not_busy();
+    FLASH->ADDR = addr;
+    // Load the page buffer a word at a time.
+    volatile uint32_t *word = (volatile uint32_t*)(uintptr_t)addr;
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 4; n++) {
+        word[n] = data[n];
+        FLASH->CTLR |= CR_BUF_LOAD;
+        flash_wait_until_not_busy();
+    }
+    // Program the whole buffer, flash_program_page_finish() collects the result.
+    FLASH->CTLR |= CR_STRT_Set;
+    return FLASH_STATUS_OK;
+}
+static inline FLASH_RAM_INLINE uint8_t flash_program_page_finish(uint32_t addr, const uint32_t *data) {
+    uint8_t status = flash_wait_for_result();
+    // Leave fast page program mode.
+    FLASH->CTLR &= ~CR_PAGE_PG;
+    // Read the page back, a bit that stayed set means the page was not erased or the program was cut short.
+    const uint32_t *word = (const uint32_t*)(uintptr_t)addr;
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 4 && status == FLASH_STATUS_OK; n++) {
+        if(word[n] != data[n]) {
+            status = FLASH_STATUS_VERIFY_FAILED;
+        }
+    }
+    #if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+    flash_op_finish(FLASH_OP_PROGRAM_PAGE, addr, FLASH_PAGE_SIZE, flash_async_op_start, status);
+    #endif
+    return status;
+}
+static FLASH_RAM_FUNC uint8_t flash_program_pages(uint32_t addr, uint8_t n_pages, flash_fill_page_fn fill, void *context) {
+    // Two buffers: one is being programmed while the other one is filled.
+    uint32_t buffer[2][FLASH_PAGE_SIZE / 4];
+    uint8_t status = n_pages ? fill(context, 0, buffer[0]) : FLASH_STATUS_OK;
+    for(uint8_t n = 0; n < n_pages && status == FLASH_STATUS_OK; n++) {
+        uint32_t page_addr = addr + (uint32_t)n * FLASH_PAGE_SIZE;
+        // An erase cannot overlap with a program, so it happens in between.
+        if(!flash_is_page_erased(page_addr)) {
+            status = flash_erase_page_checked(page_addr);
+        }
+        if(status == FLASH_STATUS_OK) {
+            status = flash_program_page_start(page_addr, buffer[n & 1]);
+        }
+        if(status != FLASH_STATUS_OK) {
+            break;
+        }
+        // Prepare the next page while the controller is busy with this one.
+        uint8_t fill_status = n + 1 < n_pages ? fill(context, n + 1, buffer[(n + 1) & 1]) : FLASH_STATUS_OK;
+        status = flash_program_page_finish(page_addr, buffer[n & 1]);
+        if(status == FLASH_STATUS_OK) {
+            status = fill_status;
+        }
+    }
+    return status;
+}
+static inline void flash_pvd_init(uint8_t level) {
+    // The PVD lives in the PWR block, which needs its clock.
+    RCC->APB1PCENR |= RCC_APB1Periph_PWR;
+    // Select the threshold and enable the detector.
+    PWR->CTLR = (PWR->CTLR & ~PWR_CTLR_PLS) | ((level << 5) & PWR_CTLR_PLS) | PWR_CTLR_PVDE;
+}
+static inline void flash_pvd_enable_interrupt() {
+    // PVDO rises when the supply drops below the threshold.
+    EXTI->RTENR |= EXTI_Line8;
+    EXTI->INTENR |= EXTI_Line8;
+    NVIC_EnableIRQ(PVD_IRQn);
+}
+static inline FLASH_RAM_INLINE uint8_t flash_supply_is_ok() {
+    // PVDO is only meaningful while the detector is enabled.
+    return !(PWR->CTLR & PWR_CTLR_PVDE) || !(PWR->CSR & PWR_CSR_PVDO);
+}
+static inline void flash_request_abort() {
+    flash_abort_requested = 1;
+}
+static inline void flash_clear_abort() {
+    flash_abort_requested = 0;
 }
 static inline void flash_program_2x8_bits(uint32_t addr, uint8_t byte1, uint8_t byte0) {
     // Combines two 8-bit values into a 16-bit value and programs it into flash at the specified address.
@@ -410,38 +1182,32 @@ static inline float flash_read_float_value(uint32_t addr) {
     // Return the combined float value.
     return conv.f;
 }
+static inline FLASH_RAM_INLINE uint8_t flash_is_page_erased(uint32_t addr) {
+    // Compare a word at a time, the page is word aligned.
+    const uint32_t *word = (const uint32_t*)(uintptr_t)addr;
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 4; n++) {
+        if(word[n] != 0xFFFFFFFF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+static inline FLASH_RAM_INLINE uint16_t flash_crc16(uint16_t crc, const void *data, uint16_t length) {
+    const uint8_t *byte = (const uint8_t*)data;
+    // Bitwise, polynomial 0x1021: no table to spend flash on.
+    for(uint16_t n = 0; n < length; n++) {
+        crc ^= (uint16_t)byte[n] << 8;
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
 static inline void flash_write_option_byte_16_bits(uint16_t data) {
     // Wait until the flash is not busy before starting any operation.
     flash_wait_until_not_busy();
-    // Backup current option bytes data.
-    uint16_t tmp_user = OB->USER; 
-    uint16_t tmp_rdpr = OB->RDPR; 
-    uint16_t tmp_wrpr1 = OB->WRPR1; 
-    uint16_t tmp_wrpr0 = OB->WRPR0; 
-    // Split the 16-bit data into two 8-bit values.
-    uint16_t tmp_data1 = (data >> 8) & 0xFF;
-    uint16_t tmp_data0 = data & 0xFF;
-    // Erase the current option bytes.
-    flash_OB_erase();
-    // Enable option byte programming.
-    FLASH->CTLR |= CR_OPTPG_Set;
-    // Restore the backup data to option bytes.
-    OB->USER = tmp_user; 
-    flash_wait_until_not_busy();
-    OB->RDPR = tmp_rdpr;
-    flash_wait_until_not_busy();
-    OB->WRPR0 = tmp_wrpr0;
-    flash_wait_until_not_busy();
-    OB->WRPR1 = tmp_wrpr1;
-    flash_wait_until_not_busy();
-    // Write the new data to option bytes.
-    OB->Data1 = tmp_data1; // High byte
-    flash_wait_until_not_busy();
-    OB->Data0 = tmp_data0; // Low byte
-    flash_wait_until_not_busy();
-    
-    // Disable option byte programming.
-    FLASH->CTLR &= CR_OPTPG_Reset;
+    // Rewrite the option bytes, keeping the current USER, RDPR and write protection.
+    flash_OB_program(OB->USER, OB->RDPR, flash_read_option_byte_WRPR_16(), data);
 }
 static inline void flash_write_option_byte_2x8_bits(uint8_t data1, uint8_t data0) {
 	flash_write_option_byte_16_bits((data1<<8)+data0);
@@ -467,8 +1233,37 @@ static inline uint8_t flash_read_option_byte_DATA0() {
 static inline uint16_t flash_read_option_byte_DATA_16() {
 	return (flash_read_option_byte_DATA1()<<8)+flash_read_option_byte_DATA0();
 }
+static inline uint16_t flash_read_option_byte_WRPR_16() {
+	// The raw bytes are used without dechecksum, an erased WRPR (0xFF) must read as unprotected.
+	return (uint16_t)~(((OB->WRPR1 & 0xFF)<<8) | (OB->WRPR0 & 0xFF));
+}
+static inline uint16_t flash_calculate_WRPR_sector_mask(uint32_t start_addr, uint32_t length) {
+    // An empty range covers no sectors.
+    if(length == 0) {
+        return 0;
+    }
+    // Find the first and last sector touched by the range.
+    uint32_t first = (start_addr - FLASH_BASE) / FLASH_WRPR_SECTOR_SIZE;
+    uint32_t last = (start_addr - FLASH_BASE + length - 1) / FLASH_WRPR_SECTOR_SIZE;
+    // Set one bit per sector from first to last.
+    return (uint16_t)(((2UL << last) - 1) & ~((1UL << first) - 1));
+}
+static inline void flash_write_protect_sectors(uint16_t sector_mask) {
+    flash_wait_until_not_busy();
+    // Add the sectors to the protection and rewrite all option bytes in one update, keeping the raw data bytes.
+    flash_OB_program(OB->USER, OB->RDPR, flash_read_option_byte_WRPR_16() | sector_mask, ((OB->Data1 & 0xFF)<<8) | (OB->Data0 & 0xFF));
+}
+static inline void flash_write_unprotect_sectors(uint16_t sector_mask) {
+    flash_wait_until_not_busy();
+    // Remove the sectors from the protection and rewrite all option bytes in one update, keeping the raw data bytes.
+    flash_OB_program(OB->USER, OB->RDPR, flash_read_option_byte_WRPR_16() & ~sector_mask, ((OB->Data1 & 0xFF)<<8) | (OB->Data0 & 0xFF));
+}
+static inline uint8_t flash_is_write_protected(uint32_t addr) {
+    // WPR holds the protection loaded at reset, a cleared bit means protected.
+    return !(FLASH->WPR & (1UL << ((addr - FLASH_BASE) / FLASH_WRPR_SECTOR_SIZE)));
+}
 // Internal Function Definitions.
-static inline uint8_t flash_is_busy() {
+static inline FLASH_RAM_INLINE uint8_t flash_is_busy() {
 	return ((FLASH->STATR & FLASH_STATR_BSY) == FLASH_STATR_BSY);
 }
 static inline uint8_t flash_is_done() {
@@ -478,10 +1273,45 @@ static inline uint8_t flash_is_ERR_WRPRT() {
 	return ((FLASH->STATR & FLASH_STATR_WRPRTERR) == FLASH_STATR_WRPRTERR);
 }
 static inline void flash_is_done_clear() {
-	FLASH->STATR |= FLASH_STATR_EOP;
+	// Write only EOP, a read-modify-write would also clear a pending WRPRTERR.
+	FLASH->STATR = FLASH_STATR_EOP;
+}
+static inline FLASH_RAM_INLINE void flash_clear_status_flags() {
+	FLASH->STATR = FLASH_STATR_EOP | FLASH_STATR_WRPRTERR;
 }
-static inline void flash_wait_until_not_busy() {
+static inline FLASH_RAM_INLINE void flash_wait_until_not_busy() {
+	#ifdef FLASH_USE_COUNTERS
+	// Only time the wait if there is one, the common idle case stays a single status read.
+	if(flash_is_busy()) {
+		uint32_t start = SysTick->CNT;
+		while(flash_is_busy()) {}
+		flash_counters.busy_wait_ticks += SysTick->CNT - start;
+	}
+	#else
 	while(flash_is_busy()) {}
+	#endif
+}
+static inline FLASH_RAM_INLINE uint8_t flash_wait_until_not_busy_timeout(uint32_t ticks) {
+	// The start time is taken once, the loop itself only adds a compare to the spin.
+	uint32_t start = SysTick->CNT;
+	while(flash_is_busy()) {
+		if(SysTick->CNT - start > ticks) {
+			return 0;
+		}
+	}
+	#ifdef FLASH_USE_COUNTERS
+	flash_counters.busy_wait_ticks += SysTick->CNT - start;
+	#endif
+	return 1;
+}
+static inline FLASH_RAM_INLINE uint8_t flash_wait_for_result() {
+	if(!flash_wait_until_not_busy_timeout(FLASH_TIMEOUT_TICKS)) {
+		return FLASH_STATUS_TIMEOUT;
+	}
+	// The controller flags WRPRTERR instead of EOP when it rejects an operation.
+	uint8_t status = flash_is_ERR_WRPRT() ? FLASH_STATUS_WRITE_PROTECTED : FLASH_STATUS_OK;
+	flash_clear_status_flags();
+	return status;
 }
 static inline void flash_wait_until_done() {
 	while(flash_is_busy() || !flash_is_done()) {}
@@ -502,6 +1332,7 @@ static inline uint8_t flash_dechecksum(uint16_t input) {
     }
 }
 static inline void flash_OB_erase() {
+    FLASH_OP_START();
     // Set the option byte erase bit in the flash control register.
     // This prepares the flash controller to erase the option bytes.
     FLASH->CTLR |= CR_OPTER_Set;
@@ -512,5 +1343,102 @@ static inline void flash_OB_erase() {
     flash_wait_until_not_busy();
     // Reset the option byte erase bit to stop the erase operation.
     FLASH->CTLR &= CR_OPTER_Reset;
+    FLASH_OP_END(FLASH_OP_OB_ERASE, (uint32_t)(uintptr_t)OB, 16, flash_is_ERR_WRPRT() ? FLASH_STATUS_WRITE_PROTECTED : FLASH_STATUS_OK);
+}
+static inline void flash_OB_program(uint16_t user, uint16_t rdpr, uint16_t wrpr_mask, uint16_t data) {
+    // Erase the current option bytes.
+    flash_OB_erase();
+    FLASH_OP_START();
+    // Enable option byte programming.
+    FLASH->CTLR |= CR_OPTPG_Set;
+    // Restore USER and RDPR as they were backed up.
+    OB->USER = user;
+    flash_wait_until_not_busy();
+    OB->RDPR = rdpr;
+    flash_wait_until_not_busy();
+    // Program the write protection, a cleared bit protects the sector.
+    OB->WRPR0 = (uint8_t)~wrpr_mask;
+    flash_wait_until_not_busy();
+    OB->WRPR1 = (uint8_t)~(wrpr_mask >> 8);
+    flash_wait_until_not_busy();
+    // Write the data bytes.
+    OB->Data1 = (data >> 8) & 0xFF; // High byte
+    flash_wait_until_not_busy();
+    OB->Data0 = data & 0xFF; // Low byte
+    flash_wait_until_not_busy();
+    // Disable option byte programming.
+    FLASH->CTLR &= CR_OPTPG_Reset;
+    FLASH_OP_END(FLASH_OP_OB_PROGRAM, (uint32_t)(uintptr_t)OB, 12, flash_is_ERR_WRPRT() ? FLASH_STATUS_WRITE_PROTECTED : FLASH_STATUS_OK);
+}
+#if defined(FLASH_USE_TRACE) || defined(FLASH_USE_COUNTERS)
+static inline FLASH_RAM_INLINE void flash_op_finish(uint8_t op, uint32_t addr, uint16_t length, uint32_t start, uint8_t status) {
+    uint32_t end = SysTick->CNT;
+    #ifdef FLASH_USE_COUNTERS
+    // Count the operation by type and keep the slowest one.
+    if(op == FLASH_OP_ERASE_PAGE) {
+        flash_counters.erases++;
+    } else if(op == FLASH_OP_PROGRAM_16) {
+        flash_counters.programs++;
+    } else if(op == FLASH_OP_PROGRAM_PAGE) {
+        flash_counters.programs += length / 2;
+    } else if(op == FLASH_OP_OB_PROGRAM) {
+        flash_counters.option_byte_writes++;
+    }
+    if(end - start > flash_counters.worst_op_ticks) {
+        flash_counters.worst_op_ticks = end - start;
+    }
+    #endif
+    #ifdef FLASH_USE_TRACE
+    flash_trace_record(op, addr, length, start, end, status);
+    #else
+    (void)addr;
+    (void)length;
+    (void)status;
+    #endif
+}
+#endif
+#ifdef FLASH_USE_TRACE
+static inline FLASH_RAM_INLINE void flash_trace_record(uint8_t op, uint32_t addr, uint16_t length, uint32_t start, uint32_t end, uint8_t status) {
+    // Pick the slot after the newest entry, wrapping around onto the oldest one.
+    struct flash_trace_entry *entry = &flash_trace_buffer[flash_trace_count % FLASH_TRACE_DEPTH];
+    entry->start = start;
+    entry->end = end;
+    entry->addr = addr;
+    entry->length = length;
+    entry->op = op;
+    entry->status = status;
+    flash_trace_count++;
+}
+static inline void flash_trace_dump() {
+    static const char *const op_names[] = { "erase", "prog16", "ob-erase", "ob-prog", "progpage" };
+    // Start at the oldest entry still held in the buffer.
+    uint32_t first = flash_trace_count > FLASH_TRACE_DEPTH ? flash_trace_count - FLASH_TRACE_DEPTH : 0;
+    printf("flash trace: %lu operations\r\n", (unsigned long)flash_trace_count);
+    for(uint32_t n = first; n < flash_trace_count; n++) {
+        struct flash_trace_entry *entry = &flash_trace_buffer[n % FLASH_TRACE_DEPTH];
+        printf("  %-8s 0x%08lx %3u bytes  start %lu  took %lu ticks  status %u\r\n",
+            op_names[entry->op], (unsigned long)entry->addr, entry->length,
+            (unsigned long)entry->start, (unsigned long)(entry->end - entry->start), entry->status);
+    }
+}
+static inline void flash_trace_clear() {
+    flash_trace_count = 0;
+}
+#else
+static inline void flash_trace_dump() {}
+static inline void flash_trace_clear() {}
+#endif
+#ifdef FLASH_USE_COUNTERS
+static inline void flash_get_counters(struct flash_counters *counters) {
+    *counters = flash_counters;
+}
+static inline void flash_reset_counters() {
+    flash_counters = (struct flash_counters){ 0 };
+}
+#else
+static inline void flash_get_counters(struct flash_counters *counters) {
+    *counters = (struct flash_counters){ 0 };
 }
+static inline void flash_reset_counters() {}
+#endif
 #endif // CH32V003_FLASH_H
@@ -0,0 +1,206 @@
+/**
+ * @file
+ * @brief Erase-free persistent bitset in CH32V003 flash memory.
+ *
+ * This header keeps a large number of persistent flags ("first boot done", "error X seen", "feature unlocked") in one or more pages of main flash.
+ * Each page holds 512 flags.
+ *
+ * @section bitset_usage Usage
+ * Reserve one or more pages at the end of the main flash (see overrides.ld) and describe them in a struct flash_bitset with start_addr and n_pages.
+ * - flash_bitset_set() sets a flag with a single half-word program, no erase.
+ * - flash_bitset_test() and flash_bitset_count() read the flags with word-wide loads.
+ * - flash_bitset_clear() only queues the clear in RAM. The queued clears are applied by flash_bitset_commit(), which rewrites each affected page once.
+ *   The queue holds FLASH_BITSET_PENDING_MAX clears and is committed automatically when it overflows.
+ * The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section bitset_format On-Flash Format
+ * Flag n is bit (n % 16) of half-word n / 16 from start_addr. An erased bit (1) means clear, a programmed bit (0) means set, so an erased page holds 512 clear flags.
+ * Setting a flag programs its half-word again with one more bit cleared.
+ *
+ * @note A power loss during flash_bitset_commit() can clear any of the flags of the page being rewritten, up to all of them; it never sets a flag.
+ */
+#ifndef CH32V003_FLASH_BITSET_H
+#define CH32V003_FLASH_BITSET_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#ifndef FLASH_BITSET_PENDING_MAX
+#define FLASH_BITSET_PENDING_MAX 8 // clears queued in RAM before a commit is forced
+#endif
+#define FLASH_BITSET_FLAGS_PER_PAGE (FLASH_PAGE_SIZE * 8)
+/**
+ * @brief A bitset partition and its queued clears.
+ *
+ * start_addr and n_pages describe the partition, the other fields start out zero.
+ */
+struct flash_bitset {
+	uint32_t start_addr;  // first page of the partition, page aligned
+	uint8_t n_pages;      // number of pages, 512 flags each
+	uint8_t n_pending;    // number of queued clears
+	uint16_t pending[FLASH_BITSET_PENDING_MAX]; // flags waiting to be cleared by flash_bitset_commit()
+};
+/**
+ * @brief Set a flag.
+ *
+ * This function programs the half-word holding the flag with its bit cleared. Setting a flag that is already set costs no program.
+ * A queued clear of the same flag is dropped.
+ *
+ * @param bitset The bitset.
+ * @param flag The flag number.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if the flag is out of range or the failed flash status.
+ */
+static inline uint8_t flash_bitset_set(struct flash_bitset *bitset, uint16_t flag);
+/**
+ * @brief Test a flag.
+ *
+ * This function reads the word holding the flag; a queued clear makes the flag read as clear.
+ *
+ * @param bitset The bitset.
+ * @param flag The flag number.
+ * @return uint8_t Non-zero if the flag is set, zero otherwise.
+ */
+static inline uint8_t flash_bitset_test(const struct flash_bitset *bitset, uint16_t flag);
+/**
+ * @brief Count the set flags.
+ *
+ * This function counts with word-wide loads and does not account for queued clears.
+ *
+ * @param bitset The bitset.
+ * @return uint16_t The number of set flags in flash.
+ */
+static inline uint16_t flash_bitset_count(const struct flash_bitset *bitset);
+/**
+ * @brief Queue a flag to be cleared.
+ *
+ * This function only records the flag in RAM. When the queue is full, flash_bitset_commit() is called first.
+ *
+ * @param bitset The bitset.
+ * @param flag The flag number.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if the flag is out of range or the failed status of the forced commit.
+ */
+static inline uint8_t flash_bitset_clear(struct flash_bitset *bitset, uint16_t flag);
+/**
+ * @brief Apply the queued clears.
+ *
+ * This function rewrites every page with queued clears once: the page is copied to RAM, the flags are cleared in the copy, the page is erased and the set flags are programmed back.
+ *
+ * @param bitset The bitset.
+ * @return uint8_t FLASH_STATUS_OK or the failed flash status; the clears of the failed page and of pages not rewritten yet stay queued.
+ */
+static inline uint8_t flash_bitset_commit(struct flash_bitset *bitset);
+// Internal Function Declarations
+/**
+ * @brief Return the index of a queued clear of the flag, or n_pending if there is none.
+ */
+static inline uint8_t flash_bitset_find_pending(const struct flash_bitset *bitset, uint16_t flag);
+/**
+ * @brief Rewrite one page with the queued clears that fall into it and drop them from the queue.
+ */
+static inline uint8_t flash_bitset_rewrite_page(struct flash_bitset *bitset, uint8_t page);
+// Function Definitions
+static inline uint8_t flash_bitset_find_pending(const struct flash_bitset *bitset, uint16_t flag) {
+    uint8_t n = 0;
+    while(n < bitset->n_pending && bitset->pending[n] != flag) {
+        n++;
+    }
+    return n;
+}
+static inline uint8_t flash_bitset_set(struct flash_bitset *bitset, uint16_t flag) {
+    if(flag >= (uint32_t)bitset->n_pages * FLASH_BITSET_FLAGS_PER_PAGE) {
+        return FLASH_STATUS_INVALID;
+    }
+    // A set cancels a clear that has not been committed yet.
+    uint8_t n = flash_bitset_find_pending(bitset, flag);
+    if(n < bitset->n_pending) {
+        bitset->pending[n] = bitset->pending[--bitset->n_pending];
+    }
+    uint32_t addr = bitset->start_addr + (flag / 16) * 2;
+    uint16_t half = flash_read_16_bits(addr);
+    // Already set, nothing to program.
+    if(!(half & (1 << (flag % 16)))) {
+        return FLASH_STATUS_OK;
+    }
+    flash_session_begin();
+    uint8_t status = flash_program_16_checked(addr, half & ~(1 << (flag % 16)));
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_bitset_test(const struct flash_bitset *bitset, uint16_t flag) {
+    if(flag >= (uint32_t)bitset->n_pages * FLASH_BITSET_FLAGS_PER_PAGE) {
+        return 0;
+    }
+    // A queued clear wins over what is still in flash.
+    if(bitset->n_pending && flash_bitset_find_pending(bitset, flag) < bitset->n_pending) {
+        return 0;
+    }
+    const uint32_t *word = (const uint32_t*)(uintptr_t)bitset->start_addr;
+    return !(word[flag / 32] & (1UL << (flag % 32)));
+}
+static inline uint16_t flash_bitset_count(const struct flash_bitset *bitset) {
+    const uint32_t *word = (const uint32_t*)(uintptr_t)bitset->start_addr;
+    uint16_t count = 0;
+    for(uint16_t n = 0; n < (uint16_t)bitset->n_pages * (FLASH_PAGE_SIZE / 4); n++) {
+        // Set flags are the programmed (zero) bits.
+        count += __builtin_popcount(~word[n]);
+    }
+    return count;
+}
+static inline uint8_t flash_bitset_clear(struct flash_bitset *bitset, uint16_t flag) {
+    if(flag >= (uint32_t)bitset->n_pages * FLASH_BITSET_FLAGS_PER_PAGE) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Clearing a clear flag or queueing it twice costs nothing.
+    if(!flash_bitset_test(bitset, flag)) {
+        return FLASH_STATUS_OK;
+    }
+    if(bitset->n_pending == FLASH_BITSET_PENDING_MAX) {
+        uint8_t status = flash_bitset_commit(bitset);
+        if(status != FLASH_STATUS_OK) {
+            return status;
+        }
+    }
+    bitset->pending[bitset->n_pending++] = flag;
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_bitset_rewrite_page(struct flash_bitset *bitset, uint8_t page) {
+    uint32_t addr = bitset->start_addr + (uint32_t)page * FLASH_PAGE_SIZE;
+    uint16_t copy[FLASH_PAGE_SIZE / 2];
+    // Copy the page and clear the queued flags of this page in the copy.
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 2; n++) {
+        copy[n] = flash_read_16_bits(addr + n * 2);
+    }
+    for(uint8_t n = 0; n < bitset->n_pending; n++) {
+        uint16_t flag = bitset->pending[n];
+        if(flag / FLASH_BITSET_FLAGS_PER_PAGE == page) {
+            copy[(flag % FLASH_BITSET_FLAGS_PER_PAGE) / 16] |= 1 << (flag % 16);
+        }
+    }
+    // Erase and program back the half-words that still hold set flags; erased ones are skipped by flash_program_16_checked().
+    uint8_t status = flash_erase_page_checked(addr);
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 2 && status == FLASH_STATUS_OK; n++) {
+        status = flash_program_16_checked(addr + n * 2, copy[n]);
+    }
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    // The page now holds the clears, drop them from the queue.
+    uint8_t n = 0;
+    while(n < bitset->n_pending) {
+        if(bitset->pending[n] / FLASH_BITSET_FLAGS_PER_PAGE == page) {
+            bitset->pending[n] = bitset->pending[--bitset->n_pending];
+        } else {
+            n++;
+        }
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_bitset_commit(struct flash_bitset *bitset) {
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    // Each rewrite takes all queued clears of its page, so the queue empties page by page.
+    while(bitset->n_pending && status == FLASH_STATUS_OK) {
+        status = flash_bitset_rewrite_page(bitset, bitset->pending[0] / FLASH_BITSET_FLAGS_PER_PAGE);
+    }
+    flash_session_end();
+    return status;
+}
+#endif // CH32V003_FLASH_BITSET_H
@@ -0,0 +1,177 @@
+/**
+ * @file
+ * @brief Default values served from code flash with sparse overrides in the reserved region.
+ *
+ * On a fresh unit the reserved region is erased and reads 0xFFFF (or NaN for floats). Instead of writing the defaults on first boot,
+ * this header keeps them in a const image in .rodata with the same layout as the region, and the reads fall back to the image
+ * wherever the region is still erased. Only values that differ from their default are ever written, so most units never erase the region.
+ *
+ * @section defaults_usage Usage
+ * Describe the defaults as an array of half-words where entry n holds the default of byte offset 2n, i.e. the same offsets you pass to
+ * flash_calculate_runtime_address(). tools/flash_image.py writes this array from the settings description with --defaults-header.
+ * - flash_defaults_read_16() and flash_defaults_read_float() return the stored value, or the default when nothing is stored.
+ * - flash_defaults_write_16() and flash_defaults_write_float() store an override. Writing the default value removes the override again.
+ * The write functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @note An image entry of 0xFFFF means "no default", the region is then read as is.
+ * @note A value that is stored erased (0xFFFF, or 0xFFFFFFFF for floats) reads as the default, so it can only be stored where it is the default.
+ */
+#ifndef CH32V003_FLASH_DEFAULTS_H
+#define CH32V003_FLASH_DEFAULTS_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#define FLASH_DEFAULTS_ERASED 0xFFFF
+/**
+ * @brief The reserved region and its defaults image.
+ */
+struct flash_defaults {
+	uint32_t start_addr;    // start of the region, see FLASH_PRECALCULATE_NONVOLATILE_ADDR(0)
+	const uint16_t *image;  // defaults, entry n for byte offset 2n
+	uint16_t length;        // number of entries in image
+};
+/**
+ * @brief Read a 16-bit value.
+ *
+ * @param defaults The region and its defaults.
+ * @param offset The byte offset of the value, even.
+ * @return uint16_t The stored value, or the default if none is stored.
+ */
+static inline uint16_t flash_defaults_read_16(const struct flash_defaults *defaults, uint16_t offset);
+/**
+ * @brief Read a float value.
+ *
+ * @param defaults The region and its defaults.
+ * @param offset The byte offset of the value, even.
+ * @return float The stored value, or the default if neither half-word is stored.
+ */
+static inline float flash_defaults_read_float(const struct flash_defaults *defaults, uint16_t offset);
+/**
+ * @brief Write a 16-bit value.
+ *
+ * This function programs the value if its half-word is still erased. Otherwise, or when the default is written back, the page is copied
+ * to RAM, erased and programmed back with the new value.
+ * @note The region has no spare page to program the copy into first: a power loss between the erase and the end of the program drops
+ *       the other overrides of that page back to their defaults.
+ *
+ * @param defaults The region and its defaults.
+ * @param offset The byte offset of the value, even.
+ * @param data The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for 0xFFFF that is not the default or the failed flash status.
+ */
+static inline uint8_t flash_defaults_write_16(const struct flash_defaults *defaults, uint16_t offset, uint16_t data);
+/**
+ * @brief Write a float value.
+ *
+ * This function stores both half-words like flash_defaults_write_16(), a float at the end of a page rewrites both pages if needed.
+ * @note A power loss while a page is rewritten drops its other overrides back to their defaults, see flash_defaults_write_16().
+ *
+ * @param defaults The region and its defaults.
+ * @param offset The byte offset of the value, even.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for the all-ones pattern that is not the default or the failed flash status.
+ */
+static inline uint8_t flash_defaults_write_float(const struct flash_defaults *defaults, uint16_t offset, float value);
+// Internal Function Declarations
+/**
+ * @brief Return the default of a half-word, FLASH_DEFAULTS_ERASED if the image does not cover it.
+ */
+static inline uint16_t flash_defaults_get(const struct flash_defaults *defaults, uint16_t offset);
+/**
+ * @brief Store count half-words at offset, where FLASH_DEFAULTS_ERASED removes the override. Rewrites the page only if programming cannot do it.
+ */
+static inline uint8_t flash_defaults_store(const struct flash_defaults *defaults, uint16_t offset, const uint16_t *data, uint8_t count);
+// Function Definitions
+static inline uint16_t flash_defaults_get(const struct flash_defaults *defaults, uint16_t offset) {
+    if(offset / 2 >= defaults->length) {
+        return FLASH_DEFAULTS_ERASED;
+    }
+    return defaults->image[offset / 2];
+}
+static inline uint16_t flash_defaults_read_16(const struct flash_defaults *defaults, uint16_t offset) {
+    uint16_t stored = flash_read_16_bits(defaults->start_addr + offset);
+    if(stored == FLASH_DEFAULTS_ERASED) {
+        return flash_defaults_get(defaults, offset);
+    }
+    return stored;
+}
+static inline float flash_defaults_read_float(const struct flash_defaults *defaults, uint16_t offset) {
+    union float_2xuint16t conv;
+    conv.u16[0] = flash_read_16_bits(defaults->start_addr + offset);
+    conv.u16[1] = flash_read_16_bits(defaults->start_addr + offset + 2);
+    // A float with one erased half-word is a stored value, only a fully erased one falls back.
+    if(conv.u16[0] == FLASH_DEFAULTS_ERASED && conv.u16[1] == FLASH_DEFAULTS_ERASED) {
+        conv.u16[0] = flash_defaults_get(defaults, offset);
+        conv.u16[1] = flash_defaults_get(defaults, offset + 2);
+    }
+    return conv.f;
+}
+static inline uint8_t flash_defaults_store(const struct flash_defaults *defaults, uint16_t offset, const uint16_t *data, uint8_t count) {
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    // One page at a time, a float at the end of a page continues on the next one.
+    while(count && status == FLASH_STATUS_OK) {
+        uint32_t addr = defaults->start_addr + offset;
+        uint32_t page_addr = addr & ~(uint32_t)(FLASH_PAGE_SIZE - 1);
+        uint8_t first = (addr - page_addr) / 2;
+        uint8_t n_page = count < FLASH_PAGE_SIZE / 2 - first ? count : FLASH_PAGE_SIZE / 2 - first;
+        // Check if the half-words can be programmed in place: unchanged or still erased.
+        uint8_t in_place = 1;
+        for(uint8_t n = 0; n < n_page; n++) {
+            uint16_t stored = flash_read_16_bits(addr + n * 2);
+            if(stored != data[n] && stored != FLASH_DEFAULTS_ERASED) {
+                in_place = 0;
+            }
+        }
+        if(in_place) {
+            // Unchanged and erased half-words are skipped by flash_program_16_checked().
+            for(uint8_t n = 0; n < n_page && status == FLASH_STATUS_OK; n++) {
+                status = flash_program_16_checked(addr + n * 2, data[n]);
+            }
+        } else {
+            // Copy the page, put the new values in and program it back after the erase.
+            uint16_t copy[FLASH_PAGE_SIZE / 2];
+            for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 2; n++) {
+                copy[n] = flash_read_16_bits(page_addr + n * 2);
+            }
+            for(uint8_t n = 0; n < n_page; n++) {
+                copy[first + n] = data[n];
+            }
+            status = flash_erase_page_checked(page_addr);
+            for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 2 && status == FLASH_STATUS_OK; n++) {
+                status = flash_program_16_checked(page_addr + n * 2, copy[n]);
+            }
+        }
+        offset += n_page * 2;
+        data += n_page;
+        count -= n_page;
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_defaults_write_16(const struct flash_defaults *defaults, uint16_t offset, uint16_t data) {
+    uint16_t fallback = flash_defaults_get(defaults, offset);
+    if(data == FLASH_DEFAULTS_ERASED && fallback != FLASH_DEFAULTS_ERASED) {
+        return FLASH_STATUS_INVALID;
+    }
+    // The default is stored as an erased half-word, so it is never programmed.
+    if(data == fallback) {
+        data = FLASH_DEFAULTS_ERASED;
+    }
+    return flash_defaults_store(defaults, offset, &data, 1);
+}
+static inline uint8_t flash_defaults_write_float(const struct flash_defaults *defaults, uint16_t offset, float value) {
+    union float_2xuint16t conv;
+    conv.f = value;
+    uint16_t fallback[2] = { flash_defaults_get(defaults, offset), flash_defaults_get(defaults, offset + 2) };
+    uint8_t is_erased = conv.u16[0] == FLASH_DEFAULTS_ERASED && conv.u16[1] == FLASH_DEFAULTS_ERASED;
+    if(is_erased && (fallback[0] != FLASH_DEFAULTS_ERASED || fallback[1] != FLASH_DEFAULTS_ERASED)) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Compare the bit patterns, not the floats, so -0.0 and NaN defaults work as well.
+    if(conv.u16[0] == fallback[0] && conv.u16[1] == fallback[1]) {
+        conv.u16[0] = FLASH_DEFAULTS_ERASED;
+        conv.u16[1] = FLASH_DEFAULTS_ERASED;
+    }
+    return flash_defaults_store(defaults, offset, conv.u16, 2);
+}
+#endif // CH32V003_FLASH_DEFAULTS_H
@@ -0,0 +1,131 @@
+/**
+ * @file
+ * @brief DMA-assisted bulk copies from CH32V003 flash memory into RAM.
+ *
+ * This header copies a range of the reserved region (tables, calibration data, a saved state) into RAM with a memory-to-memory DMA channel,
+ * so the CPU can go on initialising peripherals at boot instead of copying a half-word at a time with flash_read_16_bits().
+ *
+ * @section dma_usage Usage
+ * 1. Start the copy with flash_dma_copy_start(). It picks word, half-word or byte transfers from the alignment of the addresses and the length.
+ * 2. Do other work.
+ * 3. Poll flash_dma_is_done() or block in flash_dma_wait(). For a completion callback instead, call flash_dma_enable_interrupt() once and
+ *    flash_dma_irq_handler() from the DMA1_ChannelN_IRQHandler of the channel; the callback then runs in interrupt context.
+ *    Once the interrupt is enabled only the handler completes a copy, flash_dma_is_done() just reports it, so the callback runs exactly once.
+ * The channel is FLASH_DMA_CHANNEL (default 3); pick one that no peripheral of the application uses. One copy runs at a time.
+ *
+ * @note Do not erase or program the flash while a copy is running, the DMA reads would stall or see half-written data.
+ */
+#ifndef CH32V003_FLASH_DMA_H
+#define CH32V003_FLASH_DMA_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#ifndef FLASH_DMA_CHANNEL
+#define FLASH_DMA_CHANNEL 3 // DMA1 channel used for the copies, 1 to 7
+#endif
+#define FLASH_DMA_PASTE(a, b, c) a##b##c
+#define FLASH_DMA_EXPAND(a, b, c) FLASH_DMA_PASTE(a, b, c)
+#define FLASH_DMA_CH FLASH_DMA_EXPAND(DMA1_Channel, FLASH_DMA_CHANNEL, )
+#define FLASH_DMA_IRQN FLASH_DMA_EXPAND(DMA1_Channel, FLASH_DMA_CHANNEL, _IRQn)
+#define FLASH_DMA_FLAGS_SHIFT (4 * (FLASH_DMA_CHANNEL - 1)) // each channel has 4 flags in INTFR/INTFCR
+/**
+ * @brief Called when a copy is done.
+ */
+typedef void (*flash_dma_callback_fn)(void *context);
+/**
+ * @brief Start copying from flash into RAM.
+ *
+ * @param dest The RAM destination.
+ * @param src_addr The flash address to copy from.
+ * @param length The number of bytes, at most 65535 transfers.
+ * @param callback Called by flash_dma_irq_handler(), or by flash_dma_is_done() if the interrupt is not enabled, when the copy is done, may be NULL.
+ * @param context Passed to callback.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_INVALID if the length is 0 or too large or a copy is still running.
+ */
+static inline uint8_t flash_dma_copy_start(void *dest, uint32_t src_addr, uint16_t length, flash_dma_callback_fn callback, void *context);
+/**
+ * @brief Check if the copy is done.
+ *
+ * This function also completes the copy (and calls the callback) if the interrupt is not enabled.
+ *
+ * @return uint8_t Non-zero if no copy is running.
+ */
+static inline uint8_t flash_dma_is_done();
+/**
+ * @brief Wait until the copy is done.
+ */
+static inline void flash_dma_wait();
+/**
+ * @brief Enable the transfer complete interrupt of the channel.
+ */
+static inline void flash_dma_enable_interrupt();
+/**
+ * @brief Complete the copy; call this from the DMA1_ChannelN_IRQHandler of FLASH_DMA_CHANNEL.
+ */
+static inline void flash_dma_irq_handler();
+// Internal Function Declarations
+/**
+ * @brief Stop the channel, clear its flags and call the callback.
+ */
+static inline void flash_dma_finish();
+// Internal variables
+static volatile uint8_t flash_dma_running;
+static uint8_t flash_dma_interrupt_enabled; // the handler completes the copies, flash_dma_is_done() leaves them alone
+static flash_dma_callback_fn flash_dma_callback;
+static void *flash_dma_context;
+// Function Definitions
+static inline uint8_t flash_dma_copy_start(void *dest, uint32_t src_addr, uint16_t length, flash_dma_callback_fn callback, void *context) {
+    if(flash_dma_running || length == 0) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Use the widest transfer the alignment of both ends and the length allow.
+    uint32_t alignment = (uint32_t)(uintptr_t)dest | src_addr | length;
+    uint32_t size = 0;
+    uint16_t count = length;
+    if(!(alignment & 3)) {
+        size = DMA_CFGR1_PSIZE_1 | DMA_CFGR1_MSIZE_1;
+        count = length / 4;
+    } else if(!(alignment & 1)) {
+        size = DMA_CFGR1_PSIZE_0 | DMA_CFGR1_MSIZE_0;
+        count = length / 2;
+    }
+    flash_dma_callback = callback;
+    flash_dma_context = context;
+    flash_dma_running = 1;
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+    // In memory-to-memory mode the "peripheral" side is the source.
+    FLASH_DMA_CH->CFGR = 0;
+    DMA1->INTFCR = (DMA_GIF1 | DMA_TCIF1 | DMA_HTIF1 | DMA_TEIF1) << FLASH_DMA_FLAGS_SHIFT;
+    FLASH_DMA_CH->PADDR = src_addr;
+    FLASH_DMA_CH->MADDR = (uint32_t)(uintptr_t)dest;
+    FLASH_DMA_CH->CNTR = count;
+    FLASH_DMA_CH->CFGR = DMA_CFGR1_MEM2MEM | DMA_CFGR1_PL | DMA_CFGR1_PINC | DMA_CFGR1_MINC | size | DMA_CFGR1_TCIE | DMA_CFGR1_EN;
+    return FLASH_STATUS_OK;
+}
+static inline void flash_dma_finish() {
+    FLASH_DMA_CH->CFGR = 0;
+    DMA1->INTFCR = (DMA_GIF1 | DMA_TCIF1 | DMA_HTIF1 | DMA_TEIF1) << FLASH_DMA_FLAGS_SHIFT;
+    flash_dma_running = 0;
+    if(flash_dma_callback) {
+        flash_dma_callback(flash_dma_context);
+    }
+}
+static inline uint8_t flash_dma_is_done() {
+    // With the interrupt enabled the handler completes the copy: checking and finishing here could race with it and finish twice.
+    if(!flash_dma_interrupt_enabled && flash_dma_running && (DMA1->INTFR & (DMA_TCIF1 << FLASH_DMA_FLAGS_SHIFT))) {
+        flash_dma_finish();
+    }
+    return !flash_dma_running;
+}
+static inline void flash_dma_wait() {
+    while(!flash_dma_is_done()) {}
+}
+static inline void flash_dma_enable_interrupt() {
+    flash_dma_interrupt_enabled = 1;
+    NVIC_EnableIRQ(FLASH_DMA_IRQN);
+}
+static inline void flash_dma_irq_handler() {
+    if(flash_dma_running && (DMA1->INTFR & (DMA_TCIF1 << FLASH_DMA_FLAGS_SHIFT))) {
+        flash_dma_finish();
+    }
+}
+#endif // CH32V003_FLASH_DMA_H
@@ -0,0 +1,339 @@
+/**
+ * @file
+ * @brief Persistent FIFO queue in CH32V003 flash memory.
+ *
+ * This header implements a first-in first-out queue of small records kept in a partition of main flash.
+ * It is meant for data that has to survive a reboot until it was handled, e.g. telemetry messages waiting for the radio link to acknowledge them.
+ *
+ * @section fifo_usage Usage
+ * Reserve a partition of at least two pages at the end of the main flash (see overrides.ld) and describe it in a struct flash_fifo:
+ * 1. Set start_addr and n_pages, then call flash_fifo_mount() once during boot to find the head and the tail.
+ * 2. flash_fifo_push() appends a record of up to FLASH_FIFO_MAX_RECORD bytes.
+ * 3. flash_fifo_peek() copies the oldest record, flash_fifo_pop() marks it consumed once it was handled.
+ * 4. Optionally call flash_fifo_reclaim() when idle to erase fully consumed pages ahead of time.
+ * The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section fifo_format On-Flash Format
+ * Pages are used as a ring. Each page starts with a 4-byte header followed by records:
+ * - Page header: half-word 0 holds the page sequence number, half-word 1 the page state (0xFFFF while in use, 0x0000 once every record was consumed).
+ * - Record: a header half-word followed by the data, padded to a half-word. The header holds the length in bits 0-7; bit 15 is cleared when the record is written and bit 14 is cleared when it is consumed.
+ *
+ * The data is programmed before the record header, so a record cut short by a power loss never looks valid.
+ * Popping a record only clears a bit in its header, no erase is involved. A page is erased once every record in it was consumed and the space is needed again.
+ * At boot, flash_fifo_mount() reads the page headers to find the oldest and the newest page and only walks the records of those two pages.
+ *
+ * @note Clearing additional bits of an already programmed half-word relies on programming it a second time; the bits that are already cleared stay cleared.
+ */
+#ifndef CH32V003_FLASH_FIFO_H
+#define CH32V003_FLASH_FIFO_H
+#include "ch32v003_flash.h"
+/**
+ * @brief A FIFO partition and its runtime state.
+ *
+ * start_addr and n_pages describe the partition, the remaining fields are set by flash_fifo_mount().
+ */
+struct flash_fifo {
+	uint32_t start_addr;  // first page of the partition, page aligned
+	uint8_t n_pages;      // number of pages, at least 2
+	uint8_t head_page;    // page holding the oldest unconsumed record
+	uint8_t head_offset;  // byte offset of that record within its page
+	uint8_t tail_page;    // page receiving the next record
+	uint8_t tail_offset;  // byte offset of the next record, FLASH_PAGE_SIZE once the page is closed
+	uint16_t next_seq;    // sequence number of the next page opened
+};
+/**
+ * @brief Recover the FIFO state from flash.
+ *
+ * This function scans the page headers for the oldest and newest page in use and walks the records of those two pages only.
+ * A record found half-written at the tail closes that page, so the next push starts on a fresh page.
+ *
+ * @param fifo The FIFO with start_addr and n_pages set.
+ */
+static inline void flash_fifo_mount(struct flash_fifo *fifo);
+/**
+ * @brief Append a record to the FIFO.
+ *
+ * This function programs the record at the tail, opening (and if needed erasing) the next page when the current one is full.
+ *
+ * @param fifo The mounted FIFO.
+ * @param data The record data.
+ * @param length The record length in bytes, 1 to FLASH_FIFO_MAX_RECORD.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_FULL if the oldest page still holds unconsumed records, FLASH_STATUS_INVALID for a bad length or the failed flash status.
+ */
+static inline uint8_t flash_fifo_push(struct flash_fifo *fifo, const void *data, uint8_t length);
+/**
+ * @brief Copy the oldest record without consuming it.
+ *
+ * @param fifo The mounted FIFO.
+ * @param data Where to copy the record to.
+ * @param max_length The size of the data buffer; longer records are truncated.
+ * @return uint8_t The length of the record, zero if the FIFO is empty.
+ */
+static inline uint8_t flash_fifo_peek(struct flash_fifo *fifo, void *data, uint8_t max_length);
+/**
+ * @brief Consume the oldest record.
+ *
+ * This function clears the consumed bit in the record header. When the last record of a page is consumed, the page is marked consumed as well.
+ *
+ * @param fifo The mounted FIFO.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_EMPTY or the failed flash status.
+ */
+static inline uint8_t flash_fifo_pop(struct flash_fifo *fifo);
+/**
+ * @brief Check if the FIFO holds no unconsumed records.
+ *
+ * @param fifo The mounted FIFO.
+ * @return uint8_t Non-zero if the FIFO is empty, zero otherwise.
+ */
+static inline uint8_t flash_fifo_is_empty(const struct flash_fifo *fifo);
+/**
+ * @brief Erase fully consumed pages.
+ *
+ * This function erases every page marked consumed, so later pushes do not have to wait for an erase.
+ *
+ * @param fifo The mounted FIFO.
+ * @return uint8_t The number of pages erased.
+ */
+static inline uint8_t flash_fifo_reclaim(struct flash_fifo *fifo);
+// Internal Function Declarations
+/**
+ * @brief Return the address of a FIFO page.
+ */
+static inline uint32_t flash_fifo_page_addr(const struct flash_fifo *fifo, uint8_t page);
+/**
+ * @brief Walk the records of a page.
+ *
+ * @param addr The page address.
+ * @param offset The record offset to start at.
+ * @param live_only Non-zero to stop at the first unconsumed record, zero to walk to the end of the records.
+ * @return uint8_t The offset of the record found, or of the first blank header, or FLASH_PAGE_SIZE.
+ */
+static inline uint8_t flash_fifo_walk(uint32_t addr, uint8_t offset, uint8_t live_only);
+/**
+ * @brief Open the page after the tail for writing.
+ *
+ * @param fifo The mounted FIFO.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_FULL or the failed flash status.
+ */
+static inline uint8_t flash_fifo_open_page(struct flash_fifo *fifo);
+// Preprocessor Macros
+#define FLASH_FIFO_HEADER_SIZE 4
+#define FLASH_FIFO_MAX_RECORD (FLASH_PAGE_SIZE - FLASH_FIFO_HEADER_SIZE - 2)
+#define FLASH_FIFO_PAGE_CONSUMED 0x0000
+#define FLASH_FIFO_REC_WRITTEN 0x8000 // cleared when the record is written
+#define FLASH_FIFO_REC_LIVE 0x4000    // cleared when the record is consumed
+#define FLASH_FIFO_REC_LENGTH 0x00FF
+// Size of a record including its header, data padded to a half-word.
+#define FLASH_FIFO_REC_SIZE(length) (2 + (((length) + 1) & ~1))
+// Function Definitions
+static inline uint32_t flash_fifo_page_addr(const struct flash_fifo *fifo, uint8_t page) {
+    return fifo->start_addr + (uint32_t)page * FLASH_PAGE_SIZE;
+}
+static inline uint8_t flash_fifo_walk(uint32_t addr, uint8_t offset, uint8_t live_only) {
+    while(offset + 2 <= FLASH_PAGE_SIZE) {
+        uint16_t header = flash_read_16_bits(addr + offset);
+        // A blank header marks the end of the records.
+        if(header == 0xFFFF) {
+            return offset;
+        }
+        // Stop at the first unconsumed record if asked to.
+        if(live_only && (header & FLASH_FIFO_REC_LIVE)) {
+            return offset;
+        }
+        offset += FLASH_FIFO_REC_SIZE(header & FLASH_FIFO_REC_LENGTH);
+    }
+    return FLASH_PAGE_SIZE;
+}
+static inline void flash_fifo_mount(struct flash_fifo *fifo) {
+    uint8_t newest = 0xFF;
+    uint8_t oldest = 0xFF;
+    uint16_t newest_seq = 0;
+    uint16_t oldest_seq = 0;
+    // Scan the page headers only: the newest page is the tail, the oldest unconsumed page the head.
+    for(uint8_t page = 0; page < fifo->n_pages; page++) {
+        uint32_t addr = flash_fifo_page_addr(fifo, page);
+        uint16_t seq = flash_read_16_bits(addr);
+        if(seq == 0xFFFF) {
+            continue;
+        }
+        // Sequence numbers wrap, so compare their difference.
+        if(newest == 0xFF || (int16_t)(seq - newest_seq) > 0) {
+            newest = page;
+            newest_seq = seq;
+        }
+        if(flash_read_16_bits(addr + 2) != FLASH_FIFO_PAGE_CONSUMED && (oldest == 0xFF || (int16_t)(seq - oldest_seq) < 0)) {
+            oldest = page;
+            oldest_seq = seq;
+        }
+    }
+    if(newest == 0xFF) {
+        // Nothing written yet: the first push opens page 0.
+        fifo->tail_page = fifo->n_pages - 1;
+        fifo->tail_offset = FLASH_PAGE_SIZE;
+        fifo->head_page = fifo->tail_page;
+        fifo->head_offset = fifo->tail_offset;
+        fifo->next_seq = 0;
+        return;
+    }
+    fifo->next_seq = (newest_seq + 1 == 0xFFFF) ? 0 : newest_seq + 1;
+    // Find where the next record goes in the tail page.
+    uint32_t tail_addr = flash_fifo_page_addr(fifo, newest);
+    uint8_t tail_offset = flash_fifo_walk(tail_addr, FLASH_FIFO_HEADER_SIZE, 0);
+    // Data behind the last header belongs to a push cut short, close the page rather than programming over it.
+    for(uint8_t offset = tail_offset; offset < FLASH_PAGE_SIZE; offset += 2) {
+        if(flash_read_16_bits(tail_addr + offset) != 0xFFFF) {
+            tail_offset = FLASH_PAGE_SIZE;
+            break;
+        }
+    }
+    fifo->tail_page = newest;
+    fifo->tail_offset = tail_offset;
+    // Find the oldest unconsumed record, moving past pages whose records were all consumed before the page was marked.
+    fifo->head_page = (oldest == 0xFF) ? newest : oldest;
+    while(1) {
+        uint32_t head_addr = flash_fifo_page_addr(fifo, fifo->head_page);
+        fifo->head_offset = flash_fifo_walk(head_addr, FLASH_FIFO_HEADER_SIZE, 1);
+        if(fifo->head_page == fifo->tail_page) {
+            // The head caught up with the tail within the tail page.
+            if(fifo->head_offset > fifo->tail_offset || flash_read_16_bits(head_addr + fifo->head_offset) == 0xFFFF) {
+                fifo->head_offset = fifo->tail_offset;
+            }
+            break;
+        }
+        if(fifo->head_offset < FLASH_PAGE_SIZE && flash_read_16_bits(head_addr + fifo->head_offset) != 0xFFFF) {
+            break;
+        }
+        fifo->head_page = (fifo->head_page + 1) % fifo->n_pages;
+    }
+}
+static inline uint8_t flash_fifo_is_empty(const struct flash_fifo *fifo) {
+    return fifo->head_page == fifo->tail_page && fifo->head_offset == fifo->tail_offset;
+}
+static inline uint8_t flash_fifo_open_page(struct flash_fifo *fifo) {
+    uint8_t page = (fifo->tail_page + 1) % fifo->n_pages;
+    uint8_t was_empty = flash_fifo_is_empty(fifo);
+    // The next page still holds records that were not consumed.
+    if(!was_empty && page == fifo->head_page) {
+        return FLASH_STATUS_FULL;
+    }
+    uint32_t addr = flash_fifo_page_addr(fifo, page);
+    uint32_t tail_addr = flash_fifo_page_addr(fifo, fifo->tail_page);
+    // Leaving a tail page whose records were all consumed: mark it so the mount scan skips it.
+    if(was_empty && flash_read_16_bits(tail_addr) != 0xFFFF && flash_read_16_bits(tail_addr + 2) != FLASH_FIFO_PAGE_CONSUMED) {
+        uint8_t status = flash_program_16_checked(tail_addr + 2, FLASH_FIFO_PAGE_CONSUMED);
+        if(status != FLASH_STATUS_OK) {
+            return status;
+        }
+    }
+    // Erase consumed or leftover pages before reuse.
+    if(!flash_is_page_erased(addr)) {
+        uint8_t status = flash_erase_page_checked(addr);
+        if(status != FLASH_STATUS_OK) {
+            return status;
+        }
+    }
+    uint8_t status = flash_program_16_checked(addr, fifo->next_seq);
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    fifo->next_seq = (fifo->next_seq + 1 == 0xFFFF) ? 0 : fifo->next_seq + 1;
+    fifo->tail_page = page;
+    fifo->tail_offset = FLASH_FIFO_HEADER_SIZE;
+    // An empty FIFO has its head at the tail.
+    if(was_empty) {
+        fifo->head_page = page;
+        fifo->head_offset = FLASH_FIFO_HEADER_SIZE;
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_fifo_push(struct flash_fifo *fifo, const void *data, uint8_t length) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    if(length == 0 || length > FLASH_FIFO_MAX_RECORD) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint8_t status = FLASH_STATUS_OK;
+    uint8_t was_empty = flash_fifo_is_empty(fifo);
+    flash_session_begin();
+    // Move on to the next page if the record does not fit.
+    if(fifo->tail_offset + FLASH_FIFO_REC_SIZE(length) > FLASH_PAGE_SIZE) {
+        status = flash_fifo_open_page(fifo);
+    }
+    if(status == FLASH_STATUS_OK) {
+        uint32_t addr = flash_fifo_page_addr(fifo, fifo->tail_page) + fifo->tail_offset;
+        // Program the data first, padding the last half-word with 0xFF.
+        for(uint8_t n = 0; n < length && status == FLASH_STATUS_OK; n += 2) {
+            uint16_t half = bytes[n] | ((n + 1 < length ? bytes[n + 1] : 0xFF) << 8);
+            status = flash_program_16_checked(addr + 2 + n, half);
+        }
+        // The header commits the record.
+        if(status == FLASH_STATUS_OK) {
+            status = flash_program_16_checked(addr, (0xFFFF & ~FLASH_FIFO_REC_WRITTEN & ~FLASH_FIFO_REC_LENGTH) | length);
+        }
+        if(status == FLASH_STATUS_OK) {
+            if(was_empty) {
+                fifo->head_page = fifo->tail_page;
+                fifo->head_offset = fifo->tail_offset;
+            }
+            fifo->tail_offset += FLASH_FIFO_REC_SIZE(length);
+        } else {
+            // Never program over a failed record, continue on the next page.
+            fifo->tail_offset = FLASH_PAGE_SIZE;
+        }
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_fifo_peek(struct flash_fifo *fifo, void *data, uint8_t max_length) {
+    if(flash_fifo_is_empty(fifo)) {
+        return 0;
+    }
+    uint32_t addr = flash_fifo_page_addr(fifo, fifo->head_page) + fifo->head_offset;
+    uint8_t length = flash_read_16_bits(addr) & FLASH_FIFO_REC_LENGTH;
+    uint8_t *bytes = (uint8_t*)data;
+    for(uint8_t n = 0; n < length && n < max_length; n++) {
+        bytes[n] = flash_read_8_bits(addr + 2 + n);
+    }
+    return length;
+}
+static inline uint8_t flash_fifo_pop(struct flash_fifo *fifo) {
+    if(flash_fifo_is_empty(fifo)) {
+        return FLASH_STATUS_EMPTY;
+    }
+    uint32_t page_addr = flash_fifo_page_addr(fifo, fifo->head_page);
+    uint16_t header = flash_read_16_bits(page_addr + fifo->head_offset);
+    flash_session_begin();
+    // Consuming only clears a bit of the header.
+    uint8_t status = flash_program_16_checked(page_addr + fifo->head_offset, header & ~FLASH_FIFO_REC_LIVE);
+    if(status == FLASH_STATUS_OK) {
+        fifo->head_offset += FLASH_FIFO_REC_SIZE(header & FLASH_FIFO_REC_LENGTH);
+        // Past the last record of a page the tail already left: mark the page consumed and move on.
+        if(fifo->head_page != fifo->tail_page && (fifo->head_offset + 2 > FLASH_PAGE_SIZE || flash_read_16_bits(page_addr + fifo->head_offset) == 0xFFFF)) {
+            status = flash_program_16_checked(page_addr + 2, FLASH_FIFO_PAGE_CONSUMED);
+            fifo->head_page = (fifo->head_page + 1) % fifo->n_pages;
+            fifo->head_offset = FLASH_FIFO_HEADER_SIZE;
+        }
+        // Caught up with a tail page closed early by a torn push: nothing is left to pop.
+        if(fifo->head_page == fifo->tail_page && (fifo->head_offset + 2 > FLASH_PAGE_SIZE || flash_read_16_bits(flash_fifo_page_addr(fifo, fifo->head_page) + fifo->head_offset) == 0xFFFF)) {
+            fifo->head_offset = fifo->tail_offset;
+        }
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_fifo_reclaim(struct flash_fifo *fifo) {
+    uint8_t erased = 0;
+    flash_session_begin();
+    for(uint8_t page = 0; page < fifo->n_pages; page++) {
+        uint32_t addr = flash_fifo_page_addr(fifo, page);
+        // The tail page stays as it is, the next open marks and erases it.
+        if(page == fifo->tail_page || flash_read_16_bits(addr) == 0xFFFF) {
+            continue;
+        }
+        if(flash_read_16_bits(addr + 2) == FLASH_FIFO_PAGE_CONSUMED && flash_erase_page_checked(addr) == FLASH_STATUS_OK) {
+            erased++;
+        }
+    }
+    flash_session_end();
+    return erased;
+}
+#endif // CH32V003_FLASH_FIFO_H
@@ -0,0 +1,417 @@
+/**
+ * @file
+ * @brief Key/value store with hash-bucketed pages for constant-time lookups in CH32V003 flash memory.
+ *
+ * This header stores 16-bit values under 16-bit keys. Every key hashes to a home bucket, and each bucket is one page: a lookup scans that
+ * single 64-byte page, whatever the number of keys stored. The only RAM is a map from bucket to page, one byte per bucket.
+ * A write appends a record to the home page. A full page is compacted into a free page with only the live record of each key; a bucket
+ * that really holds more keys than fit spills into a shared overflow page. Compacting the overflow page rehashes its records: every record
+ * whose home page has room again moves back there, so the overflow page only keeps what does not fit at home.
+ *
+ * @section hashed_usage Usage
+ * Reserve n_pages pages at the end of the main flash (see overrides.ld), at least two more than n_buckets, describe them in a struct
+ * flash_hashed and call flash_hashed_mount() once at boot.
+ * - flash_hashed_read() and flash_hashed_write() read and write a key. Writing the value that is already stored costs nothing.
+ * - Size n_buckets for the number of keys: a bucket holds 15 keys, a hash spreads them unevenly, so plan for about half of that.
+ * Lookups of a bucket with keys in the overflow page scan the overflow page as well. The functions open their own unlock session,
+ * the flash does not need to be unlocked by the caller.
+ *
+ * @section hashed_format On-Flash Format
+ * - A page starts with a header of two half-words: the page sequence number, then the tag, the bucket number or FLASH_HASHED_OVERFLOW.
+ *   The tag is programmed last and commits the page. Of several pages with the same tag the one with the highest sequence number counts,
+ *   all others are free.
+ * - The header is followed by 15 records of two half-words: the value, then the key. The key is programmed last and commits the record;
+ *   key 0xFFFF is blank, so it cannot be used. The newest record of a key in a page is the last one.
+ * - A key in the overflow page is newer than its copy in the home page; writes to it go to the overflow page until a rehash moves it home.
+ * - The home bucket of a key is (uint16_t)(key * 0x9E37) * n_buckets >> 16.
+ */
+#ifndef CH32V003_FLASH_HASHED_H
+#define CH32V003_FLASH_HASHED_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#ifndef FLASH_HASHED_BUCKETS_MAX
+#define FLASH_HASHED_BUCKETS_MAX 16 // bytes of RAM for the bucket map, at most 32
+#endif
+#if FLASH_HASHED_BUCKETS_MAX > 32
+#error "FLASH_HASHED_BUCKETS_MAX must fit into the overflowed mask"
+#endif
+#define FLASH_HASHED_HEADER_SIZE 4
+#define FLASH_HASHED_RECORD_SIZE 4
+#define FLASH_HASHED_RECORDS_PER_PAGE ((FLASH_PAGE_SIZE - FLASH_HASHED_HEADER_SIZE) / FLASH_HASHED_RECORD_SIZE)
+#define FLASH_HASHED_BLANK 0xFFFF
+#define FLASH_HASHED_OVERFLOW 0xFFFE
+#define FLASH_HASHED_NO_PAGE 0xFF
+/**
+ * @brief A hashed store partition and its RAM state.
+ *
+ * start_addr, n_pages and n_buckets describe the partition, the other fields are set up by flash_hashed_mount().
+ */
+struct flash_hashed {
+	uint32_t start_addr;                          // first page of the partition, page aligned
+	uint8_t n_pages;                              // number of pages, at least n_buckets + 2
+	uint8_t n_buckets;                            // number of buckets, 1 to FLASH_HASHED_BUCKETS_MAX
+	uint8_t overflow_page;                        // page of the overflow records, FLASH_HASHED_NO_PAGE if none
+	uint16_t next_seq;                            // sequence number of the next page opened
+	uint32_t overflowed;                          // bit n set while bucket n has keys in the overflow page
+	uint8_t bucket_pages[FLASH_HASHED_BUCKETS_MAX]; // page of each bucket, FLASH_HASHED_NO_PAGE if none
+};
+/**
+ * @brief Mount the store.
+ *
+ * This function finds the page of every bucket and the overflow page.
+ *
+ * @param hashed The store.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_INVALID if the number of buckets or pages is out of range.
+ */
+static inline uint8_t flash_hashed_mount(struct flash_hashed *hashed);
+/**
+ * @brief Read a key.
+ *
+ * @param hashed The store.
+ * @param key The key.
+ * @param value Receives the newest value of the key.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_EMPTY if the key was never written.
+ */
+static inline uint8_t flash_hashed_read(const struct flash_hashed *hashed, uint16_t key, uint16_t *value);
+/**
+ * @brief Write a key.
+ *
+ * This function appends a record to the home page of the key, compacting it when it is full, or to the overflow page when the bucket holds
+ * more keys than fit. A full overflow page is rehashed first.
+ *
+ * @param hashed The store.
+ * @param key The key, anything but 0xFFFF.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for key 0xFFFF, FLASH_STATUS_FULL if neither the home page nor the overflow page has room or the failed flash status.
+ */
+static inline uint8_t flash_hashed_write(struct flash_hashed *hashed, uint16_t key, uint16_t value);
+// Internal Function Declarations
+/**
+ * @brief Return the address of a page.
+ */
+static inline uint32_t flash_hashed_page_addr(const struct flash_hashed *hashed, uint8_t page);
+/**
+ * @brief Return the home bucket of a key.
+ */
+static inline uint8_t flash_hashed_bucket(const struct flash_hashed *hashed, uint16_t key);
+/**
+ * @brief Find the newest record of a key in a page. Returns its address, or 0 if there is none.
+ */
+static inline uint32_t flash_hashed_page_find(const struct flash_hashed *hashed, uint8_t page, uint16_t key);
+/**
+ * @brief Return the byte offset after the last used record of a page.
+ */
+static inline uint8_t flash_hashed_page_end(const struct flash_hashed *hashed, uint8_t page);
+/**
+ * @brief Check if a record is the newest of its key in the page and, in a home page, not shadowed by another value in the overflow page.
+ */
+static inline uint8_t flash_hashed_record_is_live(const struct flash_hashed *hashed, uint8_t page, uint32_t addr);
+/**
+ * @brief Count the live records of a page.
+ */
+static inline uint8_t flash_hashed_count_live(const struct flash_hashed *hashed, uint8_t page);
+/**
+ * @brief Erase a page that is in use by no bucket, preferring erased ones, and program its sequence number. The tag is left to the caller.
+ */
+static inline uint8_t flash_hashed_open(struct flash_hashed *hashed, uint8_t *page);
+/**
+ * @brief Append a record to a page with room.
+ */
+static inline uint8_t flash_hashed_append(const struct flash_hashed *hashed, uint8_t page, uint16_t key, uint16_t value);
+/**
+ * @brief Copy the newest records of a bucket into a fresh page, commit it and erase the old page. Returns FLASH_STATUS_FULL if nothing can be gained.
+ */
+static inline uint8_t flash_hashed_compact(struct flash_hashed *hashed, uint8_t bucket);
+/**
+ * @brief Move the overflow records back to their home pages where there is room and the rest into a fresh overflow page.
+ */
+static inline uint8_t flash_hashed_rehash(struct flash_hashed *hashed);
+// Function Definitions
+static inline uint32_t flash_hashed_page_addr(const struct flash_hashed *hashed, uint8_t page) {
+    return hashed->start_addr + (uint32_t)page * FLASH_PAGE_SIZE;
+}
+static inline uint8_t flash_hashed_bucket(const struct flash_hashed *hashed, uint16_t key) {
+    // Multiplicative hashing, the top bits of the product pick the bucket.
+    return (uint32_t)(uint16_t)(key * 0x9E37u) * hashed->n_buckets >> 16;
+}
+static inline uint32_t flash_hashed_page_find(const struct flash_hashed *hashed, uint8_t page, uint16_t key) {
+    if(page == FLASH_HASHED_NO_PAGE) {
+        return 0;
+    }
+    uint32_t addr = flash_hashed_page_addr(hashed, page);
+    uint32_t found = 0;
+    for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE; offset += FLASH_HASHED_RECORD_SIZE) {
+        if(flash_read_16_bits(addr + offset + 2) == key) {
+            found = addr + offset;
+        }
+    }
+    return found;
+}
+static inline uint8_t flash_hashed_page_end(const struct flash_hashed *hashed, uint8_t page) {
+    uint32_t addr = flash_hashed_page_addr(hashed, page);
+    uint8_t offset = FLASH_PAGE_SIZE;
+    // A torn record counts as used.
+    while(offset > FLASH_HASHED_HEADER_SIZE
+          && flash_read_16_bits(addr + offset - 4) == FLASH_HASHED_BLANK
+          && flash_read_16_bits(addr + offset - 2) == FLASH_HASHED_BLANK) {
+        offset -= FLASH_HASHED_RECORD_SIZE;
+    }
+    return offset;
+}
+static inline uint8_t flash_hashed_record_is_live(const struct flash_hashed *hashed, uint8_t page, uint32_t addr) {
+    uint16_t key = flash_read_16_bits(addr + 2);
+    if(key == FLASH_HASHED_BLANK || flash_hashed_page_find(hashed, page, key) != addr) {
+        return 0;
+    }
+    if(page == hashed->overflow_page || !(hashed->overflowed & ((uint32_t)1 << flash_hashed_bucket(hashed, key)))) {
+        return 1;
+    }
+    // A home copy with the overflow value is one a rehash just moved home, it has to survive until the old overflow page is gone.
+    uint32_t newer = flash_hashed_page_find(hashed, hashed->overflow_page, key);
+    return !newer || flash_read_16_bits(newer) == flash_read_16_bits(addr);
+}
+static inline uint8_t flash_hashed_count_live(const struct flash_hashed *hashed, uint8_t page) {
+    uint32_t addr = flash_hashed_page_addr(hashed, page);
+    uint8_t count = 0;
+    for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE; offset += FLASH_HASHED_RECORD_SIZE) {
+        count += flash_hashed_record_is_live(hashed, page, addr + offset);
+    }
+    return count;
+}
+static inline uint8_t flash_hashed_open(struct flash_hashed *hashed, uint8_t *page) {
+    *page = FLASH_HASHED_NO_PAGE;
+    for(uint8_t n = 0; n < hashed->n_pages; n++) {
+        uint8_t used = n == hashed->overflow_page;
+        for(uint8_t bucket = 0; bucket < hashed->n_buckets; bucket++) {
+            used |= hashed->bucket_pages[bucket] == n;
+        }
+        // Prefer a page that needs no erase.
+        if(!used && (*page == FLASH_HASHED_NO_PAGE || flash_is_page_erased(flash_hashed_page_addr(hashed, n)))) {
+            *page = n;
+        }
+    }
+    if(*page == FLASH_HASHED_NO_PAGE) {
+        return FLASH_STATUS_FULL;
+    }
+    uint32_t addr = flash_hashed_page_addr(hashed, *page);
+    uint8_t status = FLASH_STATUS_OK;
+    if(!flash_is_page_erased(addr)) {
+        status = flash_erase_page_checked(addr);
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr, hashed->next_seq++);
+    }
+    return status;
+}
+static inline uint8_t flash_hashed_append(const struct flash_hashed *hashed, uint8_t page, uint16_t key, uint16_t value) {
+    uint32_t addr = flash_hashed_page_addr(hashed, page) + flash_hashed_page_end(hashed, page);
+    // The key is programmed last, it commits the record.
+    uint8_t status = flash_program_16_checked(addr, value);
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 2, key);
+    }
+    return status;
+}
+static inline uint8_t flash_hashed_compact(struct flash_hashed *hashed, uint8_t bucket) {
+    uint8_t old_page = hashed->bucket_pages[bucket];
+    if(flash_hashed_count_live(hashed, old_page) == FLASH_HASHED_RECORDS_PER_PAGE) {
+        return FLASH_STATUS_FULL;
+    }
+    uint8_t page;
+    uint8_t status = flash_hashed_open(hashed, &page);
+    uint32_t old_addr = flash_hashed_page_addr(hashed, old_page);
+    for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE && status == FLASH_STATUS_OK; offset += FLASH_HASHED_RECORD_SIZE) {
+        if(flash_hashed_record_is_live(hashed, old_page, old_addr + offset)) {
+            status = flash_hashed_append(hashed, page, flash_read_16_bits(old_addr + offset + 2), flash_read_16_bits(old_addr + offset));
+        }
+    }
+    // The tag commits the copy, which then shadows the old page until it is erased.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(flash_hashed_page_addr(hashed, page) + 2, bucket);
+    }
+    if(status == FLASH_STATUS_OK) {
+        hashed->bucket_pages[bucket] = page;
+        status = flash_erase_page_checked(old_addr);
+    }
+    return status;
+}
+static inline uint8_t flash_hashed_rehash(struct flash_hashed *hashed) {
+    uint8_t old_page = hashed->overflow_page;
+    uint32_t old_addr = flash_hashed_page_addr(hashed, old_page);
+    uint8_t status = FLASH_STATUS_OK;
+    // Copy every overflow record home that fits there; the overflow copy keeps shadowing it until the old page is gone.
+    for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE && status == FLASH_STATUS_OK; offset += FLASH_HASHED_RECORD_SIZE) {
+        uint16_t key = flash_read_16_bits(old_addr + offset + 2);
+        if(key == FLASH_HASHED_BLANK || flash_hashed_page_find(hashed, old_page, key) != old_addr + offset) {
+            continue;
+        }
+        uint8_t bucket = flash_hashed_bucket(hashed, key);
+        // A home page that cannot be compacted keeps the record in the overflow page, a failing flash stops the rehash.
+        if(flash_hashed_page_end(hashed, hashed->bucket_pages[bucket]) == FLASH_PAGE_SIZE) {
+            status = flash_hashed_compact(hashed, bucket);
+            if(status == FLASH_STATUS_FULL) {
+                status = FLASH_STATUS_OK;
+                continue;
+            }
+        }
+        if(status == FLASH_STATUS_OK && flash_hashed_page_end(hashed, hashed->bucket_pages[bucket]) < FLASH_PAGE_SIZE) {
+            status = flash_hashed_append(hashed, hashed->bucket_pages[bucket], key, flash_read_16_bits(old_addr + offset));
+        }
+    }
+    // The records whose home copy is not the overflow value stay in a fresh overflow page.
+    uint32_t overflowed = 0;
+    uint8_t page = FLASH_HASHED_NO_PAGE;
+    for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE && status == FLASH_STATUS_OK; offset += FLASH_HASHED_RECORD_SIZE) {
+        uint16_t key = flash_read_16_bits(old_addr + offset + 2);
+        if(key == FLASH_HASHED_BLANK || flash_hashed_page_find(hashed, old_page, key) != old_addr + offset) {
+            continue;
+        }
+        uint8_t bucket = flash_hashed_bucket(hashed, key);
+        uint32_t home = flash_hashed_page_find(hashed, hashed->bucket_pages[bucket], key);
+        if(home && flash_read_16_bits(home) == flash_read_16_bits(old_addr + offset)) {
+            continue;
+        }
+        if(page == FLASH_HASHED_NO_PAGE) {
+            status = flash_hashed_open(hashed, &page);
+        }
+        if(status == FLASH_STATUS_OK) {
+            status = flash_hashed_append(hashed, page, key, flash_read_16_bits(old_addr + offset));
+            overflowed |= (uint32_t)1 << bucket;
+        }
+    }
+    if(status == FLASH_STATUS_OK && page != FLASH_HASHED_NO_PAGE) {
+        status = flash_program_16_checked(flash_hashed_page_addr(hashed, page) + 2, FLASH_HASHED_OVERFLOW);
+    }
+    // The new overflow page is committed (or not needed), the old one can go.
+    if(status == FLASH_STATUS_OK) {
+        hashed->overflow_page = page;
+        hashed->overflowed = overflowed;
+        status = flash_erase_page_checked(old_addr);
+    }
+    return status;
+}
+static inline uint8_t flash_hashed_mount(struct flash_hashed *hashed) {
+    if(hashed->n_buckets == 0 || hashed->n_buckets > FLASH_HASHED_BUCKETS_MAX || hashed->n_pages < hashed->n_buckets + 2) {
+        return FLASH_STATUS_INVALID;
+    }
+    for(uint8_t bucket = 0; bucket < hashed->n_buckets; bucket++) {
+        hashed->bucket_pages[bucket] = FLASH_HASHED_NO_PAGE;
+    }
+    hashed->overflow_page = FLASH_HASHED_NO_PAGE;
+    hashed->overflowed = 0;
+    uint16_t max_seq = 0;
+    uint8_t found = 0;
+    // Of several committed pages with the same tag the newest one counts.
+    for(uint8_t page = 0; page < hashed->n_pages; page++) {
+        uint32_t addr = flash_hashed_page_addr(hashed, page);
+        uint16_t tag = flash_read_16_bits(addr + 2);
+        uint16_t seq = flash_read_16_bits(addr);
+        uint8_t *slot;
+        if(tag == FLASH_HASHED_OVERFLOW) {
+            slot = &hashed->overflow_page;
+        } else if(tag < hashed->n_buckets) {
+            slot = &hashed->bucket_pages[tag];
+        } else {
+            continue;
+        }
+        if(*slot == FLASH_HASHED_NO_PAGE || (int16_t)(seq - flash_read_16_bits(flash_hashed_page_addr(hashed, *slot))) > 0) {
+            *slot = page;
+        }
+        if(!found || (int16_t)(seq - max_seq) > 0) {
+            max_seq = seq;
+            found = 1;
+        }
+    }
+    hashed->next_seq = max_seq + found;
+    // Note the buckets with keys in the overflow page.
+    if(hashed->overflow_page != FLASH_HASHED_NO_PAGE) {
+        uint32_t addr = flash_hashed_page_addr(hashed, hashed->overflow_page);
+        for(uint8_t offset = FLASH_HASHED_HEADER_SIZE; offset < FLASH_PAGE_SIZE; offset += FLASH_HASHED_RECORD_SIZE) {
+            uint16_t key = flash_read_16_bits(addr + offset + 2);
+            if(key != FLASH_HASHED_BLANK) {
+                hashed->overflowed |= (uint32_t)1 << flash_hashed_bucket(hashed, key);
+            }
+        }
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_hashed_read(const struct flash_hashed *hashed, uint16_t key, uint16_t *value) {
+    uint8_t bucket = flash_hashed_bucket(hashed, key);
+    uint32_t addr = 0;
+    // The overflow page is only scanned for buckets that spilled into it, and it is newer than the home page.
+    if(hashed->overflowed & ((uint32_t)1 << bucket)) {
+        addr = flash_hashed_page_find(hashed, hashed->overflow_page, key);
+    }
+    if(addr == 0) {
+        addr = flash_hashed_page_find(hashed, hashed->bucket_pages[bucket], key);
+    }
+    if(addr == 0) {
+        return FLASH_STATUS_EMPTY;
+    }
+    *value = flash_read_16_bits(addr);
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_hashed_write(struct flash_hashed *hashed, uint16_t key, uint16_t value) {
+    if(key == FLASH_HASHED_BLANK) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Same value as stored, nothing to program.
+    uint16_t stored;
+    if(flash_hashed_read(hashed, key, &stored) == FLASH_STATUS_OK && stored == value) {
+        return FLASH_STATUS_OK;
+    }
+    uint8_t bucket = flash_hashed_bucket(hashed, key);
+    uint8_t status = FLASH_STATUS_FULL;
+    flash_session_begin();
+    // A rehash can move the key home, so the placement is decided again after it; two rehashes without room mean the store is full.
+    for(uint8_t round = 0; round < 3 && status == FLASH_STATUS_FULL; round++) {
+        uint8_t home = hashed->bucket_pages[bucket];
+        uint8_t in_overflow = (hashed->overflowed & ((uint32_t)1 << bucket)) && flash_hashed_page_find(hashed, hashed->overflow_page, key);
+        if(!in_overflow && home == FLASH_HASHED_NO_PAGE) {
+            // First key of the bucket: an empty committed page.
+            status = flash_hashed_open(hashed, &home);
+            if(status == FLASH_STATUS_OK) {
+                status = flash_program_16_checked(flash_hashed_page_addr(hashed, home) + 2, bucket);
+            }
+            if(status != FLASH_STATUS_OK) {
+                break;
+            }
+            hashed->bucket_pages[bucket] = home;
+        }
+        if(!in_overflow && flash_hashed_page_end(hashed, home) == FLASH_PAGE_SIZE) {
+            status = flash_hashed_compact(hashed, bucket);
+            if(status != FLASH_STATUS_OK && status != FLASH_STATUS_FULL) {
+                break;
+            }
+            home = hashed->bucket_pages[bucket];
+        }
+        if(!in_overflow && flash_hashed_page_end(hashed, home) < FLASH_PAGE_SIZE) {
+            status = flash_hashed_append(hashed, home, key, value);
+            break;
+        }
+        // The bucket holds more keys than fit, spill into the overflow page.
+        if(hashed->overflow_page == FLASH_HASHED_NO_PAGE) {
+            uint8_t page;
+            status = flash_hashed_open(hashed, &page);
+            if(status == FLASH_STATUS_OK) {
+                status = flash_program_16_checked(flash_hashed_page_addr(hashed, page) + 2, FLASH_HASHED_OVERFLOW);
+            }
+            if(status != FLASH_STATUS_OK) {
+                break;
+            }
+            hashed->overflow_page = page;
+        }
+        if(flash_hashed_page_end(hashed, hashed->overflow_page) < FLASH_PAGE_SIZE) {
+            status = flash_hashed_append(hashed, hashed->overflow_page, key, value);
+            hashed->overflowed |= (uint32_t)1 << bucket;
+            break;
+        }
+        status = flash_hashed_rehash(hashed);
+        if(status == FLASH_STATUS_OK) {
+            status = FLASH_STATUS_FULL;
+        }
+    }
+    flash_session_end();
+    return status;
+}
+#endif // CH32V003_FLASH_HASHED_H
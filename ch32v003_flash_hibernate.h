@@ -0,0 +1,239 @@
+/**
+ * @file
+ * @brief Hibernate and resume an application state struct across standby in CH32V003 flash memory.
+ *
+ * This header saves a state struct (a few hundred bytes) before standby as one tagged, checksummed image and restores it on wake.
+ * The image is written a page at a time with the fast page program into the next of several rotating slots, so saving costs a handful
+ * of page programs instead of one program per half-word, and the wear is spread over all slots. Each page is laid out and checksummed while
+ * the previous one programs (see flash_program_pages()).
+ * Resuming scans the slot headers once, checks the CRC of the newest image and copies it into RAM; waking up costs little more than a memcpy.
+ *
+ * @section hibernate_usage Usage
+ * Reserve at least two slots of whole pages at the end of the main flash (see overrides.ld) and describe them in a struct flash_hibernate.
+ * - flash_hibernate_save() writes the state before entering standby.
+ * - flash_hibernate_resume() restores the newest valid image with the given tag and length after waking up. Telling a wake-up from a cold boot
+ *   (e.g. with the RCC reset flags) is up to the application.
+ * - flash_hibernate_prepare() erases the slot the next save goes to; call it while running so the save before standby does not have to erase.
+ * Use a different tag for every layout of the state struct, an image with another tag or length is never restored.
+ * The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section hibernate_format On-Flash Format
+ * A slot starts with a header of four half-words: the tag, the sequence number, the length in bytes and the CRC-16 of the first three half-words and the state.
+ * The state follows the header, the rest of the slot stays erased. The CRC is programmed last, after all pages, and commits the image.
+ * A blank slot has tag 0xFFFF, so 0xFFFF cannot be used as a tag.
+ */
+#ifndef CH32V003_FLASH_HIBERNATE_H
+#define CH32V003_FLASH_HIBERNATE_H
+#include "ch32v003_flash.h"
+#include <string.h> // for memcpy in flash_hibernate_resume()
+// Preprocessor Macros
+#define FLASH_HIBERNATE_HEADER_SIZE 8
+#define FLASH_HIBERNATE_BLANK 0xFFFF
+/**
+ * @brief The hibernate partition.
+ */
+struct flash_hibernate {
+	uint32_t start_addr;  // first page of the partition, page aligned
+	uint8_t n_pages;      // number of pages, a multiple of slot_pages
+	uint8_t slot_pages;   // pages per slot, large enough for the header and the state
+};
+/**
+ * @brief Save the state.
+ *
+ * This function writes the state into the slot after the newest image, erasing the slot first unless flash_hibernate_prepare() already did.
+ * The previous image stays intact until the next save, so a power loss during the save falls back to it. A newest image torn by such a power
+ * loss is overwritten in place, so the newest valid image is never the one erased.
+ *
+ * @param hibernate The partition.
+ * @param tag The tag of the state layout, anything but 0xFFFF.
+ * @param state The state.
+ * @param length The size of the state in bytes.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if the tag is 0xFFFF or the state does not fit into a slot or the failed flash status.
+ */
+static inline uint8_t flash_hibernate_save(const struct flash_hibernate *hibernate, uint16_t tag, const void *state, uint16_t length);
+/**
+ * @brief Restore the state.
+ *
+ * This function finds the newest image with the tag and length, checks its CRC and copies it into state.
+ * An image that fails the CRC is skipped in favour of the next older one.
+ *
+ * @param hibernate The partition.
+ * @param tag The tag of the state layout.
+ * @param state Receives the state.
+ * @param length The size of the state in bytes.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_EMPTY if there is no valid image; state is left untouched then.
+ */
+static inline uint8_t flash_hibernate_resume(const struct flash_hibernate *hibernate, uint16_t tag, void *state, uint16_t length);
+/**
+ * @brief Erase the slot the next save goes to.
+ *
+ * @param hibernate The partition.
+ * @return uint8_t FLASH_STATUS_OK or the failed flash status.
+ */
+static inline uint8_t flash_hibernate_prepare(const struct flash_hibernate *hibernate);
+/**
+ * @brief An image being saved, the context of flash_hibernate_fill_page().
+ */
+struct flash_hibernate_image {
+	const uint8_t *state;
+	uint16_t tag;
+	uint16_t seq;
+	uint16_t length;
+	uint16_t crc;  // CRC of the pages filled so far
+};
+// Internal Function Declarations
+/**
+ * @brief Return the address of a slot.
+ */
+static inline uint32_t flash_hibernate_slot_addr(const struct flash_hibernate *hibernate, uint8_t slot);
+/**
+ * @brief Return the slot the next save goes to and its sequence number in seq: the slot after the newest image, or the newest one itself if it is torn.
+ */
+static inline uint8_t flash_hibernate_next_slot(const struct flash_hibernate *hibernate, uint16_t *seq);
+/**
+ * @brief Check the CRC of the image in a slot.
+ */
+static inline uint8_t flash_hibernate_slot_is_valid(const struct flash_hibernate *hibernate, uint8_t slot);
+/**
+ * @brief Erase the pages of a slot that are not erased yet.
+ */
+static inline uint8_t flash_hibernate_erase_slot(const struct flash_hibernate *hibernate, uint8_t slot);
+/**
+ * @brief Lay out one page of the image and continue its CRC, the fill callback of flash_program_pages().
+ */
+static FLASH_RAM_FUNC uint8_t flash_hibernate_fill_page(void *context, uint8_t page, uint32_t *buffer);
+// Function Definitions
+static inline uint32_t flash_hibernate_slot_addr(const struct flash_hibernate *hibernate, uint8_t slot) {
+    return hibernate->start_addr + (uint32_t)slot * hibernate->slot_pages * FLASH_PAGE_SIZE;
+}
+static inline uint8_t flash_hibernate_next_slot(const struct flash_hibernate *hibernate, uint16_t *seq) {
+    uint8_t n_slots = hibernate->n_pages / hibernate->slot_pages;
+    uint8_t newest = n_slots - 1;
+    *seq = 0;
+    uint8_t found = 0;
+    for(uint8_t slot = 0; slot < n_slots; slot++) {
+        uint32_t addr = flash_hibernate_slot_addr(hibernate, slot);
+        if(flash_read_16_bits(addr) == FLASH_HIBERNATE_BLANK) {
+            continue;
+        }
+        uint16_t slot_seq = flash_read_16_bits(addr + 2);
+        if(!found || (int16_t)(slot_seq - *seq) > 0) {
+            newest = slot;
+            *seq = slot_seq;
+            found = 1;
+        }
+    }
+    // A torn newest image is reused with its sequence number, which is already newer than every other one. Moving on past it could
+    // wrap around onto the newest valid image when there are only a few slots.
+    if(found && !flash_hibernate_slot_is_valid(hibernate, newest)) {
+        return newest;
+    }
+    *seq += found;
+    return (newest + 1) % n_slots;
+}
+static inline uint8_t flash_hibernate_slot_is_valid(const struct flash_hibernate *hibernate, uint8_t slot) {
+    uint32_t addr = flash_hibernate_slot_addr(hibernate, slot);
+    uint16_t length = flash_read_16_bits(addr + 4);
+    if(length > hibernate->slot_pages * FLASH_PAGE_SIZE - FLASH_HIBERNATE_HEADER_SIZE) {
+        return 0;
+    }
+    // The CRC covers tag, sequence number and length, then the state.
+    uint16_t crc = flash_crc16(0xFFFF, (const void*)(uintptr_t)addr, 6);
+    crc = flash_crc16(crc, (const void*)(uintptr_t)(addr + FLASH_HIBERNATE_HEADER_SIZE), length);
+    return crc == flash_read_16_bits(addr + 6);
+}
+static inline uint8_t flash_hibernate_erase_slot(const struct flash_hibernate *hibernate, uint8_t slot) {
+    uint32_t addr = flash_hibernate_slot_addr(hibernate, slot);
+    uint8_t status = FLASH_STATUS_OK;
+    for(uint8_t page = 0; page < hibernate->slot_pages && status == FLASH_STATUS_OK; page++) {
+        if(!flash_is_page_erased(addr + page * FLASH_PAGE_SIZE)) {
+            status = flash_erase_page_checked(addr + page * FLASH_PAGE_SIZE);
+        }
+    }
+    return status;
+}
+static FLASH_RAM_FUNC uint8_t flash_hibernate_fill_page(void *context, uint8_t page, uint32_t *buffer) {
+    struct flash_hibernate_image *image = (struct flash_hibernate_image*)context;
+    uint8_t *bytes = (uint8_t*)buffer;
+    // Lay out the page: header, state, erased padding.
+    for(uint8_t byte = 0; byte < FLASH_PAGE_SIZE; byte++) {
+        uint16_t offset = page * FLASH_PAGE_SIZE + byte;
+        bytes[byte] = offset >= FLASH_HIBERNATE_HEADER_SIZE && offset < FLASH_HIBERNATE_HEADER_SIZE + image->length ? image->state[offset - FLASH_HIBERNATE_HEADER_SIZE] : 0xFF;
+    }
+    uint8_t first = 0;
+    if(page == 0) {
+        // The CRC half-word stays erased, it is programmed once every page is in.
+        // Byte stores rather than memcpy(), which lives in flash.
+        bytes[0] = image->tag & 0xFF;
+        bytes[1] = image->tag >> 8;
+        bytes[2] = image->seq & 0xFF;
+        bytes[3] = image->seq >> 8;
+        bytes[4] = image->length & 0xFF;
+        bytes[5] = image->length >> 8;
+        image->crc = flash_crc16(0xFFFF, bytes, 6);
+        first = FLASH_HIBERNATE_HEADER_SIZE;
+    }
+    // Continue the CRC over the state bytes of this page.
+    uint16_t end = (page + 1) * FLASH_PAGE_SIZE;
+    if(end > FLASH_HIBERNATE_HEADER_SIZE + image->length) {
+        end = FLASH_HIBERNATE_HEADER_SIZE + image->length;
+    }
+    if(end > page * FLASH_PAGE_SIZE + first) {
+        image->crc = flash_crc16(image->crc, bytes + first, end - page * FLASH_PAGE_SIZE - first);
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_hibernate_save(const struct flash_hibernate *hibernate, uint16_t tag, const void *state, uint16_t length) {
+    if(tag == FLASH_HIBERNATE_BLANK || length > hibernate->slot_pages * FLASH_PAGE_SIZE - FLASH_HIBERNATE_HEADER_SIZE) {
+        return FLASH_STATUS_INVALID;
+    }
+    struct flash_hibernate_image image = { .state = (const uint8_t*)state, .tag = tag, .length = length };
+    uint8_t slot = flash_hibernate_next_slot(hibernate, &image.seq);
+    uint32_t addr = flash_hibernate_slot_addr(hibernate, slot);
+    flash_session_begin();
+    uint8_t status = flash_hibernate_erase_slot(hibernate, slot);
+    // Each page is laid out and checksummed while the previous one programs.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_pages(addr, (FLASH_HIBERNATE_HEADER_SIZE + length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, flash_hibernate_fill_page, &image);
+    }
+    // The CRC commits the image.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 6, image.crc);
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_hibernate_resume(const struct flash_hibernate *hibernate, uint16_t tag, void *state, uint16_t length) {
+    uint8_t n_slots = hibernate->n_pages / hibernate->slot_pages;
+    uint8_t best = n_slots;
+    uint16_t best_seq = 0;
+    // One pass over the headers; the CRC is only checked for an image newer than the best one so far.
+    for(uint8_t slot = 0; slot < n_slots; slot++) {
+        uint32_t addr = flash_hibernate_slot_addr(hibernate, slot);
+        if(flash_read_16_bits(addr) != tag || flash_read_16_bits(addr + 4) != length) {
+            continue;
+        }
+        uint16_t seq = flash_read_16_bits(addr + 2);
+        if(best < n_slots && (int16_t)(seq - best_seq) <= 0) {
+            continue;
+        }
+        if(flash_hibernate_slot_is_valid(hibernate, slot)) {
+            best = slot;
+            best_seq = seq;
+        }
+    }
+    if(best == n_slots) {
+        return FLASH_STATUS_EMPTY;
+    }
+    memcpy(state, (const void*)(uintptr_t)(flash_hibernate_slot_addr(hibernate, best) + FLASH_HIBERNATE_HEADER_SIZE), length);
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_hibernate_prepare(const struct flash_hibernate *hibernate) {
+    uint16_t seq;
+    uint8_t slot = flash_hibernate_next_slot(hibernate, &seq);
+    flash_session_begin();
+    uint8_t status = flash_hibernate_erase_slot(hibernate, slot);
+    flash_session_end();
+    return status;
+}
+#endif // CH32V003_FLASH_HIBERNATE_H
@@ -0,0 +1,124 @@
+/**
+ * @file
+ * @brief Erase-free updates of small hot variables in CH32V003 flash memory.
+ *
+ * This header gives a variable (last mode, last volume, ...) a row of 16-bit slots in whole pages of main flash.
+ * An update programs the next blank slot, so a write costs one half-word program instead of an erase/program pair.
+ * The slots are only erased once they are all used, i.e. once every 32 updates per page.
+ *
+ * @section slots_usage Usage
+ * Reserve one or more pages per variable at the end of the main flash (see overrides.ld) and describe them in a struct flash_slots with start_addr and n_pages.
+ * - flash_slots_read() returns the last written value.
+ * - flash_slots_write() stores a new value. Writing the value that is already stored costs nothing.
+ * The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section slots_format On-Flash Format
+ * The slots are the half-words of the pages, filled from start_addr upwards. The current value is the last programmed slot, found by a binary search for the boundary between programmed and blank slots.
+ * A blank slot reads 0xFFFF, so 0xFFFF cannot be stored.
+ *
+ * @note A power loss while the exhausted slots are erased loses the value; flash_slots_read() then returns FLASH_STATUS_EMPTY or an older value.
+ * The next flash_slots_write() notices the programmed slots the erase left behind and erases again.
+ */
+#ifndef CH32V003_FLASH_SLOTS_H
+#define CH32V003_FLASH_SLOTS_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#define FLASH_SLOTS_PER_PAGE (FLASH_PAGE_SIZE / 2)
+#define FLASH_SLOTS_BLANK 0xFFFF
+/**
+ * @brief The pages owned by one variable.
+ */
+struct flash_slots {
+	uint32_t start_addr;  // first page of the slots, page aligned
+	uint8_t n_pages;      // number of pages, 32 slots each
+};
+/**
+ * @brief Read the current value.
+ *
+ * @param slots The slots of the variable.
+ * @param value Receives the last written value.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_EMPTY if no value was written since the slots were erased.
+ */
+static inline uint8_t flash_slots_read(const struct flash_slots *slots, uint16_t *value);
+/**
+ * @brief Write a new value.
+ *
+ * This function programs the next blank slot. When all slots are used, the pages are erased first and the value goes to the first slot.
+ * Programmed slots behind the next blank one, left by an erase cut short, count as all slots used as well.
+ *
+ * @param slots The slots of the variable.
+ * @param value The value, anything but 0xFFFF.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for 0xFFFF or the failed flash status.
+ */
+static inline uint8_t flash_slots_write(const struct flash_slots *slots, uint16_t value);
+// Internal Function Declarations
+/**
+ * @brief Return the index of the first blank slot, or the number of slots if all are used.
+ */
+static inline uint16_t flash_slots_find_blank(const struct flash_slots *slots);
+/**
+ * @brief Check with word-wide loads that every slot from the given one on is blank.
+ */
+static inline uint8_t flash_slots_blank_from(const struct flash_slots *slots, uint16_t slot);
+// Function Definitions
+static inline uint16_t flash_slots_find_blank(const struct flash_slots *slots) {
+    // The programmed slots come first, so blank/programmed is a single boundary.
+    uint16_t low = 0;
+    uint16_t high = (uint16_t)slots->n_pages * FLASH_SLOTS_PER_PAGE;
+    while(low < high) {
+        uint16_t mid = low + (high - low) / 2;
+        if(flash_read_16_bits(slots->start_addr + mid * 2) == FLASH_SLOTS_BLANK) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+static inline uint8_t flash_slots_blank_from(const struct flash_slots *slots, uint16_t slot) {
+    uint16_t end = (uint16_t)slots->n_pages * FLASH_SLOTS_PER_PAGE;
+    // Up to a word boundary, then a word at a time.
+    if(slot % 2 && slot < end && flash_read_16_bits(slots->start_addr + slot++ * 2) != FLASH_SLOTS_BLANK) {
+        return 0;
+    }
+    const uint32_t *word = (const uint32_t*)(uintptr_t)(slots->start_addr + slot * 2);
+    for(uint16_t n = 0; n < (end - slot) / 2; n++) {
+        if(word[n] != 0xFFFFFFFF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+static inline uint8_t flash_slots_read(const struct flash_slots *slots, uint16_t *value) {
+    uint16_t blank = flash_slots_find_blank(slots);
+    if(blank == 0) {
+        return FLASH_STATUS_EMPTY;
+    }
+    *value = flash_read_16_bits(slots->start_addr + (blank - 1) * 2);
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_slots_write(const struct flash_slots *slots, uint16_t value) {
+    if(value == FLASH_SLOTS_BLANK) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint16_t blank = flash_slots_find_blank(slots);
+    // Same value as stored, nothing to program.
+    if(blank != 0 && flash_read_16_bits(slots->start_addr + (blank - 1) * 2) == value) {
+        return FLASH_STATUS_OK;
+    }
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    // All slots used, or a torn erase left programmed slots behind the blank one: erase them and start over at the first one.
+    if(blank == (uint16_t)slots->n_pages * FLASH_SLOTS_PER_PAGE || !flash_slots_blank_from(slots, blank)) {
+        for(uint8_t page = 0; page < slots->n_pages && status == FLASH_STATUS_OK; page++) {
+            status = flash_erase_page_checked(slots->start_addr + (uint32_t)page * FLASH_PAGE_SIZE);
+        }
+        blank = 0;
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(slots->start_addr + blank * 2, value);
+    }
+    flash_session_end();
+    return status;
+}
+#endif // CH32V003_FLASH_SLOTS_H
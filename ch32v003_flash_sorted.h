@@ -0,0 +1,326 @@
+/**
+ * @file
+ * @brief Key/value store with sorted segments, read by binary search directly over CH32V003 flash memory.
+ *
+ * This header stores 16-bit values under 16-bit keys without any index in RAM. Most records live in a sorted segment: a header table with
+ * the first key of every page, then the records in key order. A lookup binary searches the table for the page and the page for the record,
+ * a handful of flash reads whatever the number of keys. New writes are appended to a short unsorted tail that is scanned linearly; when it
+ * is full, compaction merges the tail into the segment in key order. The RAM state is a few bytes, the merge itself needs no buffer.
+ *
+ * @section sorted_usage Usage
+ * Reserve two segments of segment_pages pages followed by tail_pages pages at the end of the main flash (see overrides.ld), describe them
+ * in a struct flash_sorted and call flash_sorted_mount() once at boot.
+ * - flash_sorted_read() and flash_sorted_write() read and write a key. Writing the value that is already stored costs nothing.
+ * - flash_sorted_compact() merges the tail early, e.g. when the application is idle, so that the next writes do not have to.
+ * A segment holds up to 16 records per page after its header page, at most 480. Lookups in the tail cost one read per tail record, so keep
+ * the tail short: one or two pages. The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section sorted_format On-Flash Format
+ * - The first page of a segment is its header table: the sequence number, the number of records, then the first key of each data page.
+ *   The sequence number is programmed last and commits the segment; the segment with the highest committed sequence number is active.
+ * - The data pages follow with records of two half-words, the value then the key, in ascending key order and without gaps.
+ * - The tail holds records in the same layout in write order; the key is programmed last and commits the record. The newest record of a
+ *   key is the last one in the tail, or else the one in the active segment. Key 0xFFFF is blank, so it cannot be used.
+ * - Compaction writes the merged records into the other segment and commits it before it erases the tail and the old segment, so a power
+ *   loss leaves either the old segment and the tail or the new segment. If the mount finds two committed segments, the power failed
+ *   after the commit: it erases the tail, which a cut erase may have left with intact keys over erased values, and the old segment.
+ */
+#ifndef CH32V003_FLASH_SORTED_H
+#define CH32V003_FLASH_SORTED_H
+#include "ch32v003_flash.h"
+// Preprocessor Macros
+#define FLASH_SORTED_RECORD_SIZE 4
+#define FLASH_SORTED_RECORDS_PER_PAGE (FLASH_PAGE_SIZE / FLASH_SORTED_RECORD_SIZE)
+#define FLASH_SORTED_HEADER_SIZE 4
+#define FLASH_SORTED_MAX_DATA_PAGES ((FLASH_PAGE_SIZE - FLASH_SORTED_HEADER_SIZE) / 2)
+#define FLASH_SORTED_BLANK 0xFFFF
+#define FLASH_SORTED_NO_SEGMENT 0xFF
+/**
+ * @brief A sorted store partition and its RAM state.
+ *
+ * start_addr, segment_pages and tail_pages describe the partition, the other fields are set up by flash_sorted_mount().
+ */
+struct flash_sorted {
+	uint32_t start_addr;    // first page of segment 0, followed by segment 1 and the tail, page aligned
+	uint8_t segment_pages;  // pages per segment including the header page, 2 to 31
+	uint8_t tail_pages;     // pages of the tail, at least 1
+	uint8_t segment;        // active segment, FLASH_SORTED_NO_SEGMENT if none was committed yet
+	uint16_t seq;           // sequence number of the active segment
+	uint16_t count;         // records in the active segment
+	uint16_t tail_offset;   // byte offset of the next record in the tail
+};
+/**
+ * @brief Mount the store.
+ *
+ * This function finds the active segment and the end of the tail. It finishes a compaction that lost power after its commit.
+ *
+ * @param sorted The store.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if the segment or tail size is out of range or the failed flash status of finishing a compaction.
+ */
+static inline uint8_t flash_sorted_mount(struct flash_sorted *sorted);
+/**
+ * @brief Read a key.
+ *
+ * @param sorted The store.
+ * @param key The key.
+ * @param value Receives the newest value of the key.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_EMPTY if the key was never written.
+ */
+static inline uint8_t flash_sorted_read(const struct flash_sorted *sorted, uint16_t key, uint16_t *value);
+/**
+ * @brief Write a key.
+ *
+ * This function appends a record to the tail, compacting first if the tail is full.
+ *
+ * @param sorted The store.
+ * @param key The key, anything but 0xFFFF.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for key 0xFFFF, FLASH_STATUS_FULL if the keys no longer fit into a segment or the failed flash status.
+ */
+static inline uint8_t flash_sorted_write(struct flash_sorted *sorted, uint16_t key, uint16_t value);
+/**
+ * @brief Merge the tail into a new sorted segment.
+ *
+ * @param sorted The store.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_FULL if the merged keys do not fit into a segment (nothing is changed then) or the failed flash status.
+ */
+static inline uint8_t flash_sorted_compact(struct flash_sorted *sorted);
+// Internal Function Declarations
+/**
+ * @brief Return the address of a segment, or of the tail for segment 2.
+ */
+static inline uint32_t flash_sorted_addr(const struct flash_sorted *sorted, uint8_t segment);
+/**
+ * @brief Find the newest tail record of a key. Returns its address, or 0 if there is none.
+ */
+static inline uint32_t flash_sorted_tail_find(const struct flash_sorted *sorted, uint16_t key);
+/**
+ * @brief Binary search the active segment for a key. Returns the address of its record, or 0 if there is none.
+ */
+static inline uint32_t flash_sorted_segment_find(const struct flash_sorted *sorted, uint16_t key);
+/**
+ * @brief Return the smallest key in the tail that is greater than after, FLASH_SORTED_BLANK if there is none.
+ */
+static inline uint16_t flash_sorted_tail_next(const struct flash_sorted *sorted, int32_t after);
+/**
+ * @brief Erase the pages of an area that are not erased yet.
+ */
+static inline uint8_t flash_sorted_erase(uint32_t addr, uint8_t n_pages);
+// Function Definitions
+static inline uint32_t flash_sorted_addr(const struct flash_sorted *sorted, uint8_t segment) {
+    return sorted->start_addr + (uint32_t)segment * sorted->segment_pages * FLASH_PAGE_SIZE;
+}
+static inline uint32_t flash_sorted_tail_find(const struct flash_sorted *sorted, uint16_t key) {
+    uint32_t addr = flash_sorted_addr(sorted, 2);
+    uint32_t found = 0;
+    for(uint16_t offset = 0; offset < sorted->tail_offset; offset += FLASH_SORTED_RECORD_SIZE) {
+        if(flash_read_16_bits(addr + offset + 2) == key) {
+            found = addr + offset;
+        }
+    }
+    return found;
+}
+static inline uint32_t flash_sorted_segment_find(const struct flash_sorted *sorted, uint16_t key) {
+    if(sorted->segment == FLASH_SORTED_NO_SEGMENT || sorted->count == 0) {
+        return 0;
+    }
+    uint32_t addr = flash_sorted_addr(sorted, sorted->segment);
+    uint8_t n_data_pages = (sorted->count + FLASH_SORTED_RECORDS_PER_PAGE - 1) / FLASH_SORTED_RECORDS_PER_PAGE;
+    // The header table gives the first key of every data page, find the last page starting at or below the key.
+    uint8_t low = 0;
+    uint8_t high = n_data_pages;
+    while(low < high) {
+        uint8_t mid = (low + high) / 2;
+        if(flash_read_16_bits(addr + FLASH_SORTED_HEADER_SIZE + mid * 2) <= key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if(low == 0) {
+        return 0;
+    }
+    uint8_t page = low - 1;
+    uint32_t page_addr = addr + (uint32_t)(page + 1) * FLASH_PAGE_SIZE;
+    uint8_t n_records = page == n_data_pages - 1 ? sorted->count - page * FLASH_SORTED_RECORDS_PER_PAGE : FLASH_SORTED_RECORDS_PER_PAGE;
+    // Then the first record in the page with a key not below it.
+    low = 0;
+    high = n_records;
+    while(low < high) {
+        uint8_t mid = (low + high) / 2;
+        if(flash_read_16_bits(page_addr + mid * FLASH_SORTED_RECORD_SIZE + 2) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if(low < n_records && flash_read_16_bits(page_addr + low * FLASH_SORTED_RECORD_SIZE + 2) == key) {
+        return page_addr + low * FLASH_SORTED_RECORD_SIZE;
+    }
+    return 0;
+}
+static inline uint16_t flash_sorted_tail_next(const struct flash_sorted *sorted, int32_t after) {
+    uint32_t addr = flash_sorted_addr(sorted, 2);
+    uint16_t next = FLASH_SORTED_BLANK;
+    for(uint16_t offset = 0; offset < sorted->tail_offset; offset += FLASH_SORTED_RECORD_SIZE) {
+        uint16_t key = flash_read_16_bits(addr + offset + 2);
+        if(key != FLASH_SORTED_BLANK && key > after && key < next) {
+            next = key;
+        }
+    }
+    return next;
+}
+static inline uint8_t flash_sorted_erase(uint32_t addr, uint8_t n_pages) {
+    uint8_t status = FLASH_STATUS_OK;
+    for(uint8_t page = 0; page < n_pages && status == FLASH_STATUS_OK; page++) {
+        if(!flash_is_page_erased(addr + page * FLASH_PAGE_SIZE)) {
+            status = flash_erase_page_checked(addr + page * FLASH_PAGE_SIZE);
+        }
+    }
+    return status;
+}
+static inline uint8_t flash_sorted_mount(struct flash_sorted *sorted) {
+    if(sorted->segment_pages < 2 || sorted->segment_pages - 1 > FLASH_SORTED_MAX_DATA_PAGES || sorted->tail_pages == 0) {
+        return FLASH_STATUS_INVALID;
+    }
+    // The active segment is the committed one with the higher sequence number.
+    sorted->segment = FLASH_SORTED_NO_SEGMENT;
+    sorted->seq = 0;
+    sorted->count = 0;
+    uint8_t n_committed = 0;
+    for(uint8_t segment = 0; segment < 2; segment++) {
+        uint32_t addr = flash_sorted_addr(sorted, segment);
+        uint16_t seq = flash_read_16_bits(addr);
+        if(seq == FLASH_SORTED_BLANK) {
+            continue;
+        }
+        n_committed++;
+        if(sorted->segment == FLASH_SORTED_NO_SEGMENT || (int16_t)(seq - sorted->seq) > 0) {
+            sorted->segment = segment;
+            sorted->seq = seq;
+            sorted->count = flash_read_16_bits(addr + 2);
+        }
+    }
+    // Two committed segments mean a compaction lost power after its commit. The tail is merged already and its erase may have been cut
+    // short, leaving records with erased values: finish the compaction before anything reads it.
+    uint8_t status = FLASH_STATUS_OK;
+    if(n_committed == 2) {
+        flash_session_begin();
+        status = flash_sorted_erase(flash_sorted_addr(sorted, 2), sorted->tail_pages);
+        if(status == FLASH_STATUS_OK) {
+            status = flash_sorted_erase(flash_sorted_addr(sorted, sorted->segment ^ 1), sorted->segment_pages);
+        }
+        flash_session_end();
+    }
+    // Records are appended after the last used slot of the tail, a torn record included.
+    uint32_t addr = flash_sorted_addr(sorted, 2);
+    sorted->tail_offset = sorted->tail_pages * FLASH_PAGE_SIZE;
+    while(sorted->tail_offset > 0
+          && flash_read_16_bits(addr + sorted->tail_offset - 4) == FLASH_SORTED_BLANK
+          && flash_read_16_bits(addr + sorted->tail_offset - 2) == FLASH_SORTED_BLANK) {
+        sorted->tail_offset -= FLASH_SORTED_RECORD_SIZE;
+    }
+    return status;
+}
+static inline uint8_t flash_sorted_read(const struct flash_sorted *sorted, uint16_t key, uint16_t *value) {
+    // The tail is newer than the segment.
+    uint32_t addr = flash_sorted_tail_find(sorted, key);
+    if(addr == 0) {
+        addr = flash_sorted_segment_find(sorted, key);
+    }
+    if(addr == 0) {
+        return FLASH_STATUS_EMPTY;
+    }
+    *value = flash_read_16_bits(addr);
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_sorted_compact(struct flash_sorted *sorted) {
+    uint8_t target = sorted->segment == 0 ? 1 : 0;
+    uint32_t segment_addr = sorted->segment == FLASH_SORTED_NO_SEGMENT ? 0 : flash_sorted_addr(sorted, sorted->segment);
+    uint32_t addr = flash_sorted_addr(sorted, target);
+    uint16_t capacity = (sorted->segment_pages - 1) * FLASH_SORTED_RECORDS_PER_PAGE;
+    // Count the merged keys first, a merge that does not fit changes nothing.
+    uint16_t count = sorted->count;
+    for(int32_t key = flash_sorted_tail_next(sorted, -1); key != FLASH_SORTED_BLANK; key = flash_sorted_tail_next(sorted, key)) {
+        count += !flash_sorted_segment_find(sorted, key);
+    }
+    if(count > capacity) {
+        return FLASH_STATUS_FULL;
+    }
+    flash_session_begin();
+    uint8_t status = flash_sorted_erase(addr, sorted->segment_pages);
+    // Merge the sorted segment and the tail in key order, the tail value wins.
+    uint16_t index = 0;
+    uint16_t n = 0;
+    int32_t last = -1;
+    while(status == FLASH_STATUS_OK && index < count) {
+        uint16_t segment_key = n < sorted->count ? flash_read_16_bits(segment_addr + FLASH_PAGE_SIZE + n * FLASH_SORTED_RECORD_SIZE + 2) : FLASH_SORTED_BLANK;
+        uint16_t tail_key = flash_sorted_tail_next(sorted, last);
+        uint16_t key = segment_key < tail_key ? segment_key : tail_key;
+        uint32_t source = flash_sorted_tail_find(sorted, key);
+        if(segment_key == key) {
+            source = source ? source : segment_addr + FLASH_PAGE_SIZE + n * FLASH_SORTED_RECORD_SIZE;
+            n++;
+        }
+        uint32_t record = addr + FLASH_PAGE_SIZE + index * FLASH_SORTED_RECORD_SIZE;
+        // The first record of a data page goes into the header table as well.
+        if(index % FLASH_SORTED_RECORDS_PER_PAGE == 0) {
+            status = flash_program_16_checked(addr + FLASH_SORTED_HEADER_SIZE + index / FLASH_SORTED_RECORDS_PER_PAGE * 2, key);
+        }
+        if(status == FLASH_STATUS_OK) {
+            status = flash_program_16_checked(record, flash_read_16_bits(source));
+        }
+        if(status == FLASH_STATUS_OK) {
+            status = flash_program_16_checked(record + 2, key);
+        }
+        last = key;
+        index++;
+    }
+    // The sequence number commits the new segment, only then the tail and the old segment go.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 2, count);
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr, (uint16_t)(sorted->seq + 1) == FLASH_SORTED_BLANK ? 0 : sorted->seq + 1);
+    }
+    if(status == FLASH_STATUS_OK) {
+        sorted->seq = flash_read_16_bits(addr);
+        sorted->segment = target;
+        sorted->count = count;
+        status = flash_sorted_erase(flash_sorted_addr(sorted, 2), sorted->tail_pages);
+    }
+    if(status == FLASH_STATUS_OK) {
+        sorted->tail_offset = 0;
+        status = flash_sorted_erase(flash_sorted_addr(sorted, target ^ 1), sorted->segment_pages);
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_sorted_write(struct flash_sorted *sorted, uint16_t key, uint16_t value) {
+    if(key == FLASH_SORTED_BLANK) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Same value as stored, nothing to program.
+    uint16_t stored;
+    if(flash_sorted_read(sorted, key, &stored) == FLASH_STATUS_OK && stored == value) {
+        return FLASH_STATUS_OK;
+    }
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    if(sorted->tail_offset >= sorted->tail_pages * FLASH_PAGE_SIZE) {
+        status = flash_sorted_compact(sorted);
+    }
+    if(status == FLASH_STATUS_OK) {
+        uint32_t addr = flash_sorted_addr(sorted, 2) + sorted->tail_offset;
+        // The record slot is used up even if programming fails, a torn record is skipped by the readers.
+        sorted->tail_offset += FLASH_SORTED_RECORD_SIZE;
+        // The key is programmed last, it commits the record.
+        status = flash_program_16_checked(addr, value);
+        if(status == FLASH_STATUS_OK) {
+            status = flash_program_16_checked(addr + 2, key);
+        }
+    }
+    flash_session_end();
+    return status;
+}
+#endif // CH32V003_FLASH_SORTED_H
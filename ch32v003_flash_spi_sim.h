@@ -0,0 +1,111 @@
+/**
+ * @file
+ * @brief Simulated SPI EEPROM with a latency model, for testing ch32v003_flash_tier.h on the host.
+ *
+ * The simulation answers the 25xx commands used by the driver (WREN, RDSR, READ, WRITE) from a RAM array and keeps a simulated clock:
+ * every byte on the bus takes byte_ns, and a write keeps the WIP bit set for write_cycle_ns after chip select goes inactive, so the status
+ * polls of the driver advance the clock as well. Like a real device, a write wraps around within its page, is ignored without WREN and every
+ * command but RDSR is ignored during the write cycle.
+ *
+ * @section spi_sim_usage Usage
+ * Set memory, size, page_size, byte_ns and write_cycle_ns, and hand the simulation to the driver:
+ * @code
+ * struct flash_spi_eeprom eeprom = { { flash_spi_sim_select, flash_spi_sim_transfer, &sim }, 0, 32, 2 };
+ * @endcode
+ * now_ns is the simulated time spent on the device, writes and bytes count the write cycles and bus bytes.
+ * Typical values: 1 MHz SPI is byte_ns = 8000, a 25LC256 has write_cycle_ns = 5000000, an FRAM 0.
+ */
+#ifndef CH32V003_FLASH_SPI_SIM_H
+#define CH32V003_FLASH_SPI_SIM_H
+#include <stdint.h>
+/**
+ * @brief A simulated SPI EEPROM.
+ */
+struct flash_spi_sim {
+	uint8_t *memory;          // device contents, size bytes
+	uint32_t size;            // a power of two
+	uint16_t page_size;       // write page, a power of two
+	uint8_t addr_bytes;       // address bytes per command
+	uint32_t byte_ns;         // time per byte on the bus
+	uint32_t write_cycle_ns;  // time a write keeps the device busy
+	uint64_t now_ns;          // simulated time
+	uint64_t busy_until_ns;   // end of the running write cycle
+	uint32_t writes;          // write cycles
+	uint32_t bytes;           // bytes on the bus
+	uint8_t selected;         // chip select state
+	uint8_t write_enabled;    // WEL bit
+	uint8_t command;          // command of the current transaction, 0 before the first byte
+	uint8_t n_addr;           // address bytes received
+	uint8_t written;          // data bytes were written in this transaction
+	uint32_t addr;            // current address
+};
+/**
+ * @brief Drive the chip select of the simulated device, the select function of a struct flash_spi_bus.
+ *
+ * @param context The simulation.
+ * @param selected Non-zero to select.
+ */
+static inline void flash_spi_sim_select(void *context, uint8_t selected);
+/**
+ * @brief Shift a byte through the simulated device, the transfer function of a struct flash_spi_bus.
+ *
+ * @param context The simulation.
+ * @param byte The byte sent.
+ * @return uint8_t The byte received.
+ */
+static inline uint8_t flash_spi_sim_transfer(void *context, uint8_t byte);
+// Function Definitions
+static inline void flash_spi_sim_select(void *context, uint8_t selected) {
+    struct flash_spi_sim *sim = (struct flash_spi_sim*)context;
+    // Deselecting after a WRITE starts the write cycle.
+    if(sim->selected && !selected && sim->written) {
+        sim->busy_until_ns = sim->now_ns + sim->write_cycle_ns;
+        sim->write_enabled = 0;
+        sim->writes++;
+    }
+    sim->selected = selected;
+    sim->command = 0;
+    sim->n_addr = 0;
+    sim->written = 0;
+    sim->addr = 0;
+}
+static inline uint8_t flash_spi_sim_transfer(void *context, uint8_t byte) {
+    struct flash_spi_sim *sim = (struct flash_spi_sim*)context;
+    sim->now_ns += sim->byte_ns;
+    sim->bytes++;
+    uint8_t busy = sim->now_ns < sim->busy_until_ns;
+    if(!sim->selected) {
+        return 0xFF;
+    }
+    if(!sim->command) {
+        sim->command = byte;
+        if(byte == 0x06 && !busy) {
+            sim->write_enabled = 1;
+        }
+        return 0xFF;
+    }
+    if(sim->command == 0x05) {
+        return (uint8_t)(busy | sim->write_enabled << 1);
+    }
+    if(busy || (sim->command != 0x03 && sim->command != 0x02)) {
+        return 0xFF;
+    }
+    if(sim->n_addr < sim->addr_bytes) {
+        sim->addr = (sim->addr << 8 | byte) & (sim->size - 1);
+        sim->n_addr++;
+        return 0xFF;
+    }
+    if(sim->command == 0x03) {
+        uint8_t data = sim->memory[sim->addr];
+        sim->addr = (sim->addr + 1) & (sim->size - 1);
+        return data;
+    }
+    if(sim->write_enabled) {
+        // Page writes wrap around to the start of the page.
+        sim->memory[sim->addr] = byte;
+        sim->addr = (sim->addr & ~(uint32_t)(sim->page_size - 1)) | ((sim->addr + 1) & (sim->page_size - 1));
+        sim->written = 1;
+    }
+    return 0xFF;
+}
+#endif // CH32V003_FLASH_SPI_SIM_H
@@ -0,0 +1,752 @@
+/**
+ * @file
+ * @brief Log-structured key/value store with instant factory reset in CH32V003 flash memory.
+ *
+ * This header stores 16-bit values under 16-bit keys in a partition of whole pages. A write appends a record to the active page instead of
+ * erasing, a read returns the newest record of the key. Every page carries the generation it was written in; a factory reset programs a new
+ * generation number, which turns all older pages into garbage at the cost of a single half-word program. The old pages are erased later,
+ * either by flash_store_gc_step() in the background or when a write needs the page.
+ *
+ * @section store_usage Usage
+ * Reserve the store pages and two banks of at least one page each for the generation number at the end of the main flash (see overrides.ld),
+ * describe them in a struct flash_store and call flash_store_mount() once at boot.
+ * - flash_store_read() and flash_store_write() read and write a key. Writing the value that is already stored costs nothing.
+ * - flash_store_reset() forgets all keys with one program.
+ * - flash_store_gc_step() erases one stale page per call; call it when the application is idle so writes find pre-erased pages.
+ * When no free page is left for a write, the oldest page is compacted: its live records are copied to a fresh page and it is erased.
+ *
+ * @section store_wear Wear Leveling
+ * Every page header carries the number of times the page was erased. A new head page is always the least-worn free page, so pages that
+ * are reclaimed unevenly (e.g. after a factory reset) do not drift apart. Records that are never rewritten keep their page from being
+ * erased at all; once that page is more than FLASH_STORE_WEAR_SPREAD erases behind the most-worn free page, flash_store_gc_step() moves its
+ * records onto the most-worn free page and frees it for the frequent writes. The most-worn page is sealed after the move, so new records
+ * never go into it: the next write opens the least-worn free page. What limits the lifetime is the worst page, and this keeps it close to
+ * the mean.
+ *
+ * @section store_bad_pages Bad Pages
+ * Set bad_pages to a bitset partition (see ch32v003_flash_bitset.h) with one flag per store page to retire pages that fail. An erase that
+ * does not leave the page blank, or a program that does not read back (with FLASH_USE_VERIFY), marks the page bad with a single half-word program, and the write
+ * that hit it is retried on another page. Bad pages are never allocated again; one that still holds live records keeps serving reads until
+ * compaction moves them, then it is detached by programming its format to 0 instead of being erased. The store keeps working with fewer
+ * pages, flash_store_bad_pages() tells how many. Without a bitset the failed status is returned as before.
+ * With a bitset the store keeps two free pages instead of one, so a page that fails while compaction uses the spare does not leave it
+ * without a page to compact into; below that reserve, pages without live records are dropped first to get it back.
+ * @note If failures use up both spare pages, only pages without live records can still be freed. Once there is none, writes return
+ *       FLASH_STATUS_FULL: a page is never rewritten in place, which a power loss would turn into lost records.
+ * The functions open their own unlock session, the flash does not need to be unlocked by the caller.
+ *
+ * @section store_emergency Emergency Flush
+ * Values that change all the time (runtime counters, last position) can be kept in RAM with flash_store_write_deferred() and persisted
+ * only at power-down. Set emergency_addr to one more reserved page: the store keeps it erased, and flash_store_emergency_flush() dumps
+ * the deferred values into it with a single fast page program, no erase, which fits the few milliseconds left after a PVD warning.
+ * flash_store_mount() merges the page back into the store on the next boot and erases it again.
+ * - Call flash_store_emergency_flush() once flash_request_abort() has stopped any running commit; it ignores the abort request itself.
+ * - flash_store_flush() writes the deferred values the normal way, e.g. before a planned shutdown.
+ * - At most FLASH_STORE_DEFERRED_MAX values are deferred; deferring one more flushes them first.
+ *
+ * @section store_format On-Flash Format
+ * - The generation number is kept in two flash_slots variables (see ch32v003_flash_slots.h) in their own pages, written alternately: a reset
+ *   programs the bank that does not hold the current generation, and the mount takes the newer of the two. A power loss while one bank rolls
+ *   over its slots therefore leaves the other bank with the previous generation, never generation 0. Two blank banks mean generation 0.
+ * - A page starts with a header of four half-words: the page sequence number, the erase count, the format (FLASH_STORE_FORMAT) and the
+ *   generation. The erase count is programmed right after each erase, the generation is programmed last and commits the header.
+ *   A page belongs to the store only if its format and its generation equal the current ones. A blank erase count reads as 0.
+ * - The header is followed by 14 records of two half-words: the value, then the key. The key is programmed last and commits the record;
+ *   key 0xFFFF is blank, so it cannot be used.
+ * - The newest record of a key is the last one in the page with the highest sequence number.
+ * - The emergency page holds the CRC-16 of the rest of the page, the generation, two blank half-words and up to FLASH_STORE_DEFERRED_MAX
+ *   records in the same layout.
+ * - A page is sealed by programming the value of its last record slot and leaving the key blank: readers skip it like a torn record,
+ *   and the mount sees a full page.
+ */
+#ifndef CH32V003_FLASH_STORE_H
+#define CH32V003_FLASH_STORE_H
+#include "ch32v003_flash.h"
+#include "ch32v003_flash_slots.h"
+#include "ch32v003_flash_bitset.h"
+// Preprocessor Macros
+#define FLASH_STORE_HEADER_SIZE 8
+#define FLASH_STORE_FORMAT 1
+#define FLASH_STORE_RECORD_SIZE 4
+#define FLASH_STORE_RECORDS_PER_PAGE ((FLASH_PAGE_SIZE - FLASH_STORE_HEADER_SIZE) / FLASH_STORE_RECORD_SIZE)
+#define FLASH_STORE_BLANK 0xFFFF
+#define FLASH_STORE_NO_PAGE 0xFF
+#ifndef FLASH_STORE_DEFERRED_MAX
+#define FLASH_STORE_DEFERRED_MAX 8 // values kept in RAM by flash_store_write_deferred()
+#endif
+#ifndef FLASH_STORE_WEAR_SPREAD
+#define FLASH_STORE_WEAR_SPREAD 100 // erases a page holding static records may fall behind before they are moved
+#endif
+#if FLASH_STORE_DEFERRED_MAX > FLASH_STORE_RECORDS_PER_PAGE
+#error "FLASH_STORE_DEFERRED_MAX must fit into the emergency page"
+#endif
+/**
+ * @brief A store partition and its RAM state.
+ *
+ * start_addr, n_pages, generation_slots, emergency_addr and bad_pages describe the partition, the other fields are set up by flash_store_mount().
+ */
+struct flash_store {
+	uint32_t start_addr;                    // first page of the store, page aligned
+	uint8_t n_pages;                        // number of store pages, at least 2
+	struct flash_slots generation_slots[2]; // two banks holding the generation number, written alternately
+	uint32_t emergency_addr;                // pre-erased page for flash_store_emergency_flush(), 0 for none
+	struct flash_bitset bad_pages;          // one flag per store page for retired pages, n_pages 0 for none
+	uint16_t generation;                    // current generation
+	uint8_t head_page;                      // page records are appended to, FLASH_STORE_NO_PAGE if none is open
+	uint8_t head_offset;                    // byte offset of the next record in the head page
+	uint16_t next_seq;                      // sequence number of the next page opened
+	uint8_t n_deferred;                     // number of values kept in RAM
+	uint16_t deferred_keys[FLASH_STORE_DEFERRED_MAX];
+	uint16_t deferred_values[FLASH_STORE_DEFERRED_MAX];
+};
+/**
+ * @brief Mount the store.
+ *
+ * This function reads the generation, finds the head page and its first blank record and merges a filled emergency page back into the store.
+ *
+ * @param store The store.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if the store has less than 2 pages or the failed flash status of the merge.
+ */
+static inline uint8_t flash_store_mount(struct flash_store *store);
+/**
+ * @brief Read a key.
+ *
+ * @param store The store.
+ * @param key The key.
+ * @param value Receives the newest value of the key, deferred or stored.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_EMPTY if the key was not written since the last reset.
+ */
+static inline uint8_t flash_store_read(const struct flash_store *store, uint16_t key, uint16_t *value);
+/**
+ * @brief Write a key.
+ *
+ * This function appends a record to the head page. A full head page is replaced by a free page, compacting the oldest page if it is the last free one.
+ *
+ * @param store The store.
+ * @param key The key, anything but 0xFFFF.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for key 0xFFFF, FLASH_STATUS_FULL if compaction frees no space or the failed flash status.
+ */
+static inline uint8_t flash_store_write(struct flash_store *store, uint16_t key, uint16_t value);
+/**
+ * @brief Write a key in RAM only.
+ *
+ * This function keeps the value in RAM until flash_store_flush() or flash_store_emergency_flush(). When FLASH_STORE_DEFERRED_MAX other keys are already deferred, they are flushed first.
+ *
+ * @param store The store.
+ * @param key The key, anything but 0xFFFF.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for key 0xFFFF or the failed status of the flush.
+ */
+static inline uint8_t flash_store_write_deferred(struct flash_store *store, uint16_t key, uint16_t value);
+/**
+ * @brief Write the deferred values to the store.
+ *
+ * @param store The store.
+ * @return uint8_t FLASH_STATUS_OK or the failed status of flash_store_write(); the values not written stay deferred.
+ */
+static inline uint8_t flash_store_flush(struct flash_store *store);
+/**
+ * @brief Dump the deferred values into the emergency page.
+ *
+ * This function programs the deferred values into the pre-erased emergency page with a single fast page program and no erase.
+ *
+ * @param store The store.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID if there is no emergency page, FLASH_STATUS_FULL if it was already used since the last mount or the failed flash status.
+ */
+static inline uint8_t flash_store_emergency_flush(struct flash_store *store);
+/**
+ * @brief Forget all keys.
+ *
+ * This function programs the next generation number, all pages written so far become stale. Nothing is erased. Deferred values are dropped as well.
+ *
+ * @param store The store.
+ * @return uint8_t FLASH_STATUS_OK or the failed flash status.
+ */
+static inline uint8_t flash_store_reset(struct flash_store *store);
+/**
+ * @brief Erase one stale page, or level the wear if there is none.
+ *
+ * This function erases the first stale page. When all free pages are erased and the least-worn live page is more than FLASH_STORE_WEAR_SPREAD
+ * erases behind the most-worn free page, it moves the records of that live page onto the free page and erases it instead.
+ *
+ * @param store The store.
+ * @return uint8_t FLASH_STATUS_OK if a page was erased, FLASH_STATUS_EMPTY if there was nothing to do or the failed flash status.
+ */
+static inline uint8_t flash_store_gc_step(struct flash_store *store);
+/**
+ * @brief Count the retired pages.
+ *
+ * @param store The store.
+ * @return uint8_t The number of store pages marked bad.
+ */
+static inline uint8_t flash_store_bad_pages(const struct flash_store *store);
+// Internal Function Declarations
+/**
+ * @brief Return the address of a store page.
+ */
+static inline uint32_t flash_store_page_addr(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Check if a page belongs to the current generation.
+ */
+static inline uint8_t flash_store_page_is_live(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Find the newest record of a key. Returns its address, or 0 if there is none.
+ */
+static inline uint32_t flash_store_find(const struct flash_store *store, uint16_t key);
+/**
+ * @brief Return the erase count of a page.
+ */
+static inline uint16_t flash_store_erase_count(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Check if a page is erased apart from its erase count.
+ */
+static inline uint8_t flash_store_page_is_blank(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Check if a page was retired.
+ */
+static inline uint8_t flash_store_page_is_bad(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Mark a page bad after it failed verification. Returns FLASH_STATUS_INVALID if there is no bad page table.
+ */
+static inline uint8_t flash_store_retire_page(struct flash_store *store, uint8_t page);
+/**
+ * @brief Erase a page, check that it is blank and program its incremented erase count. A page that fails is retired.
+ */
+static inline uint8_t flash_store_erase_page(struct flash_store *store, uint8_t page);
+/**
+ * @brief Return the number of free (not live) pages and the least-worn one in page, preferring blank ones among equals.
+ */
+static inline uint8_t flash_store_count_free(const struct flash_store *store, uint8_t *page);
+/**
+ * @brief Erase a free page if needed, program its header and make it the head page.
+ */
+static inline uint8_t flash_store_open_page(struct flash_store *store, uint8_t page);
+/**
+ * @brief Append a record to the head page, which must have room.
+ */
+static inline uint8_t flash_store_append(struct flash_store *store, uint16_t key, uint16_t value);
+/**
+ * @brief Open a free page, move the live records of another page into it and erase that page. A sealed page takes no further records.
+ */
+static inline uint8_t flash_store_move(struct flash_store *store, uint8_t page, uint8_t free_page, uint8_t seal);
+/**
+ * @brief Move the live records of the oldest page that has a dead record into the last free page. Returns FLASH_STATUS_FULL if no page has one.
+ */
+static inline uint8_t flash_store_compact(struct flash_store *store, uint8_t free_page);
+/**
+ * @brief Count the records of a page that are the newest of their key.
+ */
+static inline uint8_t flash_store_count_live_records(const struct flash_store *store, uint8_t page);
+/**
+ * @brief Free a page without a free page to move to: erase a page without live records. Returns FLASH_STATUS_FULL if there is none.
+ */
+static inline uint8_t flash_store_reclaim(struct flash_store *store);
+/**
+ * @brief Move the records of the least-worn live page onto the most-worn free page if it fell too far behind.
+ */
+static inline uint8_t flash_store_level_wear(struct flash_store *store);
+/**
+ * @brief Return the index of a deferred key, or n_deferred if it is not deferred.
+ */
+static inline uint8_t flash_store_find_deferred(const struct flash_store *store, uint16_t key);
+/**
+ * @brief Write the records of a valid emergency page to the store and erase the page.
+ */
+static inline uint8_t flash_store_merge_emergency(struct flash_store *store);
+/**
+ * @brief Read the generation from the bank holding the newer one, 0 if both are blank.
+ */
+static inline uint16_t flash_store_read_generation(const struct flash_store *store);
+// Function Definitions
+static inline uint32_t flash_store_page_addr(const struct flash_store *store, uint8_t page) {
+    return store->start_addr + (uint32_t)page * FLASH_PAGE_SIZE;
+}
+static inline uint8_t flash_store_page_is_live(const struct flash_store *store, uint8_t page) {
+    uint32_t addr = flash_store_page_addr(store, page);
+    return flash_read_16_bits(addr + 6) == store->generation && flash_read_16_bits(addr + 4) == FLASH_STORE_FORMAT;
+}
+static inline uint16_t flash_store_erase_count(const struct flash_store *store, uint8_t page) {
+    uint16_t erases = flash_read_16_bits(flash_store_page_addr(store, page) + 2);
+    return erases == FLASH_STORE_BLANK ? 0 : erases;
+}
+static inline uint8_t flash_store_page_is_blank(const struct flash_store *store, uint8_t page) {
+    uint32_t addr = flash_store_page_addr(store, page);
+    for(uint8_t offset = 0; offset < FLASH_PAGE_SIZE; offset += 2) {
+        if(offset != 2 && flash_read_16_bits(addr + offset) != FLASH_STORE_BLANK) {
+            return 0;
+        }
+    }
+    return 1;
+}
+static inline uint8_t flash_store_page_is_bad(const struct flash_store *store, uint8_t page) {
+    return store->bad_pages.n_pages && flash_bitset_test(&store->bad_pages, page);
+}
+static inline uint8_t flash_store_retire_page(struct flash_store *store, uint8_t page) {
+    if(!store->bad_pages.n_pages) {
+        return FLASH_STATUS_INVALID;
+    }
+    return flash_bitset_set(&store->bad_pages, page);
+}
+static inline uint8_t flash_store_erase_page(struct flash_store *store, uint8_t page) {
+    uint32_t addr = flash_store_page_addr(store, page);
+    uint16_t erases = flash_store_erase_count(store, page);
+    // Detach a live page first: an erase cut short could leave its header intact over half-erased records and a half-erased sequence number.
+    uint8_t status = FLASH_STATUS_OK;
+    if(flash_store_page_is_live(store, page)) {
+        status = flash_program_16_checked(addr + 4, 0);
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_erase_page_checked(addr);
+    }
+    if(status == FLASH_STATUS_OK && !flash_is_page_erased(addr)) {
+        // Whatever the erase left behind must not read as a live page.
+        flash_program_16_checked(addr + 4, 0);
+        status = FLASH_STATUS_VERIFY_FAILED;
+    }
+    // The count goes back in right away, a page without generation stays free. It saturates below the blank value.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 2, erases + 1 < FLASH_STORE_BLANK ? erases + 1 : erases);
+    }
+    if(status == FLASH_STATUS_VERIFY_FAILED) {
+        flash_store_retire_page(store, page);
+    }
+    return status;
+}
+static inline uint32_t flash_store_find(const struct flash_store *store, uint16_t key) {
+    if(store->head_page == FLASH_STORE_NO_PAGE) {
+        return 0;
+    }
+    uint16_t head_seq = store->next_seq - 1;
+    uint16_t best_age = 0xFFFF;
+    uint32_t found = 0;
+    for(uint8_t page = 0; page < store->n_pages; page++) {
+        if(!flash_store_page_is_live(store, page)) {
+            continue;
+        }
+        // The age of a page is its distance to the head page, newer pages are younger.
+        uint32_t addr = flash_store_page_addr(store, page);
+        uint16_t age = head_seq - flash_read_16_bits(addr);
+        if(age >= best_age) {
+            continue;
+        }
+        // The last record of the key in the page is the newest one.
+        for(uint8_t offset = FLASH_STORE_HEADER_SIZE; offset < FLASH_PAGE_SIZE; offset += FLASH_STORE_RECORD_SIZE) {
+            if(flash_read_16_bits(addr + offset + 2) == key) {
+                found = addr + offset;
+                best_age = age;
+            }
+        }
+    }
+    return found;
+}
+static inline uint8_t flash_store_count_free(const struct flash_store *store, uint8_t *page) {
+    uint8_t count = 0;
+    uint16_t best_erases = 0;
+    uint8_t best_blank = 0;
+    *page = FLASH_STORE_NO_PAGE;
+    for(uint8_t n = 0; n < store->n_pages; n++) {
+        if(flash_store_page_is_live(store, n) || flash_store_page_is_bad(store, n)) {
+            continue;
+        }
+        count++;
+        // The least-worn page wins, a page that needs no erase breaks a tie.
+        uint16_t erases = flash_store_erase_count(store, n);
+        uint8_t blank = flash_store_page_is_blank(store, n);
+        if(*page == FLASH_STORE_NO_PAGE || erases < best_erases || (erases == best_erases && blank && !best_blank)) {
+            *page = n;
+            best_erases = erases;
+            best_blank = blank;
+        }
+    }
+    return count;
+}
+static inline uint8_t flash_store_open_page(struct flash_store *store, uint8_t page) {
+    uint32_t addr = flash_store_page_addr(store, page);
+    uint8_t status = FLASH_STATUS_OK;
+    if(!flash_store_page_is_blank(store, page)) {
+        status = flash_store_erase_page(store, page);
+    }
+    // The generation is programmed last, it commits the header.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr, store->next_seq);
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 4, FLASH_STORE_FORMAT);
+    }
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 6, store->generation);
+    }
+    if(status == FLASH_STATUS_VERIFY_FAILED) {
+        flash_store_retire_page(store, page);
+    }
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    store->head_page = page;
+    store->head_offset = FLASH_STORE_HEADER_SIZE;
+    store->next_seq++;
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_store_append(struct flash_store *store, uint16_t key, uint16_t value) {
+    uint32_t addr = flash_store_page_addr(store, store->head_page) + store->head_offset;
+    // The record slot is used up even if programming fails, a torn record is skipped by the readers.
+    store->head_offset += FLASH_STORE_RECORD_SIZE;
+    // The key is programmed last, it commits the record.
+    uint8_t status = flash_program_16_checked(addr, value);
+    if(status == FLASH_STATUS_OK) {
+        status = flash_program_16_checked(addr + 2, key);
+    }
+    // Nothing more goes into a page that failed, its records stay readable until compaction moves them.
+    if(status == FLASH_STATUS_VERIFY_FAILED) {
+        flash_store_retire_page(store, store->head_page);
+        store->head_offset = FLASH_PAGE_SIZE;
+    }
+    return status;
+}
+static inline uint8_t flash_store_compact(struct flash_store *store, uint8_t free_page) {
+    // The oldest live page is the one farthest from the head.
+    uint16_t head_seq = store->next_seq - 1;
+    uint8_t oldest = FLASH_STORE_NO_PAGE;
+    uint16_t oldest_age = 0;
+    for(uint8_t page = 0; page < store->n_pages; page++) {
+        if(!flash_store_page_is_live(store, page)) {
+            continue;
+        }
+        uint16_t age = head_seq - flash_read_16_bits(flash_store_page_addr(store, page));
+        // Moving a page whose records are all live frees nothing and only costs an erase.
+        if((oldest == FLASH_STORE_NO_PAGE || age > oldest_age) && flash_store_count_live_records(store, page) < FLASH_STORE_RECORDS_PER_PAGE) {
+            oldest = page;
+            oldest_age = age;
+        }
+    }
+    if(oldest == FLASH_STORE_NO_PAGE) {
+        return FLASH_STATUS_FULL;
+    }
+    return flash_store_move(store, oldest, free_page, 0);
+}
+static inline uint8_t flash_store_move(struct flash_store *store, uint8_t page, uint8_t free_page, uint8_t seal) {
+    uint8_t status = flash_store_open_page(store, free_page);
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    // Copy the records that are still the newest of their key; a page holds at most as many as the fresh page.
+    uint32_t addr = flash_store_page_addr(store, page);
+    for(uint8_t offset = FLASH_STORE_HEADER_SIZE; offset < FLASH_PAGE_SIZE && status == FLASH_STATUS_OK; offset += FLASH_STORE_RECORD_SIZE) {
+        uint16_t key = flash_read_16_bits(addr + offset + 2);
+        if(key != FLASH_STORE_BLANK && flash_store_find(store, key) == addr + offset) {
+            status = flash_store_append(store, key, flash_read_16_bits(addr + offset));
+        }
+    }
+    // Seal before the erase, so the page is full for the mount whenever the old copies are gone.
+    if(status == FLASH_STATUS_OK && seal && store->head_offset < FLASH_PAGE_SIZE) {
+        store->head_offset = FLASH_PAGE_SIZE;
+        status = flash_program_16_checked(flash_store_page_addr(store, free_page) + FLASH_PAGE_SIZE - FLASH_STORE_RECORD_SIZE, 0);
+        if(status == FLASH_STATUS_VERIFY_FAILED) {
+            flash_store_retire_page(store, free_page);
+        }
+    }
+    // A power loss before this erase leaves duplicates, which the newer copy shadows. A bad page is detached, not erased.
+    if(status == FLASH_STATUS_OK && flash_store_page_is_bad(store, page)) {
+        status = flash_program_16_checked(addr + 4, 0);
+    } else if(status == FLASH_STATUS_OK) {
+        status = flash_store_erase_page(store, page);
+    }
+    return status;
+}
+static inline uint8_t flash_store_count_live_records(const struct flash_store *store, uint8_t page) {
+    uint32_t addr = flash_store_page_addr(store, page);
+    uint8_t count = 0;
+    for(uint8_t offset = FLASH_STORE_HEADER_SIZE; offset < FLASH_PAGE_SIZE; offset += FLASH_STORE_RECORD_SIZE) {
+        uint16_t key = flash_read_16_bits(addr + offset + 2);
+        count += key != FLASH_STORE_BLANK && flash_store_find(store, key) == addr + offset;
+    }
+    return count;
+}
+static inline uint8_t flash_store_reclaim(struct flash_store *store) {
+    for(uint8_t page = 0; page < store->n_pages; page++) {
+        // Only a page without live records can go: rewriting one in place would lose them to a power loss.
+        if(page == store->head_page || !flash_store_page_is_live(store, page) || flash_store_count_live_records(store, page)) {
+            continue;
+        }
+        if(flash_store_page_is_bad(store, page)) {
+            return flash_program_16_checked(flash_store_page_addr(store, page) + 4, 0);
+        }
+        return flash_store_erase_page(store, page);
+    }
+    return FLASH_STATUS_FULL;
+}
+static inline uint8_t flash_store_level_wear(struct flash_store *store) {
+    uint8_t coldest = FLASH_STORE_NO_PAGE;
+    uint8_t worn = FLASH_STORE_NO_PAGE;
+    uint16_t coldest_erases = 0;
+    uint16_t worn_erases = 0;
+    for(uint8_t page = 0; page < store->n_pages; page++) {
+        uint16_t erases = flash_store_erase_count(store, page);
+        if(flash_store_page_is_live(store, page)) {
+            if(coldest == FLASH_STORE_NO_PAGE || erases < coldest_erases) {
+                coldest = page;
+                coldest_erases = erases;
+            }
+        } else if(!flash_store_page_is_bad(store, page) && (worn == FLASH_STORE_NO_PAGE || erases > worn_erases)) {
+            worn = page;
+            worn_erases = erases;
+        }
+    }
+    if(coldest == FLASH_STORE_NO_PAGE || worn == FLASH_STORE_NO_PAGE || (uint32_t)coldest_erases + FLASH_STORE_WEAR_SPREAD >= worn_erases) {
+        return FLASH_STATUS_EMPTY;
+    }
+    // Records that stay put wear the page they land on least, so they go to the most-worn page, sealed so the frequent writes go elsewhere.
+    return flash_store_move(store, coldest, worn, 1);
+}
+static inline uint16_t flash_store_read_generation(const struct flash_store *store) {
+    uint16_t generation[2];
+    uint8_t found[2];
+    for(uint8_t bank = 0; bank < 2; bank++) {
+        found[bank] = flash_slots_read(&store->generation_slots[bank], &generation[bank]) == FLASH_STATUS_OK;
+    }
+    // Generations wrap, so compare their difference.
+    if(found[1] && (!found[0] || (int16_t)(generation[1] - generation[0]) > 0)) {
+        return generation[1];
+    }
+    return found[0] ? generation[0] : 0;
+}
+static inline uint8_t flash_store_mount(struct flash_store *store) {
+    if(store->n_pages < 2) {
+        return FLASH_STATUS_INVALID;
+    }
+    store->generation = flash_store_read_generation(store);
+    // The head page is the live page with the highest sequence number.
+    store->head_page = FLASH_STORE_NO_PAGE;
+    uint16_t head_seq = 0;
+    for(uint8_t page = 0; page < store->n_pages; page++) {
+        if(!flash_store_page_is_live(store, page)) {
+            continue;
+        }
+        uint16_t seq = flash_read_16_bits(flash_store_page_addr(store, page));
+        if(store->head_page == FLASH_STORE_NO_PAGE || (int16_t)(seq - head_seq) > 0) {
+            store->head_page = page;
+            head_seq = seq;
+        }
+    }
+    store->next_seq = head_seq + 1;
+    store->n_deferred = 0;
+    if(store->head_page != FLASH_STORE_NO_PAGE) {
+        // Records are appended after the last used slot, a torn record included.
+        uint32_t addr = flash_store_page_addr(store, store->head_page);
+        store->head_offset = FLASH_PAGE_SIZE;
+        while(store->head_offset > FLASH_STORE_HEADER_SIZE
+              && flash_read_16_bits(addr + store->head_offset - 4) == FLASH_STORE_BLANK
+              && flash_read_16_bits(addr + store->head_offset - 2) == FLASH_STORE_BLANK) {
+            store->head_offset -= FLASH_STORE_RECORD_SIZE;
+        }
+        // Nothing is appended to a retired head page.
+        if(flash_store_page_is_bad(store, store->head_page)) {
+            store->head_offset = FLASH_PAGE_SIZE;
+        }
+    }
+    if(store->emergency_addr && !flash_is_page_erased(store->emergency_addr)) {
+        return flash_store_merge_emergency(store);
+    }
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_store_merge_emergency(struct flash_store *store) {
+    uint32_t addr = store->emergency_addr;
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    // A page torn by the power loss or left over from an older generation is dropped.
+    if(flash_read_16_bits(addr) == flash_crc16(0xFFFF, (const void*)(uintptr_t)(addr + 2), FLASH_PAGE_SIZE - 2)
+       && flash_read_16_bits(addr + 2) == store->generation) {
+        for(uint8_t offset = FLASH_STORE_HEADER_SIZE; offset < FLASH_PAGE_SIZE && status == FLASH_STATUS_OK; offset += FLASH_STORE_RECORD_SIZE) {
+            uint16_t key = flash_read_16_bits(addr + offset + 2);
+            if(key != FLASH_STORE_BLANK) {
+                status = flash_store_write(store, key, flash_read_16_bits(addr + offset));
+            }
+        }
+    }
+    // Erase only once the records are in the store, a power loss before that merges them again.
+    if(status == FLASH_STATUS_OK) {
+        status = flash_erase_page_checked(addr);
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_store_find_deferred(const struct flash_store *store, uint16_t key) {
+    uint8_t n = 0;
+    while(n < store->n_deferred && store->deferred_keys[n] != key) {
+        n++;
+    }
+    return n;
+}
+static inline uint8_t flash_store_read(const struct flash_store *store, uint16_t key, uint16_t *value) {
+    // A deferred value is newer than anything in flash.
+    uint8_t n = flash_store_find_deferred(store, key);
+    if(n < store->n_deferred) {
+        *value = store->deferred_values[n];
+        return FLASH_STATUS_OK;
+    }
+    uint32_t addr = flash_store_find(store, key);
+    if(addr == 0) {
+        return FLASH_STATUS_EMPTY;
+    }
+    *value = flash_read_16_bits(addr);
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_store_write(struct flash_store *store, uint16_t key, uint16_t value) {
+    if(key == FLASH_STORE_BLANK) {
+        return FLASH_STATUS_INVALID;
+    }
+    // Same value as stored, nothing to program.
+    uint32_t addr = flash_store_find(store, key);
+    uint8_t status = addr && flash_read_16_bits(addr) == value ? FLASH_STATUS_OK : FLASH_STATUS_FULL;
+    flash_session_begin();
+    // Every compaction frees at least one record slot or reports FLASH_STATUS_FULL, and every retirement uses a page up, so n_pages rounds are enough to find room or give up.
+    for(uint8_t round = 0; round <= store->n_pages && status != FLASH_STATUS_OK; round++) {
+        if(store->head_page != FLASH_STORE_NO_PAGE && store->head_offset < FLASH_PAGE_SIZE) {
+            status = flash_store_append(store, key, value);
+            // The head page was retired, retry on the next one.
+            if(status == FLASH_STATUS_VERIFY_FAILED && store->bad_pages.n_pages) {
+                status = FLASH_STATUS_FULL;
+                continue;
+            }
+            break;
+        }
+        // Keep one free page in reserve for compaction, and a second one against a page failing while compaction uses the first.
+        uint8_t page;
+        uint8_t n_free = flash_store_count_free(store, &page);
+        uint8_t reserve = store->bad_pages.n_pages ? 2 : 1;
+        if(n_free > reserve) {
+            status = flash_store_open_page(store, page);
+        } else {
+            // Below the reserve, a page without live records is dropped first, which gets a free page back.
+            status = n_free < reserve ? flash_store_reclaim(store) : FLASH_STATUS_FULL;
+            if(status == FLASH_STATUS_FULL && n_free) {
+                status = flash_store_compact(store, page);
+            }
+        }
+        // A page that failed verification was retired, the next round picks another one.
+        if(status == FLASH_STATUS_VERIFY_FAILED && store->bad_pages.n_pages) {
+            status = FLASH_STATUS_FULL;
+            continue;
+        }
+        if(status != FLASH_STATUS_OK) {
+            break;
+        }
+        status = FLASH_STATUS_FULL;
+    }
+    flash_session_end();
+    // The value is in flash now, which supersedes a deferred value of the key.
+    uint8_t n = flash_store_find_deferred(store, key);
+    if(status == FLASH_STATUS_OK && n < store->n_deferred) {
+        store->n_deferred--;
+        store->deferred_keys[n] = store->deferred_keys[store->n_deferred];
+        store->deferred_values[n] = store->deferred_values[store->n_deferred];
+    }
+    return status;
+}
+static inline uint8_t flash_store_write_deferred(struct flash_store *store, uint16_t key, uint16_t value) {
+    if(key == FLASH_STORE_BLANK) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint8_t n = flash_store_find_deferred(store, key);
+    if(n == store->n_deferred) {
+        // No room for another key, make some by flushing.
+        if(n == FLASH_STORE_DEFERRED_MAX) {
+            uint8_t status = flash_store_flush(store);
+            if(status != FLASH_STATUS_OK) {
+                return status;
+            }
+            n = 0;
+        }
+        store->deferred_keys[n] = key;
+        store->n_deferred++;
+    }
+    store->deferred_values[n] = value;
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_store_flush(struct flash_store *store) {
+    uint8_t status = FLASH_STATUS_OK;
+    flash_session_begin();
+    // flash_store_write() drops the deferred copy of every key it writes, so the list shrinks from the end.
+    while(store->n_deferred && status == FLASH_STATUS_OK) {
+        uint8_t n = store->n_deferred - 1;
+        status = flash_store_write(store, store->deferred_keys[n], store->deferred_values[n]);
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_store_emergency_flush(struct flash_store *store) {
+    if(!store->emergency_addr) {
+        return FLASH_STATUS_INVALID;
+    }
+    if(!store->n_deferred) {
+        return FLASH_STATUS_OK;
+    }
+    // No time for an erase, the page has to be blank already.
+    if(!flash_is_page_erased(store->emergency_addr)) {
+        return FLASH_STATUS_FULL;
+    }
+    // Lay the page out in RAM: CRC, generation, then the records.
+    union {
+        uint32_t u32[FLASH_PAGE_SIZE / 4];
+        uint16_t u16[FLASH_PAGE_SIZE / 2];
+    } page;
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 4; n++) {
+        page.u32[n] = 0xFFFFFFFF;
+    }
+    page.u16[1] = store->generation;
+    for(uint8_t n = 0; n < store->n_deferred; n++) {
+        page.u16[FLASH_STORE_HEADER_SIZE / 2 + n * 2] = store->deferred_values[n];
+        page.u16[FLASH_STORE_HEADER_SIZE / 2 + n * 2 + 1] = store->deferred_keys[n];
+    }
+    page.u16[0] = flash_crc16(0xFFFF, &page.u16[1], FLASH_PAGE_SIZE - 2);
+    // This is the operation the abort request made room for, let it through.
+    uint8_t aborted = flash_abort_requested;
+    flash_abort_requested = 0;
+    flash_session_begin();
+    uint8_t status = flash_program_page_checked(store->emergency_addr, page.u32);
+    flash_session_end();
+    flash_abort_requested = aborted;
+    if(status == FLASH_STATUS_OK) {
+        store->n_deferred = 0;
+    }
+    return status;
+}
+static inline uint8_t flash_store_reset(struct flash_store *store) {
+    // 0xFFFF cannot be stored in the slots, wrap around to 0.
+    uint16_t generation = store->generation + 1;
+    if(generation == FLASH_SLOTS_BLANK) {
+        generation = 0;
+    }
+    // Write the bank that does not hold the current generation, the other one keeps it if this write is cut short.
+    uint16_t current = FLASH_SLOTS_BLANK;
+    flash_slots_read(&store->generation_slots[0], &current);
+    uint8_t bank = current == store->generation;
+    uint8_t status = flash_slots_write(&store->generation_slots[bank], generation);
+    if(status != FLASH_STATUS_OK) {
+        return status;
+    }
+    store->generation = generation;
+    store->head_page = FLASH_STORE_NO_PAGE;
+    store->n_deferred = 0;
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_store_gc_step(struct flash_store *store) {
+    uint8_t status = FLASH_STATUS_EMPTY;
+    flash_session_begin();
+    for(uint8_t page = 0; page < store->n_pages && status == FLASH_STATUS_EMPTY; page++) {
+        if(!flash_store_page_is_live(store, page) && !flash_store_page_is_bad(store, page) && !flash_store_page_is_blank(store, page)) {
+            status = flash_store_erase_page(store, page);
+        }
+    }
+    // Only level the wear once every free page is erased.
+    if(status == FLASH_STATUS_EMPTY) {
+        status = flash_store_level_wear(store);
+    }
+    flash_session_end();
+    return status;
+}
+static inline uint8_t flash_store_bad_pages(const struct flash_store *store) {
+    return store->bad_pages.n_pages ? flash_bitset_count(&store->bad_pages) : 0;
+}
+#endif // CH32V003_FLASH_STORE_H
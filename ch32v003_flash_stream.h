@@ -0,0 +1,183 @@
+/**
+ * @file
+ * @brief Double-buffered streaming writes into CH32V003 flash memory.
+ *
+ * This header writes a byte stream (e.g. a settings file received over UART) into consecutive pages of main flash without stopping the
+ * sender while a page is erased or programmed. Incoming bytes fill one 64-byte staging buffer while the other one is erased and programmed
+ * asynchronously; the writer only pushes back when both buffers are full.
+ *
+ * @section stream_usage Usage
+ * Reserve the target pages at the end of the main flash (see overrides.ld) and describe them in a struct flash_stream with start_addr and n_pages.
+ * 1. Call flash_stream_open(); it unlocks the flash for the whole transfer.
+ * 2. Hand every received chunk to flash_stream_write(). It takes as many bytes as fit and returns that number, keep the rest and offer it again.
+ * 3. Call flash_stream_poll() from the main loop so the next page starts as soon as the controller is idle.
+ * 4. Call flash_stream_close() at the end of the stream; it pads the last page with 0xFF and waits for everything to be programmed.
+ *
+ * The CPU stalls on any flash access while a page operation runs, so the receive path must not depend on the CPU fetching code from flash:
+ * receive into a RAM ring buffer with DMA, or mark the UART interrupt handler FLASH_RAM_FUNC. At 115200 baud a page arrives every 5.5 ms, which
+ * covers an erase and a page program; erasing the target pages before the transfer leaves even more headroom.
+ */
+#ifndef CH32V003_FLASH_STREAM_H
+#define CH32V003_FLASH_STREAM_H
+#include "ch32v003_flash.h"
+/**
+ * @brief The page operation a stream is waiting for.
+ */
+enum flash_stream_state {
+	FLASH_STREAM_IDLE = 0,
+	FLASH_STREAM_ERASING,
+	FLASH_STREAM_PROGRAMMING,
+};
+/**
+ * @brief A stream target and its staging buffers.
+ *
+ * start_addr and n_pages describe the target, the other fields are set up by flash_stream_open().
+ */
+struct flash_stream {
+	uint32_t start_addr;  // first page of the target, page aligned
+	uint8_t n_pages;      // number of pages
+	uint8_t page;         // page the next full buffer goes to
+	uint8_t state;        // enum flash_stream_state
+	uint8_t status;       // first failed FLASH_STATUS_*, sticky
+	uint8_t fill;         // buffer being filled
+	uint8_t fill_count;   // bytes in the buffer being filled
+	uint8_t n_full;       // full buffers waiting for or being programmed
+	uint32_t buffers[2][FLASH_PAGE_SIZE / 4];
+};
+/**
+ * @brief Start a stream.
+ *
+ * This function resets the stream and opens an unlock session that lasts until flash_stream_close().
+ *
+ * @param stream The stream.
+ */
+static inline void flash_stream_open(struct flash_stream *stream);
+/**
+ * @brief Add bytes to the stream.
+ *
+ * This function copies as many bytes as fit into the staging buffers and starts the next page operation if the controller is idle. It never waits for the controller.
+ *
+ * @param stream The stream.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return uint16_t The number of bytes taken, less than length when both buffers are full or the stream failed.
+ */
+static inline uint16_t flash_stream_write(struct flash_stream *stream, const uint8_t *data, uint16_t length);
+/**
+ * @brief Advance the page operations.
+ *
+ * This function collects a finished erase or program and starts the next one. It never waits for the controller.
+ *
+ * @param stream The stream.
+ * @return uint8_t FLASH_STATUS_OK or the first failed status, FLASH_STATUS_FULL if the stream ran past the last page.
+ */
+static inline uint8_t flash_stream_poll(struct flash_stream *stream);
+/**
+ * @brief Finish the stream.
+ *
+ * This function pads the last buffer with 0xFF, waits until all buffers are programmed and closes the unlock session.
+ *
+ * @param stream The stream.
+ * @return uint8_t FLASH_STATUS_OK or the first failed status.
+ */
+static inline uint8_t flash_stream_close(struct flash_stream *stream);
+// Internal Function Declarations
+/**
+ * @brief Return the address of the page the next full buffer goes to.
+ */
+static inline uint32_t flash_stream_page_addr(const struct flash_stream *stream);
+// Function Definitions
+static inline uint32_t flash_stream_page_addr(const struct flash_stream *stream) {
+    return stream->start_addr + (uint32_t)stream->page * FLASH_PAGE_SIZE;
+}
+static inline void flash_stream_open(struct flash_stream *stream) {
+    stream->page = 0;
+    stream->state = FLASH_STREAM_IDLE;
+    stream->status = FLASH_STATUS_OK;
+    stream->fill = 0;
+    stream->fill_count = 0;
+    stream->n_full = 0;
+    flash_session_begin();
+}
+static inline uint8_t flash_stream_poll(struct flash_stream *stream) {
+    // Nothing to collect while the controller is still busy.
+    if(stream->status != FLASH_STATUS_OK || flash_is_busy()) {
+        return stream->status;
+    }
+    // The oldest full buffer is the one being programmed.
+    uint32_t *buffer = stream->buffers[stream->fill ^ (stream->n_full == 1)];
+    uint32_t addr = flash_stream_page_addr(stream);
+    if(stream->state == FLASH_STREAM_ERASING) {
+        stream->status = flash_erase_page_finish(addr);
+        stream->state = FLASH_STREAM_IDLE;
+        if(stream->status == FLASH_STATUS_OK) {
+            stream->status = flash_program_page_start(addr, buffer);
+        }
+        if(stream->status == FLASH_STATUS_OK) {
+            stream->state = FLASH_STREAM_PROGRAMMING;
+        }
+        return stream->status;
+    }
+    if(stream->state == FLASH_STREAM_PROGRAMMING) {
+        stream->status = flash_program_page_finish(addr, buffer);
+        stream->state = FLASH_STREAM_IDLE;
+        stream->page++;
+        stream->n_full--;
+        if(stream->status != FLASH_STATUS_OK || !stream->n_full) {
+            return stream->status;
+        }
+        buffer = stream->buffers[stream->fill ^ 1];
+        addr = flash_stream_page_addr(stream);
+    }
+    // Start on the next full buffer, the erase first if the page needs one.
+    if(stream->n_full) {
+        if(stream->page >= stream->n_pages) {
+            stream->status = FLASH_STATUS_FULL;
+        } else if(flash_is_page_erased(addr)) {
+            stream->status = flash_program_page_start(addr, buffer);
+            stream->state = stream->status == FLASH_STATUS_OK ? FLASH_STREAM_PROGRAMMING : FLASH_STREAM_IDLE;
+        } else {
+            stream->status = flash_erase_page_start(addr);
+            stream->state = stream->status == FLASH_STATUS_OK ? FLASH_STREAM_ERASING : FLASH_STREAM_IDLE;
+        }
+    }
+    return stream->status;
+}
+static inline uint16_t flash_stream_write(struct flash_stream *stream, const uint8_t *data, uint16_t length) {
+    uint16_t taken = 0;
+    while(taken < length && stream->n_full < 2 && stream->status == FLASH_STATUS_OK) {
+        ((uint8_t*)stream->buffers[stream->fill])[stream->fill_count++] = data[taken++];
+        // A full buffer is queued for programming and filling moves on to the other one.
+        if(stream->fill_count == FLASH_PAGE_SIZE) {
+            stream->fill_count = 0;
+            stream->fill ^= 1;
+            stream->n_full++;
+            flash_stream_poll(stream);
+        }
+    }
+    return taken;
+}
+static inline uint8_t flash_stream_close(struct flash_stream *stream) {
+    // Pad the last page, the padding reads like erased flash.
+    if(stream->fill_count && stream->n_full < 2) {
+        while(stream->fill_count < FLASH_PAGE_SIZE) {
+            ((uint8_t*)stream->buffers[stream->fill])[stream->fill_count++] = 0xFF;
+        }
+        stream->fill_count = 0;
+        stream->fill ^= 1;
+        stream->n_full++;
+    }
+    while(stream->n_full && stream->status == FLASH_STATUS_OK) {
+        flash_stream_poll(stream);
+    }
+    // Leave the controller idle, even after a failure.
+    if(stream->state == FLASH_STREAM_ERASING) {
+        flash_erase_page_finish(flash_stream_page_addr(stream));
+    } else if(stream->state == FLASH_STREAM_PROGRAMMING) {
+        flash_program_page_finish(flash_stream_page_addr(stream), stream->buffers[stream->fill ^ (stream->n_full == 1)]);
+    }
+    stream->state = FLASH_STREAM_IDLE;
+    flash_session_end();
+    return stream->status;
+}
+#endif // CH32V003_FLASH_STREAM_H
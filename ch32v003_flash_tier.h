@@ -0,0 +1,328 @@
+/**
+ * @file
+ * @brief Tiered key/value storage: an external SPI EEPROM for hot keys, the internal flash for cold ones.
+ *
+ * The internal flash wears out after about 10,000 erases, a 25xx SPI EEPROM or FRAM takes a million writes or more per byte and needs no erase.
+ * This header puts both behind one key/value API. Each device is a backend, a struct flash_tier_ops vtable plus its context, and a placement
+ * policy keeps a write counter per key: keys written often move to the external device, keys that calm down move back to the internal flash.
+ *
+ * @section tier_backends Backends
+ * - flash_tier_store_ops: the internal flash through the log-structured store of ch32v003_flash_store.h, the context is a mounted struct flash_store.
+ * - flash_tier_eeprom_ops: an SPI EEPROM or FRAM with the 25xx command set, the context is a struct flash_spi_eeprom. The application supplies
+ *   the SPI transfer and chip select functions in its struct flash_spi_bus. Each key owns a record of its value and the inverted value at
+ *   base_addr + 4 * key, a record that does not match its inverse is empty.
+ * Other devices plug in by filling a struct flash_tier_ops; remove may be NULL for the cold backend, the hot backend needs it. ch32v003_flash_spi_sim.h simulates an
+ * SPI EEPROM with a latency model on the host.
+ *
+ * @section tier_policy Placement Policy
+ * - Every write increments the counter of its key. A key that reaches FLASH_TIER_HOT_WRITES is hot: it is written to the hot backend from then on.
+ * - Every FLASH_TIER_WINDOW writes all counters are halved. A hot key whose counter has dropped to 0 is cold again: its value is written to
+ *   the cold backend and removed from the hot one, all within the write that closes the window.
+ * - A key held by the hot backend is read from there, every other key from the cold backend. The hot copy always wins, so a power loss
+ *   during a move leaves the old or the new placement, never a lost value.
+ * flash_tier_mount() rebuilds the placement at boot from the records of the hot backend; the counters start at 0.
+ */
+#ifndef CH32V003_FLASH_TIER_H
+#define CH32V003_FLASH_TIER_H
+#include "ch32v003_flash.h"
+#include "ch32v003_flash_store.h"
+// Preprocessor Macros
+#ifndef FLASH_TIER_KEYS
+#define FLASH_TIER_KEYS 32 // keys 0 to FLASH_TIER_KEYS - 1, at most 32
+#endif
+#if FLASH_TIER_KEYS > 32
+#error "FLASH_TIER_KEYS must fit into the hot_keys mask"
+#endif
+#ifndef FLASH_TIER_HOT_WRITES
+#define FLASH_TIER_HOT_WRITES 4 // writes within a window that make a key hot
+#endif
+#ifndef FLASH_TIER_WINDOW
+#define FLASH_TIER_WINDOW 32 // writes between two halvings of the counters
+#endif
+#define FLASH_SPI_EEPROM_WREN 0x06
+#define FLASH_SPI_EEPROM_RDSR 0x05
+#define FLASH_SPI_EEPROM_READ 0x03
+#define FLASH_SPI_EEPROM_WRITE 0x02
+#define FLASH_SPI_EEPROM_WIP 0x01
+#define FLASH_SPI_EEPROM_RECORD_SIZE 4
+/**
+ * @brief A key/value backend.
+ *
+ * The functions return FLASH_STATUS_* codes; read returns FLASH_STATUS_EMPTY for a key the backend does not hold.
+ */
+struct flash_tier_ops {
+	uint8_t (*read)(void *context, uint16_t key, uint16_t *value);
+	uint8_t (*write)(void *context, uint16_t key, uint16_t value);
+	uint8_t (*remove)(void *context, uint16_t key);  // NULL if the backend cannot forget a key
+};
+/**
+ * @brief A backend and its device.
+ */
+struct flash_tier_backend {
+	const struct flash_tier_ops *ops;
+	void *context;
+};
+/**
+ * @brief The SPI bus of an external device, supplied by the application.
+ */
+struct flash_spi_bus {
+	void (*select)(void *context, uint8_t selected);  // drive chip select, active while selected is non-zero
+	uint8_t (*transfer)(void *context, uint8_t byte); // shift one byte out and return the byte shifted in
+	void *context;
+};
+/**
+ * @brief An SPI EEPROM or FRAM with the 25xx command set.
+ */
+struct flash_spi_eeprom {
+	struct flash_spi_bus bus;
+	uint32_t base_addr;  // device address of the record of key 0, a multiple of 4
+	uint16_t n_keys;     // number of records
+	uint8_t addr_bytes;  // address bytes per command: 2 up to 512 Kbit, 3 above
+};
+/**
+ * @brief Two backends and the placement of the keys.
+ *
+ * cold and hot describe the backends, the other fields are set up by flash_tier_mount().
+ */
+struct flash_tier {
+	struct flash_tier_backend cold;  // internal flash
+	struct flash_tier_backend hot;   // external device
+	uint32_t hot_keys;               // bit n set while the hot backend holds key n
+	uint8_t n_writes;                // writes in the current window
+	uint8_t churn[FLASH_TIER_KEYS];  // decaying write counter per key
+};
+/**
+ * @brief Read bytes from an SPI EEPROM.
+ *
+ * @param eeprom The device.
+ * @param addr The device address.
+ * @param data Receives the bytes.
+ * @param length The number of bytes.
+ */
+static inline void flash_spi_eeprom_read(const struct flash_spi_eeprom *eeprom, uint32_t addr, uint8_t *data, uint16_t length);
+/**
+ * @brief Write bytes to an SPI EEPROM.
+ *
+ * This function enables the write, sends the bytes and waits until the write cycle is done. The bytes must not cross a page of the device.
+ *
+ * @param eeprom The device.
+ * @param addr The device address.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return uint8_t FLASH_STATUS_OK or FLASH_STATUS_TIMEOUT if the device stayed busy for longer than FLASH_TIMEOUT_TICKS.
+ */
+static inline uint8_t flash_spi_eeprom_write(const struct flash_spi_eeprom *eeprom, uint32_t addr, const uint8_t *data, uint16_t length);
+/**
+ * @brief Mount the tiers.
+ *
+ * This function resets the counters and marks the keys the hot backend holds.
+ *
+ * @param tier The tiers.
+ */
+static inline void flash_tier_mount(struct flash_tier *tier);
+/**
+ * @brief Read a key.
+ *
+ * @param tier The tiers.
+ * @param key The key.
+ * @param value Receives the value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for a key of FLASH_TIER_KEYS or more or FLASH_STATUS_EMPTY if the key was never written.
+ */
+static inline uint8_t flash_tier_read(const struct flash_tier *tier, uint16_t key, uint16_t *value);
+/**
+ * @brief Write a key.
+ *
+ * This function counts the write, places the key and writes it to its backend. The write that closes a window also moves the keys that cooled down.
+ *
+ * @param tier The tiers.
+ * @param key The key.
+ * @param value The value.
+ * @return uint8_t FLASH_STATUS_OK, FLASH_STATUS_INVALID for a key of FLASH_TIER_KEYS or more or the failed status of the backend.
+ */
+static inline uint8_t flash_tier_write(struct flash_tier *tier, uint16_t key, uint16_t value);
+/**
+ * @brief Check if a key is placed on the hot backend.
+ *
+ * @param tier The tiers.
+ * @param key The key.
+ * @return uint8_t Non-zero if the hot backend holds the key.
+ */
+static inline uint8_t flash_tier_is_hot(const struct flash_tier *tier, uint16_t key);
+// Internal Function Declarations
+/**
+ * @brief Select the device and send a command with its address.
+ */
+static inline void flash_spi_eeprom_command(const struct flash_spi_eeprom *eeprom, uint8_t command, uint32_t addr, uint8_t has_addr);
+/**
+ * @brief Wait until the write cycle of the device is done.
+ */
+static inline uint8_t flash_spi_eeprom_wait(const struct flash_spi_eeprom *eeprom);
+/**
+ * @brief Backend functions of the internal flash store.
+ */
+static inline uint8_t flash_tier_store_read(void *context, uint16_t key, uint16_t *value);
+static inline uint8_t flash_tier_store_write(void *context, uint16_t key, uint16_t value);
+/**
+ * @brief Backend functions of the SPI EEPROM.
+ */
+static inline uint8_t flash_tier_eeprom_read(void *context, uint16_t key, uint16_t *value);
+static inline uint8_t flash_tier_eeprom_write(void *context, uint16_t key, uint16_t value);
+static inline uint8_t flash_tier_eeprom_remove(void *context, uint16_t key);
+/**
+ * @brief Halve the counters and move the hot keys that cooled down to the cold backend.
+ */
+static inline uint8_t flash_tier_decay(struct flash_tier *tier);
+// Backends
+static const struct flash_tier_ops flash_tier_store_ops = { flash_tier_store_read, flash_tier_store_write, 0 };
+static const struct flash_tier_ops flash_tier_eeprom_ops = { flash_tier_eeprom_read, flash_tier_eeprom_write, flash_tier_eeprom_remove };
+// Function Definitions
+static inline void flash_spi_eeprom_command(const struct flash_spi_eeprom *eeprom, uint8_t command, uint32_t addr, uint8_t has_addr) {
+    eeprom->bus.select(eeprom->bus.context, 1);
+    eeprom->bus.transfer(eeprom->bus.context, command);
+    // Most significant address byte first.
+    for(int8_t shift = (eeprom->addr_bytes - 1) * 8; has_addr && shift >= 0; shift -= 8) {
+        eeprom->bus.transfer(eeprom->bus.context, (uint8_t)(addr >> shift));
+    }
+}
+static inline uint8_t flash_spi_eeprom_wait(const struct flash_spi_eeprom *eeprom) {
+    uint32_t start = SysTick->CNT;
+    uint8_t status = FLASH_STATUS_OK;
+    flash_spi_eeprom_command(eeprom, FLASH_SPI_EEPROM_RDSR, 0, 0);
+    // The status register is sent over and over while the device stays selected.
+    while(eeprom->bus.transfer(eeprom->bus.context, 0xFF) & FLASH_SPI_EEPROM_WIP) {
+        if(SysTick->CNT - start > FLASH_TIMEOUT_TICKS) {
+            status = FLASH_STATUS_TIMEOUT;
+            break;
+        }
+    }
+    eeprom->bus.select(eeprom->bus.context, 0);
+    return status;
+}
+static inline void flash_spi_eeprom_read(const struct flash_spi_eeprom *eeprom, uint32_t addr, uint8_t *data, uint16_t length) {
+    flash_spi_eeprom_command(eeprom, FLASH_SPI_EEPROM_READ, addr, 1);
+    for(uint16_t n = 0; n < length; n++) {
+        data[n] = eeprom->bus.transfer(eeprom->bus.context, 0xFF);
+    }
+    eeprom->bus.select(eeprom->bus.context, 0);
+}
+static inline uint8_t flash_spi_eeprom_write(const struct flash_spi_eeprom *eeprom, uint32_t addr, const uint8_t *data, uint16_t length) {
+    flash_spi_eeprom_command(eeprom, FLASH_SPI_EEPROM_WREN, 0, 0);
+    eeprom->bus.select(eeprom->bus.context, 0);
+    flash_spi_eeprom_command(eeprom, FLASH_SPI_EEPROM_WRITE, addr, 1);
+    for(uint16_t n = 0; n < length; n++) {
+        eeprom->bus.transfer(eeprom->bus.context, data[n]);
+    }
+    // The write cycle starts when chip select goes inactive.
+    eeprom->bus.select(eeprom->bus.context, 0);
+    return flash_spi_eeprom_wait(eeprom);
+}
+static inline uint8_t flash_tier_store_read(void *context, uint16_t key, uint16_t *value) {
+    return flash_store_read((const struct flash_store*)context, key, value);
+}
+static inline uint8_t flash_tier_store_write(void *context, uint16_t key, uint16_t value) {
+    return flash_store_write((struct flash_store*)context, key, value);
+}
+static inline uint8_t flash_tier_eeprom_read(void *context, uint16_t key, uint16_t *value) {
+    const struct flash_spi_eeprom *eeprom = (const struct flash_spi_eeprom*)context;
+    if(key >= eeprom->n_keys) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint8_t record[FLASH_SPI_EEPROM_RECORD_SIZE];
+    flash_spi_eeprom_read(eeprom, eeprom->base_addr + (uint32_t)key * FLASH_SPI_EEPROM_RECORD_SIZE, record, sizeof(record));
+    // A blank, removed or torn record does not match its inverse.
+    uint16_t stored = record[0] | record[1] << 8;
+    uint16_t inverse = record[2] | record[3] << 8;
+    if((uint16_t)(stored ^ inverse) != 0xFFFF) {
+        return FLASH_STATUS_EMPTY;
+    }
+    *value = stored;
+    return FLASH_STATUS_OK;
+}
+static inline uint8_t flash_tier_eeprom_write(void *context, uint16_t key, uint16_t value) {
+    const struct flash_spi_eeprom *eeprom = (const struct flash_spi_eeprom*)context;
+    if(key >= eeprom->n_keys) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint16_t inverse = ~value;
+    uint8_t record[FLASH_SPI_EEPROM_RECORD_SIZE] = { value & 0xFF, value >> 8, inverse & 0xFF, inverse >> 8 };
+    // A record never crosses a device page, the pages are a power of two of at least 16 bytes.
+    return flash_spi_eeprom_write(eeprom, eeprom->base_addr + (uint32_t)key * FLASH_SPI_EEPROM_RECORD_SIZE, record, sizeof(record));
+}
+static inline uint8_t flash_tier_eeprom_remove(void *context, uint16_t key) {
+    const struct flash_spi_eeprom *eeprom = (const struct flash_spi_eeprom*)context;
+    if(key >= eeprom->n_keys) {
+        return FLASH_STATUS_INVALID;
+    }
+    uint8_t record[FLASH_SPI_EEPROM_RECORD_SIZE] = { 0xFF, 0xFF, 0xFF, 0xFF };
+    return flash_spi_eeprom_write(eeprom, eeprom->base_addr + (uint32_t)key * FLASH_SPI_EEPROM_RECORD_SIZE, record, sizeof(record));
+}
+static inline void flash_tier_mount(struct flash_tier *tier) {
+    tier->hot_keys = 0;
+    tier->n_writes = 0;
+    for(uint8_t key = 0; key < FLASH_TIER_KEYS; key++) {
+        uint16_t value;
+        tier->churn[key] = 0;
+        if(tier->hot.ops->read(tier->hot.context, key, &value) == FLASH_STATUS_OK) {
+            tier->hot_keys |= (uint32_t)1 << key;
+        }
+    }
+}
+static inline uint8_t flash_tier_is_hot(const struct flash_tier *tier, uint16_t key) {
+    return key < FLASH_TIER_KEYS && (tier->hot_keys & ((uint32_t)1 << key));
+}
+static inline uint8_t flash_tier_read(const struct flash_tier *tier, uint16_t key, uint16_t *value) {
+    if(key >= FLASH_TIER_KEYS) {
+        return FLASH_STATUS_INVALID;
+    }
+    const struct flash_tier_backend *backend = flash_tier_is_hot(tier, key) ? &tier->hot : &tier->cold;
+    return backend->ops->read(backend->context, key, value);
+}
+static inline uint8_t flash_tier_decay(struct flash_tier *tier) {
+    uint8_t status = FLASH_STATUS_OK;
+    for(uint8_t key = 0; key < FLASH_TIER_KEYS; key++) {
+        tier->churn[key] /= 2;
+        if(tier->churn[key] || !flash_tier_is_hot(tier, key) || status != FLASH_STATUS_OK) {
+            continue;
+        }
+        // Copy to the cold backend before removing the hot copy, which wins until it is gone.
+        uint16_t value;
+        status = tier->hot.ops->read(tier->hot.context, key, &value);
+        if(status == FLASH_STATUS_OK) {
+            status = tier->cold.ops->write(tier->cold.context, key, value);
+        }
+        if(status == FLASH_STATUS_OK) {
+            status = tier->hot.ops->remove(tier->hot.context, key);
+        }
+        if(status == FLASH_STATUS_OK) {
+            tier->hot_keys &= ~((uint32_t)1 << key);
+        }
+    }
+    return status;
+}
+static inline uint8_t flash_tier_write(struct flash_tier *tier, uint16_t key, uint16_t value) {
+    if(key >= FLASH_TIER_KEYS) {
+        return FLASH_STATUS_INVALID;
+    }
+    if(tier->churn[key] < 0xFF) {
+        tier->churn[key]++;
+    }
+    // A hot key stays on the hot backend until the decay moves it back, a stale cold copy is shadowed by the hot one.
+    uint8_t status;
+    if(flash_tier_is_hot(tier, key) || tier->churn[key] >= FLASH_TIER_HOT_WRITES) {
+        status = tier->hot.ops->write(tier->hot.context, key, value);
+        if(status == FLASH_STATUS_OK) {
+            tier->hot_keys |= (uint32_t)1 << key;
+        }
+    } else {
+        status = tier->cold.ops->write(tier->cold.context, key, value);
+    }
+    if(++tier->n_writes >= FLASH_TIER_WINDOW) {
+        tier->n_writes = 0;
+        uint8_t decay_status = flash_tier_decay(tier);
+        if(status == FLASH_STATUS_OK) {
+            status = decay_status;
+        }
+    }
+    return status;
+}
+#endif // CH32V003_FLASH_TIER_H
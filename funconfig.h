@@ -9,5 +9,10 @@
 
 #define CH32V003           1
 
+//#define FLASH_USE_TRACE 1               // Record flash operations for flash_trace_dump()
+//#define FLASH_USE_COUNTERS 1            // Count flash operations for flash_get_counters()
+//#define FLASH_USE_VERIFY 1              // Read back every half-word program, retry flash_program_16()
+//#define FLASH_USE_PVD_GATE 1            // Refuse erases on a low supply and honour flash_request_abort()
+
 #endif
 
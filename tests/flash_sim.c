@@ -0,0 +1,271 @@
+/**
+ * @file
+ * @brief Host simulation of the CH32V003 flash controller, see flash_sim.h.
+ *
+ * The mapped flash is what the code reads and where its stores land, cells holds what the flash really holds. On every register access
+ * flash_sim_flash_tick() compares the two: a changed half-word is a program in PG mode, a page buffer load in fast page program mode and an
+ * error otherwise. Starting an erase or a page program applies it to cells right away.
+ */
+#include <sys/mman.h>
+#include "flash_sim.h"
+FLASH_TypeDef flash_sim_flash;
+OB_TypeDef flash_sim_ob;
+SysTick_Type flash_sim_systick;
+PWR_TypeDef flash_sim_pwr;
+RCC_TypeDef flash_sim_rcc;
+EXTI_TypeDef flash_sim_exti;
+DMA_TypeDef flash_sim_dma;
+DMA_Channel_TypeDef flash_sim_dma_channels[7];
+uint32_t flash_sim_enabled_irqs;
+char FLASH_LENGTH_OVERRIDE[1];
+struct flash_sim_stats flash_sim_stats;
+jmp_buf flash_sim_power_loss;
+uint8_t flash_sim_cut_happened;
+uint64_t (*flash_sim_clock_ns)(void);
+static uint8_t *flash_sim_mapped;
+static uint8_t flash_sim_cells[FLASH_SIM_SIZE];
+static uint16_t flash_sim_page_buffer[FLASH_PAGE_SIZE / 2];
+#define FLASH_SIM_STATR_UNTOUCHED 0x80000000
+static uint32_t flash_sim_status;
+static uint8_t flash_sim_key_state;
+static uint8_t flash_sim_mode_key_state;
+static uint32_t flash_sim_cut_countdown;
+static uint32_t flash_sim_worn[FLASH_SIM_WORN_MAX];
+static uint32_t flash_sim_rng = 1;
+static void flash_sim_fail(const char *message, uint32_t addr) {
+    printf("flash sim: %s at 0x%08lx\n", message, (unsigned long)addr);
+    exit(2);
+}
+static uint16_t flash_sim_get(const uint8_t *memory, uint32_t offset) {
+    return memory[offset] | memory[offset + 1] << 8;
+}
+static void flash_sim_put(uint32_t offset, uint16_t value) {
+    for(uint8_t n = 0; n < FLASH_SIM_WORN_MAX; n++) {
+        if(flash_sim_worn[n] == FLASH_BASE + offset) {
+            value = 0;
+        }
+    }
+    flash_sim_cells[offset] = flash_sim_mapped[offset] = value & 0xFF;
+    flash_sim_cells[offset + 1] = flash_sim_mapped[offset + 1] = value >> 8;
+}
+static uint8_t flash_sim_is_protected(uint32_t offset) {
+    return !(flash_sim_flash.WPR & (1UL << (offset / 1024)));
+}
+// Count an operation and fail the power when the armed one comes up. Returns non-zero if this operation is the one cut short.
+static uint8_t flash_sim_operation(void) {
+    return flash_sim_cut_countdown && --flash_sim_cut_countdown == 0;
+}
+static void flash_sim_power_fails(void) {
+    flash_sim_cut_happened = 1;
+    longjmp(flash_sim_power_loss, 1);
+}
+static void flash_sim_erase(uint32_t offset, uint32_t size) {
+    if(flash_sim_is_protected(offset)) {
+        flash_sim_status |= FLASH_STATR_WRPRTERR;
+        return;
+    }
+    uint8_t cut = flash_sim_operation();
+    flash_sim_stats.erases++;
+    for(uint32_t n = 0; n < size; n += 2) {
+        if(!cut || (flash_sim_random() & 1)) {
+            flash_sim_put(offset + n, 0xFFFF);
+        }
+    }
+    if(cut) {
+        flash_sim_power_fails();
+    }
+}
+static void flash_sim_program_page(uint32_t offset) {
+    if(flash_sim_is_protected(offset)) {
+        flash_sim_status |= FLASH_STATR_WRPRTERR;
+        return;
+    }
+    uint8_t cut = flash_sim_operation();
+    flash_sim_stats.page_programs++;
+    for(uint8_t n = 0; n < FLASH_PAGE_SIZE / 2; n++) {
+        if(!cut || (flash_sim_random() & 1)) {
+            flash_sim_put(offset + 2 * n, flash_sim_get(flash_sim_cells, offset + 2 * n) & flash_sim_page_buffer[n]);
+        }
+    }
+    if(cut) {
+        flash_sim_power_fails();
+    }
+}
+// Act on the stores the code made to the mapped flash since the last register access.
+static void flash_sim_sync(void) {
+    if(!memcmp(flash_sim_mapped, flash_sim_cells, FLASH_SIM_SIZE)) {
+        return;
+    }
+    for(uint32_t offset = 0; offset < FLASH_SIM_SIZE; offset += 2) {
+        uint16_t stored = flash_sim_get(flash_sim_mapped, offset);
+        uint16_t held = flash_sim_get(flash_sim_cells, offset);
+        if(stored == held) {
+            continue;
+        }
+        if(flash_sim_flash.CTLR & CR_PAGE_PG) {
+            // Fast page program mode: the store goes into the page buffer, the flash only changes when the program starts.
+            flash_sim_page_buffer[(offset % FLASH_PAGE_SIZE) / 2] = stored;
+            flash_sim_put(offset, held);
+        } else if(flash_sim_flash.CTLR & CR_PG_Set) {
+            if(flash_sim_flash.CTLR & FLASH_CTLR_LOCK) {
+                flash_sim_fail("program while locked", FLASH_BASE + offset);
+            }
+            if(flash_sim_is_protected(offset)) {
+                flash_sim_status |= FLASH_STATR_WRPRTERR;
+                flash_sim_put(offset, held);
+                continue;
+            }
+            // A half-word program is atomic: the power fails before it.
+            if(flash_sim_operation()) {
+                flash_sim_put(offset, held);
+                flash_sim_power_fails();
+            }
+            flash_sim_stats.programs++;
+            flash_sim_put(offset, held & stored);
+        } else {
+            flash_sim_fail("store to flash outside program mode", FLASH_BASE + offset);
+        }
+    }
+}
+void flash_sim_flash_tick(void) {
+    FLASH_TypeDef *flash = &flash_sim_flash;
+    flash_sim_sync();
+    // STATR flags are write-one-to-clear. The published value carries a reserved bit, so a register the code only read clears nothing.
+    if(!(flash->STATR & FLASH_SIM_STATR_UNTOUCHED)) {
+        flash_sim_status &= ~(flash->STATR & (FLASH_STATR_EOP | FLASH_STATR_WRPRTERR));
+    }
+    flash->STATR = 0;
+    // Key sequences.
+    if(flash->KEYR == FLASH_KEY1) {
+        flash_sim_key_state = 1;
+    } else if(flash->KEYR == FLASH_KEY2 && flash_sim_key_state == 1) {
+        flash->CTLR &= ~FLASH_CTLR_LOCK;
+        flash_sim_key_state = 0;
+    } else if(flash->KEYR) {
+        flash_sim_fail("wrong key sequence", 0);
+    }
+    flash->KEYR = 0;
+    if(flash->MODEKEYR == FLASH_KEY1) {
+        flash_sim_mode_key_state = 1;
+    } else if(flash->MODEKEYR == FLASH_KEY2 && flash_sim_mode_key_state == 1 && !(flash->CTLR & FLASH_CTLR_LOCK)) {
+        flash->CTLR &= ~FLASH_CTLR_FLOCK;
+        flash_sim_mode_key_state = 0;
+    }
+    flash->MODEKEYR = 0;
+    if(flash->CTLR & FLASH_CTLR_LOCK) {
+        flash->CTLR |= FLASH_CTLR_FLOCK;
+    }
+    // The page buffer bits clear themselves.
+    if(flash->CTLR & CR_BUF_RST) {
+        memset(flash_sim_page_buffer, 0xFF, sizeof(flash_sim_page_buffer));
+    }
+    flash->CTLR &= ~(CR_BUF_RST | CR_BUF_LOAD);
+    if(flash->CTLR & CR_STRT_Set) {
+        flash->CTLR &= ~CR_STRT_Set;
+        uint32_t offset = flash->ADDR - FLASH_BASE;
+        if(flash->CTLR & FLASH_CTLR_LOCK) {
+            flash_sim_status |= FLASH_STATR_WRPRTERR;
+        } else if(flash->CTLR & CR_OPTER_Set) {
+            memset(&flash_sim_ob, 0xFF, sizeof(flash_sim_ob));
+        } else if(offset >= FLASH_SIM_SIZE) {
+            flash_sim_fail("operation outside the main flash", flash->ADDR);
+        } else if(flash->CTLR & CR_PAGE_ER) {
+            if(flash->CTLR & FLASH_CTLR_FLOCK) {
+                flash_sim_fail("fast page erase with the fast page mode locked", flash->ADDR);
+            }
+            flash_sim_erase(offset & ~(uint32_t)(FLASH_PAGE_SIZE - 1), FLASH_PAGE_SIZE);
+        } else if(flash->CTLR & CR_PER_Set) {
+            flash_sim_erase(offset & ~(uint32_t)1023, 1024);
+        } else if(flash->CTLR & CR_PAGE_PG) {
+            if(flash->CTLR & FLASH_CTLR_FLOCK) {
+                flash_sim_fail("fast page program with the fast page mode locked", flash->ADDR);
+            }
+            flash_sim_program_page(offset & ~(uint32_t)(FLASH_PAGE_SIZE - 1));
+        }
+        flash_sim_status |= FLASH_STATR_EOP;
+    }
+    if(flash->CTLR & CR_PG_Set) {
+        flash_sim_status |= FLASH_STATR_EOP;
+    }
+    flash->STATR = flash_sim_status | FLASH_SIM_STATR_UNTOUCHED;
+}
+void flash_sim_systick_tick(void) {
+    // SysTick runs at HCLK; without a clock every read advances it a little so timeouts still expire.
+    if(flash_sim_clock_ns) {
+        flash_sim_systick.CNT = (uint32_t)(flash_sim_clock_ns() * (FUNCONF_SYSTEM_CORE_CLOCK / 1000000) / 1000);
+    } else {
+        flash_sim_systick.CNT += 3;
+    }
+}
+void flash_sim_dma_tick(void) {
+    flash_sim_dma.INTFR &= ~flash_sim_dma.INTFCR;
+    flash_sim_dma.INTFCR = 0;
+}
+void flash_sim_dma_run(void) {
+    for(uint8_t n = 0; n < 7; n++) {
+        DMA_Channel_TypeDef *channel = &flash_sim_dma_channels[n];
+        if(!(channel->CFGR & DMA_CFGR1_EN) || !(channel->CFGR & DMA_CFGR1_MEM2MEM) || !channel->CNTR) {
+            continue;
+        }
+        uint32_t size = (channel->CFGR & DMA_CFGR1_PSIZE_1) ? 4 : (channel->CFGR & DMA_CFGR1_PSIZE_0) ? 2 : 1;
+        memcpy((void*)(uintptr_t)channel->MADDR, (const void*)(uintptr_t)channel->PADDR, channel->CNTR * size);
+        channel->CNTR = 0;
+        flash_sim_dma_tick();
+        flash_sim_dma.INTFR |= (DMA_GIF1 | DMA_TCIF1) << (4 * n);
+    }
+}
+void flash_sim_reboot(void) {
+    // Stores the controller did not take are gone, so are the staged page buffer and the unlock.
+    memcpy(flash_sim_mapped, flash_sim_cells, FLASH_SIM_SIZE);
+    memset(&flash_sim_flash, 0, sizeof(flash_sim_flash));
+    flash_sim_flash.CTLR = FLASH_CTLR_LOCK | FLASH_CTLR_FLOCK;
+    flash_sim_flash.WPR = 0xFFFFFFFF;
+    flash_sim_status = 0;
+    flash_sim_key_state = 0;
+    flash_sim_mode_key_state = 0;
+    memset(flash_sim_page_buffer, 0xFF, sizeof(flash_sim_page_buffer));
+    memset(&flash_sim_dma, 0, sizeof(flash_sim_dma));
+    memset(flash_sim_dma_channels, 0, sizeof(flash_sim_dma_channels));
+}
+void flash_sim_init(void) {
+    // Map the flash where the headers expect it; the tests link without PIE so nothing else lives there.
+    void *memory = mmap((void*)(uintptr_t)FLASH_BASE, FLASH_SIM_SIZE, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory != (void*)(uintptr_t)FLASH_BASE) {
+        perror("mmap");
+        exit(2);
+    }
+    flash_sim_mapped = memory;
+    memset(flash_sim_cells, 0xFF, FLASH_SIM_SIZE);
+    memset(&flash_sim_ob, 0xFF, sizeof(flash_sim_ob));
+    memset(flash_sim_worn, 0, sizeof(flash_sim_worn));
+    memset(&flash_sim_stats, 0, sizeof(flash_sim_stats));
+    flash_sim_cut_countdown = 0;
+    flash_sim_cut_happened = 0;
+    flash_sim_reboot();
+}
+void flash_sim_cut_after(uint32_t n) {
+    flash_sim_cut_countdown = n;
+    if(n) {
+        flash_sim_cut_happened = 0;
+    }
+}
+void flash_sim_wear_out(uint32_t addr) {
+    for(uint8_t n = 0; n < FLASH_SIM_WORN_MAX; n++) {
+        if(!flash_sim_worn[n]) {
+            flash_sim_worn[n] = addr & ~(uint32_t)1;
+            flash_sim_put(flash_sim_worn[n] - FLASH_BASE, 0);
+            return;
+        }
+    }
+    flash_sim_fail("too many worn cells", addr);
+}
+void flash_sim_seed(uint32_t seed) {
+    flash_sim_rng = seed ? seed : 1;
+}
+uint32_t flash_sim_random(void) {
+    // xorshift32
+    flash_sim_rng ^= flash_sim_rng << 13;
+    flash_sim_rng ^= flash_sim_rng >> 17;
+    flash_sim_rng ^= flash_sim_rng << 5;
+    return flash_sim_rng;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file
+ * @brief Host simulation of the CH32V003 flash for the tests.
+ *
+ * The 16K of main flash are mapped at FLASH_BASE, so the headers read them with plain loads as on the chip. Every access to the FLASH
+ * registers lets the simulated controller act on what the code did since the last access: programs can only clear bits, half-word programs
+ * need PG, page programs load the page buffer and need the fast page mode unlocked, erases set a 64-byte page or a 1K sector to 0xFF,
+ * and a write protected sector or a store outside program mode is an error. The controller never reports busy.
+ *
+ * @section sim_power_loss Power Loss
+ * flash_sim_cut_after(n) lets the power fail during the n-th erase or program from now on. A cut erase leaves a random half of the page's
+ * half-words erased, a cut page program a random half programmed; a half-word program is either done or not, the commit protocols of the
+ * headers rely on that. The cut jumps back to FLASH_SIM_POWER_CUT(), which reboots the controller and the static state of the library:
+ * @code
+ * FLASH_SIM_POWER_CUT(3, flash_store_write(&store, key, value));
+ * if(flash_sim_cut_happened) ...
+ * @endcode
+ *
+ * @section sim_faults Worn Cells
+ * flash_sim_wear_out(addr) makes a half-word stay 0x0000 whatever is erased or programmed, the way a worn cell fails to erase.
+ */
+#ifndef FLASH_SIM_H
+#define FLASH_SIM_H
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ch32v003_flash.h"
+#define FLASH_SIM_SIZE 16384
+#define FLASH_SIM_WORN_MAX 8
+/**
+ * @brief Fail the test unless the condition holds.
+ */
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        exit(1); \
+    } \
+} while(0)
+/**
+ * @brief Run code with the power failing during the n-th erase or program, then reboot.
+ */
+#define FLASH_SIM_POWER_CUT(n, code) do { \
+    if(!setjmp(flash_sim_power_loss)) { \
+        flash_sim_cut_after(n); \
+        code; \
+    } \
+    flash_sim_cut_after(0); \
+    flash_sim_reboot(); \
+    flash_session_nesting = 0; \
+    flash_abort_requested = 0; \
+} while(0)
+/**
+ * @brief Operations done by the simulated controller.
+ */
+struct flash_sim_stats {
+	uint32_t erases;         // page and sector erases
+	uint32_t programs;       // half-words changed by programs
+	uint32_t page_programs;  // fast page programs
+};
+extern struct flash_sim_stats flash_sim_stats;
+extern jmp_buf flash_sim_power_loss;
+extern uint8_t flash_sim_cut_happened;
+extern uint64_t (*flash_sim_clock_ns)(void);
+/**
+ * @brief Map the flash, erase it and reset the controller. Call once at the start of a test.
+ */
+void flash_sim_init(void);
+/**
+ * @brief Reset the controller and drop whatever the code stored without the controller taking it.
+ */
+void flash_sim_reboot(void);
+/**
+ * @brief Let the power fail during the n-th erase or program from now on, 0 to disarm.
+ */
+void flash_sim_cut_after(uint32_t n);
+/**
+ * @brief Make a half-word read 0x0000 from now on, like a worn cell.
+ */
+void flash_sim_wear_out(uint32_t addr);
+/**
+ * @brief Seed the random choices of the simulation.
+ */
+void flash_sim_seed(uint32_t seed);
+/**
+ * @brief Return a pseudo-random number, for the tests as well.
+ */
+uint32_t flash_sim_random(void);
+/**
+ * @brief Run the enabled memory-to-memory DMA channels to completion.
+ */
+void flash_sim_dma_run(void);
+#endif // FLASH_SIM_H
@@ -0,0 +1,202 @@
+/**
+ * @file
+ * @brief Host stand-in for the ch32v003fun register definitions, for the tests only.
+ *
+ * The flash headers include ch32v003fun.h for the register blocks and bit definitions. On the host this file takes its place: every
+ * peripheral the headers touch is a plain struct in flash_sim.c, and every access to FLASH, SysTick or DMA1 first lets the simulation
+ * catch up with what the code did (see flash_sim.h). The values of the bit definitions are the ones of ch32v003fun.
+ */
+#ifndef CH32V003FUN_HOST_H
+#define CH32V003FUN_HOST_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#define __IO volatile
+#ifndef FUNCONF_SYSTEM_CORE_CLOCK
+#define FUNCONF_SYSTEM_CORE_CLOCK 48000000
+#endif
+// Flash
+#define FLASH_BASE ((uint32_t)0x08000000)
+#define FLASH_KEY1 ((uint32_t)0x45670123)
+#define FLASH_KEY2 ((uint32_t)0xCDEF89AB)
+#define FLASH_Latency_0 ((uint32_t)0x00000000)
+#define FLASH_Latency_1 ((uint32_t)0x00000001)
+#define FLASH_Latency_2 ((uint32_t)0x00000002)
+#define FLASH_ACTLR_LATENCY ((uint8_t)0x03)
+#define CR_PG_Set ((uint32_t)0x00000001)
+#define CR_PG_Reset ((uint32_t)0xFFFFFFFE)
+#define CR_PER_Set ((uint32_t)0x00000002)
+#define CR_PER_Reset ((uint32_t)0xFFFFFFFD)
+#define CR_OPTPG_Set ((uint32_t)0x00000010)
+#define CR_OPTPG_Reset ((uint32_t)0xFFFFFFEF)
+#define CR_OPTER_Set ((uint32_t)0x00000020)
+#define CR_OPTER_Reset ((uint32_t)0xFFFFFFDF)
+#define CR_STRT_Set ((uint32_t)0x00000040)
+#define CR_LOCK_Set ((uint32_t)0x00000080)
+#define CR_PAGE_PG ((uint32_t)0x00010000)
+#define CR_PAGE_ER ((uint32_t)0x00020000)
+#define CR_BUF_LOAD ((uint32_t)0x00040000)
+#define CR_BUF_RST ((uint32_t)0x00080000)
+#define FLASH_CTLR_PG ((uint32_t)0x00000001)
+#define FLASH_CTLR_PER ((uint32_t)0x00000002)
+#define FLASH_CTLR_OPTPG ((uint32_t)0x00000010)
+#define FLASH_CTLR_OPTER ((uint32_t)0x00000020)
+#define FLASH_CTLR_STRT ((uint32_t)0x00000040)
+#define FLASH_CTLR_LOCK ((uint32_t)0x00000080)
+#define FLASH_CTLR_OPTWRE ((uint32_t)0x00000200)
+#define FLASH_CTLR_ERRIE ((uint32_t)0x00000400)
+#define FLASH_CTLR_EOPIE ((uint32_t)0x00001000)
+#define FLASH_CTLR_FLOCK ((uint32_t)0x00008000)
+#define FLASH_CTLR_PAGE_PG ((uint32_t)0x00010000)
+#define FLASH_CTLR_PAGE_ER ((uint32_t)0x00020000)
+#define FLASH_CTLR_BUF_LOAD ((uint32_t)0x00040000)
+#define FLASH_CTLR_BUF_RST ((uint32_t)0x00080000)
+#define FLASH_STATR_BSY ((uint8_t)0x01)
+#define FLASH_STATR_WRPRTERR ((uint8_t)0x10)
+#define FLASH_STATR_EOP ((uint8_t)0x20)
+typedef struct {
+	__IO uint32_t ACTLR;
+	__IO uint32_t KEYR;
+	__IO uint32_t OBKEYR;
+	__IO uint32_t STATR;
+	__IO uint32_t CTLR;
+	__IO uint32_t ADDR;
+	__IO uint32_t RESERVED;
+	__IO uint32_t OBR;
+	__IO uint32_t WPR;
+	__IO uint32_t MODEKEYR;
+	__IO uint32_t BOOT_MODEKEYR;
+} FLASH_TypeDef;
+typedef struct {
+	__IO uint16_t RDPR;
+	__IO uint16_t USER;
+	__IO uint16_t Data0;
+	__IO uint16_t Data1;
+	__IO uint16_t WRPR0;
+	__IO uint16_t WRPR1;
+	__IO uint16_t WRPR2;
+	__IO uint16_t WRPR3;
+} OB_TypeDef;
+// SysTick
+typedef struct {
+	__IO uint32_t CTLR;
+	__IO uint32_t SR;
+	__IO uint32_t CNT;
+	uint32_t RESERVED0;
+	__IO uint32_t CMP;
+	uint32_t RESERVED1;
+} SysTick_Type;
+// Power control and PVD
+#define PWR_CTLR_PVDE ((uint16_t)0x0010)
+#define PWR_CTLR_PLS ((uint16_t)0x00E0)
+#define PWR_CSR_PVDO ((uint16_t)0x0004)
+typedef struct {
+	__IO uint32_t CTLR;
+	__IO uint32_t CSR;
+} PWR_TypeDef;
+// Clocks
+#define RCC_APB1Periph_PWR ((uint32_t)0x10000000)
+#define RCC_AHBPeriph_DMA1 ((uint32_t)0x00000001)
+#define RCC_APB2Periph_GPIOC ((uint32_t)0x00000010)
+#define RCC_SWS ((uint32_t)0x0000000C)
+#define RCC_SWS_HSI ((uint32_t)0x00000000)
+#define RCC_SWS_HSE ((uint32_t)0x00000004)
+#define RCC_SWS_PLL ((uint32_t)0x00000008)
+#define RCC_HPRE ((uint32_t)0x000000F0)
+#define RCC_PLLSRC ((uint32_t)0x00010000)
+typedef struct {
+	__IO uint32_t CTLR;
+	__IO uint32_t CFGR0;
+	__IO uint32_t INTR;
+	__IO uint32_t APB2PRSTR;
+	__IO uint32_t APB1PRSTR;
+	__IO uint32_t AHBPCENR;
+	__IO uint32_t APB2PCENR;
+	__IO uint32_t APB1PCENR;
+	__IO uint32_t RSTSCKR;
+} RCC_TypeDef;
+// External interrupts
+#define EXTI_Line8 ((uint32_t)0x00100)
+typedef struct {
+	__IO uint32_t INTENR;
+	__IO uint32_t EVENR;
+	__IO uint32_t RTENR;
+	__IO uint32_t FTENR;
+	__IO uint32_t SWIEVR;
+	__IO uint32_t INTFR;
+} EXTI_TypeDef;
+// DMA
+#define DMA_CFGR1_EN ((uint16_t)0x0001)
+#define DMA_CFGR1_TCIE ((uint16_t)0x0002)
+#define DMA_CFGR1_TEIE ((uint16_t)0x0008)
+#define DMA_CFGR1_DIR ((uint16_t)0x0010)
+#define DMA_CFGR1_PINC ((uint16_t)0x0040)
+#define DMA_CFGR1_MINC ((uint16_t)0x0080)
+#define DMA_CFGR1_PSIZE_0 ((uint16_t)0x0100)
+#define DMA_CFGR1_PSIZE_1 ((uint16_t)0x0200)
+#define DMA_CFGR1_MSIZE_0 ((uint16_t)0x0400)
+#define DMA_CFGR1_MSIZE_1 ((uint16_t)0x0800)
+#define DMA_CFGR1_PL ((uint16_t)0x3000)
+#define DMA_CFGR1_MEM2MEM ((uint16_t)0x4000)
+#define DMA_GIF1 ((uint32_t)0x00000001)
+#define DMA_TCIF1 ((uint32_t)0x00000002)
+#define DMA_HTIF1 ((uint32_t)0x00000004)
+#define DMA_TEIF1 ((uint32_t)0x00000008)
+typedef struct {
+	__IO uint32_t CFGR;
+	__IO uint32_t CNTR;
+	__IO uint32_t PADDR;
+	__IO uint32_t MADDR;
+} DMA_Channel_TypeDef;
+typedef struct {
+	__IO uint32_t INTFR;
+	__IO uint32_t INTFCR;
+} DMA_TypeDef;
+// Interrupts
+typedef enum {
+	PVD_IRQn = 17,
+	DMA1_Channel1_IRQn = 22,
+	DMA1_Channel2_IRQn = 23,
+	DMA1_Channel3_IRQn = 24,
+	DMA1_Channel4_IRQn = 25,
+	DMA1_Channel5_IRQn = 26,
+	DMA1_Channel6_IRQn = 27,
+	DMA1_Channel7_IRQn = 28,
+} IRQn_Type;
+// The simulated peripherals, see flash_sim.c.
+extern FLASH_TypeDef flash_sim_flash;
+extern OB_TypeDef flash_sim_ob;
+extern SysTick_Type flash_sim_systick;
+extern PWR_TypeDef flash_sim_pwr;
+extern RCC_TypeDef flash_sim_rcc;
+extern EXTI_TypeDef flash_sim_exti;
+extern DMA_TypeDef flash_sim_dma;
+extern DMA_Channel_TypeDef flash_sim_dma_channels[7];
+extern uint32_t flash_sim_enabled_irqs;
+void flash_sim_flash_tick(void);
+void flash_sim_systick_tick(void);
+void flash_sim_dma_tick(void);
+#define FLASH (flash_sim_flash_tick(), &flash_sim_flash)
+#define OB (&flash_sim_ob)
+#define SysTick (flash_sim_systick_tick(), &flash_sim_systick)
+#define PWR (&flash_sim_pwr)
+#define RCC (&flash_sim_rcc)
+#define EXTI (&flash_sim_exti)
+#define DMA1 (flash_sim_dma_tick(), &flash_sim_dma)
+#define DMA1_Channel1 (&flash_sim_dma_channels[0])
+#define DMA1_Channel2 (&flash_sim_dma_channels[1])
+#define DMA1_Channel3 (&flash_sim_dma_channels[2])
+#define DMA1_Channel4 (&flash_sim_dma_channels[3])
+#define DMA1_Channel5 (&flash_sim_dma_channels[4])
+#define DMA1_Channel6 (&flash_sim_dma_channels[5])
+#define DMA1_Channel7 (&flash_sim_dma_channels[6])
+static inline void NVIC_EnableIRQ(IRQn_Type irq) {
+    flash_sim_enabled_irqs |= (uint32_t)1 << (irq - PVD_IRQn);
+}
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+static inline void SystemInit(void) {}
+static inline void Delay_Ms(uint32_t ms) {
+    (void)ms;
+}
+#endif // CH32V003FUN_HOST_H
@@ -0,0 +1,105 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_bitset.h: random sets, clears and commits against a model, and power cuts during set and commit.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_bitset.h"
+#define BITSET_ADDR 0x08003C00
+#define BITSET_PAGES 2
+#define BITSET_FLAGS (BITSET_PAGES * FLASH_BITSET_FLAGS_PER_PAGE)
+static uint8_t model[BITSET_FLAGS];
+static void test_random_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(2);
+    struct flash_bitset bitset = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+    for(uint32_t round = 0; round < 20000; round++) {
+        uint16_t flag = flash_sim_random() % BITSET_FLAGS;
+        uint32_t choice = flash_sim_random() % 100;
+        if(choice < 60) {
+            CHECK(flash_bitset_set(&bitset, flag) == FLASH_STATUS_OK);
+            model[flag] = 1;
+        } else if(choice < 95) {
+            CHECK(flash_bitset_clear(&bitset, flag) == FLASH_STATUS_OK);
+            model[flag] = 0;
+        } else if(choice < 96) {
+            CHECK(flash_bitset_commit(&bitset) == FLASH_STATUS_OK);
+            CHECK(bitset.n_pending == 0);
+        }
+        for(uint8_t n = 0; n < 5; n++) {
+            uint16_t other = flash_sim_random() % BITSET_FLAGS;
+            CHECK(flash_bitset_test(&bitset, other) == model[other]);
+        }
+    }
+    // Once committed, the flags survive a reboot and count right.
+    CHECK(flash_bitset_commit(&bitset) == FLASH_STATUS_OK);
+    flash_sim_reboot();
+    struct flash_bitset mounted = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+    uint16_t count = 0;
+    for(uint16_t flag = 0; flag < BITSET_FLAGS; flag++) {
+        CHECK(flash_bitset_test(&mounted, flag) == model[flag]);
+        count += model[flag];
+    }
+    CHECK(flash_bitset_count(&mounted) == count);
+    CHECK(flash_bitset_set(&mounted, BITSET_FLAGS) == FLASH_STATUS_INVALID);
+    CHECK(flash_bitset_clear(&mounted, BITSET_FLAGS) == FLASH_STATUS_INVALID);
+}
+static void test_set_costs_no_erase(void) {
+    flash_sim_init();
+    struct flash_bitset bitset = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+    for(uint16_t flag = 0; flag < BITSET_FLAGS; flag++) {
+        CHECK(flash_bitset_set(&bitset, flag) == FLASH_STATUS_OK);
+    }
+    CHECK(flash_bitset_count(&bitset) == BITSET_FLAGS);
+    CHECK(flash_sim_stats.erases == 0);
+    CHECK(flash_sim_stats.programs == BITSET_FLAGS);
+    // Setting a set flag programs nothing.
+    CHECK(flash_bitset_set(&bitset, 7) == FLASH_STATUS_OK);
+    CHECK(flash_sim_stats.programs == BITSET_FLAGS);
+}
+static void test_power_cut_during_set(void) {
+    flash_sim_init();
+    struct flash_bitset bitset = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+    CHECK(flash_bitset_set(&bitset, 3) == FLASH_STATUS_OK);
+    FLASH_SIM_POWER_CUT(1, flash_bitset_set(&bitset, 4));
+    CHECK(flash_sim_cut_happened);
+    // The half-word program did not happen, the flag next to it is untouched.
+    CHECK(flash_bitset_test(&bitset, 3));
+    CHECK(!flash_bitset_test(&bitset, 4));
+    CHECK(flash_bitset_set(&bitset, 4) == FLASH_STATUS_OK);
+    CHECK(flash_bitset_count(&bitset) == 2);
+}
+static void test_power_cut_during_commit(void) {
+    for(uint32_t cut = 1; cut < 20; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_bitset bitset = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+        // Every fourth flag of both pages set, then clear a few on page 0.
+        for(uint16_t flag = 0; flag < BITSET_FLAGS; flag += 4) {
+            CHECK(flash_bitset_set(&bitset, flag) == FLASH_STATUS_OK);
+        }
+        CHECK(flash_bitset_clear(&bitset, 8) == FLASH_STATUS_OK);
+        CHECK(flash_bitset_clear(&bitset, 100) == FLASH_STATUS_OK);
+        FLASH_SIM_POWER_CUT(cut, flash_bitset_commit(&bitset));
+        struct flash_bitset mounted = { .start_addr = BITSET_ADDR, .n_pages = BITSET_PAGES };
+        for(uint16_t flag = 0; flag < BITSET_FLAGS; flag++) {
+            uint8_t was_set = (flag % 4) == 0;
+            if(flag >= FLASH_BITSET_FLAGS_PER_PAGE) {
+                // The other page is never touched.
+                CHECK(flash_bitset_test(&mounted, flag) == was_set);
+            } else if(!flash_sim_cut_happened) {
+                CHECK(flash_bitset_test(&mounted, flag) == (was_set && flag != 8 && flag != 100));
+            } else {
+                // The page being rewritten may lose set flags, as documented, but never gains any.
+                CHECK(!flash_bitset_test(&mounted, flag) || was_set);
+            }
+        }
+    }
+}
+int main(void) {
+    test_random_against_model();
+    test_set_costs_no_erase();
+    test_power_cut_during_set();
+    test_power_cut_during_commit();
+    printf("test_bitset: ok\n");
+    return 0;
+}
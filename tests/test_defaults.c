@@ -0,0 +1,89 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_defaults.h: reads fall back to the image, overrides and their removal, erases only where needed, a
+ * float across a page boundary.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_defaults.h"
+#define DEFAULTS_ADDR 0x08003C00
+// 0x3F80 at offset 6 is the upper half of 1.0f, offset 4 holds the lower half (0x0000) and offset 2 has no default.
+static const uint16_t image[] = { 0x1234, 0xFFFF, 0x0000, 0x3F80, 0xFFFF, 1000 };
+static void test_fresh_region_reads_defaults(void) {
+    flash_sim_init();
+    struct flash_defaults defaults = { DEFAULTS_ADDR, image, sizeof(image) / sizeof(image[0]) };
+    CHECK(flash_defaults_read_16(&defaults, 0) == 0x1234);
+    CHECK(flash_defaults_read_16(&defaults, 2) == 0xFFFF);
+    CHECK(flash_defaults_read_16(&defaults, 10) == 1000);
+    CHECK(flash_defaults_read_float(&defaults, 4) == 1.0f);
+    // Past the image the region is read as is.
+    CHECK(flash_defaults_read_16(&defaults, 100) == 0xFFFF);
+}
+static void test_overrides(void) {
+    flash_sim_init();
+    struct flash_defaults defaults = { DEFAULTS_ADDR, image, sizeof(image) / sizeof(image[0]) };
+    // Writing the default stores nothing.
+    CHECK(flash_defaults_write_16(&defaults, 10, 1000) == FLASH_STATUS_OK);
+    CHECK(flash_read_16_bits(DEFAULTS_ADDR + 10) == 0xFFFF);
+    CHECK(flash_sim_stats.programs == 0);
+    // An override on an erased half-word is a single program.
+    CHECK(flash_defaults_write_16(&defaults, 10, 999) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_16(&defaults, 10) == 999);
+    CHECK(flash_sim_stats.erases == 0);
+    CHECK(flash_defaults_write_16(&defaults, 0, 7) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_16(&defaults, 0) == 7);
+    CHECK(flash_sim_stats.erases == 0);
+    // Back to the default: the override has to go, which rewrites the page and keeps the other override.
+    CHECK(flash_defaults_write_16(&defaults, 10, 1000) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_16(&defaults, 10) == 1000);
+    CHECK(flash_read_16_bits(DEFAULTS_ADDR + 10) == 0xFFFF);
+    CHECK(flash_sim_stats.erases == 1);
+    CHECK(flash_defaults_read_16(&defaults, 0) == 7);
+    // Floats work the same way on both half-words.
+    CHECK(flash_defaults_write_float(&defaults, 4, 2.5f) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_float(&defaults, 4) == 2.5f);
+    CHECK(flash_defaults_write_float(&defaults, 4, 1.0f) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_float(&defaults, 4) == 1.0f);
+    CHECK(*(const uint32_t*)(uintptr_t)(DEFAULTS_ADDR + 4) == 0xFFFFFFFF);
+    // 0xFFFF can only be stored where it is the default.
+    CHECK(flash_defaults_write_16(&defaults, 0, 0xFFFF) == FLASH_STATUS_INVALID);
+    CHECK(flash_defaults_write_16(&defaults, 2, 0xFFFF) == FLASH_STATUS_OK);
+    // Everything survives a reboot.
+    flash_sim_reboot();
+    CHECK(flash_defaults_read_16(&defaults, 0) == 7);
+    CHECK(flash_defaults_read_16(&defaults, 10) == 1000);
+}
+static void test_float_across_pages(void) {
+    flash_sim_init();
+    struct flash_defaults defaults = { DEFAULTS_ADDR, image, sizeof(image) / sizeof(image[0]) };
+    // A float at offset 62 has its upper half-word in the next page, together with another override.
+    CHECK(flash_defaults_write_16(&defaults, 64 + 8, 42) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_write_float(&defaults, 62, 1.1f) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_float(&defaults, 62) == 1.1f);
+    CHECK(flash_sim_stats.erases == 0);
+    // Overwriting it rewrites both pages, each with its own copy, and keeps the other override.
+    CHECK(flash_defaults_write_float(&defaults, 62, -3.75f) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_float(&defaults, 62) == -3.75f);
+    CHECK(flash_sim_stats.erases == 2);
+    CHECK(flash_defaults_read_16(&defaults, 64 + 8) == 42);
+    flash_sim_reboot();
+    CHECK(flash_defaults_read_float(&defaults, 62) == -3.75f);
+    CHECK(flash_defaults_read_16(&defaults, 64 + 8) == 42);
+}
+static void test_power_cut_during_override(void) {
+    flash_sim_init();
+    struct flash_defaults defaults = { DEFAULTS_ADDR, image, sizeof(image) / sizeof(image[0]) };
+    FLASH_SIM_POWER_CUT(1, flash_defaults_write_16(&defaults, 10, 999));
+    CHECK(flash_sim_cut_happened);
+    // The program did not happen, the default is still served.
+    CHECK(flash_defaults_read_16(&defaults, 10) == 1000);
+    CHECK(flash_defaults_write_16(&defaults, 10, 999) == FLASH_STATUS_OK);
+    CHECK(flash_defaults_read_16(&defaults, 10) == 999);
+}
+int main(void) {
+    test_fresh_region_reads_defaults();
+    test_overrides();
+    test_float_across_pages();
+    test_power_cut_during_override();
+    printf("test_defaults: ok\n");
+    return 0;
+}
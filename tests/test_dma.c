@@ -0,0 +1,83 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_dma.h: copies of every alignment, completion by polling and by the interrupt, each calling the callback once.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_dma.h"
+#define TABLE_ADDR 0x08003C00
+#define TABLE_LENGTH 64
+static uint8_t table[TABLE_LENGTH];
+static uint8_t callbacks;
+static void count_callback(void *context) {
+    CHECK(context == &callbacks);
+    callbacks++;
+}
+static void program_table(void) {
+    for(uint8_t n = 0; n < TABLE_LENGTH; n++) {
+        table[n] = (uint8_t)flash_sim_random();
+    }
+    flash_unlock();
+    for(uint8_t n = 0; n < TABLE_LENGTH; n += 2) {
+        flash_program_16(TABLE_ADDR + n, table[n] | table[n + 1] << 8);
+    }
+    flash_lock();
+}
+static void test_polled_copies(void) {
+    // Words, half-words and bytes, picked from the alignment of both ends and the length.
+    static const struct { uint8_t dest_offset, src_offset, length; uint16_t count; } copies[] = {
+        { 0, 0, 32, 8 },
+        { 2, 2, 6, 3 },
+        { 0, 1, 5, 5 },
+        { 1, 0, 8, 8 },
+        { 4, 8, 56, 14 },
+    };
+    for(uint8_t n = 0; n < sizeof(copies) / sizeof(copies[0]); n++) {
+        // The channel takes 32-bit addresses, so the destinations are static rather than on the stack.
+        static uint32_t dest[TABLE_LENGTH / 4 + 1];
+        memset(dest, 0, sizeof(dest));
+        uint8_t *bytes = (uint8_t*)dest + copies[n].dest_offset;
+        callbacks = 0;
+        CHECK(flash_dma_copy_start(bytes, TABLE_ADDR + copies[n].src_offset, copies[n].length, count_callback, &callbacks) == FLASH_STATUS_OK);
+        CHECK(DMA1_Channel3->CNTR == copies[n].count);
+        // One copy at a time.
+        CHECK(flash_dma_copy_start(bytes, TABLE_ADDR, 4, NULL, NULL) == FLASH_STATUS_INVALID);
+        CHECK(!flash_dma_is_done());
+        flash_sim_dma_run();
+        flash_dma_wait();
+        CHECK(flash_dma_is_done());
+        CHECK(callbacks == 1);
+        CHECK(!memcmp(bytes, table + copies[n].src_offset, copies[n].length));
+        CHECK(DMA1_Channel3->CFGR == 0);
+    }
+    CHECK(flash_dma_copy_start(table, TABLE_ADDR, 0, NULL, NULL) == FLASH_STATUS_INVALID);
+}
+static void test_interrupt_completion(void) {
+    flash_dma_enable_interrupt();
+    CHECK(flash_sim_enabled_irqs & ((uint32_t)1 << (DMA1_Channel3_IRQn - PVD_IRQn)));
+    for(uint8_t n = 0; n < 3; n++) {
+        static uint8_t dest[TABLE_LENGTH];
+        memset(dest, 0, sizeof(dest));
+        callbacks = 0;
+        CHECK(flash_dma_copy_start(dest, TABLE_ADDR, TABLE_LENGTH, count_callback, &callbacks) == FLASH_STATUS_OK);
+        flash_sim_dma_run();
+        // The transfer is done but only the handler completes it, polling cannot race it into a second callback.
+        CHECK(!flash_dma_is_done());
+        CHECK(callbacks == 0);
+        flash_dma_irq_handler();
+        CHECK(callbacks == 1);
+        CHECK(flash_dma_is_done());
+        // A late or spurious interrupt does not complete the copy again.
+        flash_dma_irq_handler();
+        CHECK(callbacks == 1);
+        CHECK(!memcmp(dest, table, TABLE_LENGTH));
+    }
+}
+int main(void) {
+    flash_sim_init();
+    flash_sim_seed(7);
+    program_table();
+    test_polled_copies();
+    test_interrupt_completion();
+    printf("test_dma: ok\n");
+    return 0;
+}
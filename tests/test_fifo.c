@@ -0,0 +1,148 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_fifo.h: random pushes and pops against a model queue with remounts, and power cuts during push and pop.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_fifo.h"
+#define FIFO_ADDR 0x08003C00
+#define FIFO_PAGES 4
+#define MODEL_SIZE 4096
+static uint8_t model_data[MODEL_SIZE][FLASH_FIFO_MAX_RECORD];
+static uint8_t model_length[MODEL_SIZE];
+static uint32_t model_head;
+static uint32_t model_tail;
+static struct flash_fifo fifo_mounted(void) {
+    struct flash_fifo fifo = { .start_addr = FIFO_ADDR, .n_pages = FIFO_PAGES };
+    flash_fifo_mount(&fifo);
+    return fifo;
+}
+static void make_record(uint8_t *data, uint8_t length, uint32_t tag) {
+    for(uint8_t n = 0; n < length; n++) {
+        data[n] = (uint8_t)(tag * 7 + n);
+    }
+}
+// Pop every record, checking it against the tags expected in order. Returns the number of records popped.
+static uint8_t drain_count(struct flash_fifo *fifo, const uint32_t *tags, uint8_t max_tags) {
+    uint8_t n = 0;
+    for(; !flash_fifo_is_empty(fifo); n++) {
+        CHECK(n < max_tags);
+        uint8_t expected[8];
+        uint8_t data[FLASH_FIFO_MAX_RECORD];
+        make_record(expected, sizeof(expected), tags[n]);
+        CHECK(flash_fifo_peek(fifo, data, sizeof(data)) == sizeof(expected));
+        CHECK(!memcmp(data, expected, sizeof(expected)));
+        CHECK(flash_fifo_pop(fifo) == FLASH_STATUS_OK);
+    }
+    return n;
+}
+static void test_random_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(1);
+    struct flash_fifo fifo = fifo_mounted();
+    CHECK(flash_fifo_is_empty(&fifo));
+    uint32_t pushes = 0;
+    for(uint32_t round = 0; round < 20000; round++) {
+        uint32_t choice = flash_sim_random() % 10;
+        if(choice < 5) {
+            uint8_t data[FLASH_FIFO_MAX_RECORD];
+            uint8_t length = 1 + flash_sim_random() % 20;
+            make_record(data, length, round);
+            uint8_t status = flash_fifo_push(&fifo, data, length);
+            if(status == FLASH_STATUS_OK) {
+                CHECK(model_tail - model_head < MODEL_SIZE);
+                memcpy(model_data[model_tail % MODEL_SIZE], data, length);
+                model_length[model_tail % MODEL_SIZE] = length;
+                model_tail++;
+                pushes++;
+            } else {
+                CHECK(status == FLASH_STATUS_FULL);
+            }
+        } else if(choice < 9) {
+            uint8_t data[FLASH_FIFO_MAX_RECORD];
+            uint8_t length = flash_fifo_peek(&fifo, data, sizeof(data));
+            if(model_head == model_tail) {
+                CHECK(length == 0);
+                CHECK(flash_fifo_pop(&fifo) == FLASH_STATUS_EMPTY);
+                continue;
+            }
+            CHECK(length == model_length[model_head % MODEL_SIZE]);
+            CHECK(!memcmp(data, model_data[model_head % MODEL_SIZE], length));
+            CHECK(flash_fifo_pop(&fifo) == FLASH_STATUS_OK);
+            model_head++;
+        } else {
+            if(flash_sim_random() & 1) {
+                flash_fifo_reclaim(&fifo);
+            }
+            // A remount finds the same head and tail.
+            struct flash_fifo mounted = fifo_mounted();
+            CHECK(flash_fifo_is_empty(&mounted) == (model_head == model_tail));
+            if(model_head != model_tail) {
+                CHECK(!memcmp(&mounted, &fifo, sizeof(fifo)));
+            }
+            fifo = mounted;
+        }
+    }
+    // The test has to wrap the ring many times to mean something.
+    CHECK(pushes > 5000);
+    CHECK(flash_sim_stats.erases > 100);
+}
+static void test_power_cut_during_push(void) {
+    for(uint32_t cut = 1; cut < 40; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_fifo fifo = fifo_mounted();
+        uint8_t data[8];
+        // Fill all four pages and consume the first three, so the cut push has to erase and open page 0 again.
+        uint32_t tag = 0;
+        for(; tag < 24; tag++) {
+            make_record(data, sizeof(data), tag);
+            CHECK(flash_fifo_push(&fifo, data, sizeof(data)) == FLASH_STATUS_OK);
+        }
+        for(uint8_t n = 0; n < 20; n++) {
+            CHECK(flash_fifo_pop(&fifo) == FLASH_STATUS_OK);
+        }
+        make_record(data, sizeof(data), tag);
+        FLASH_SIM_POWER_CUT(cut, flash_fifo_push(&fifo, data, sizeof(data)));
+        uint8_t was_cut = flash_sim_cut_happened;
+        fifo = fifo_mounted();
+        // The cut record is either there in full or not at all, the older records survive.
+        uint32_t tags[5] = { 20, 21, 22, 23, 24 };
+        uint8_t n_tags = drain_count(&fifo, tags, 5);
+        CHECK(n_tags == 5 || (was_cut && n_tags == 4));
+        // The FIFO keeps working after the cut.
+        make_record(data, sizeof(data), 99);
+        CHECK(flash_fifo_push(&fifo, data, sizeof(data)) == FLASH_STATUS_OK);
+        fifo = fifo_mounted();
+        uint32_t after[] = { 99 };
+        CHECK(drain_count(&fifo, after, 1) == 1);
+    }
+}
+static void test_power_cut_during_pop(void) {
+    for(uint32_t cut = 1; cut < 4; cut++) {
+        flash_sim_init();
+        struct flash_fifo fifo = fifo_mounted();
+        uint8_t data[8];
+        for(uint32_t tag = 0; tag < 8; tag++) {
+            make_record(data, sizeof(data), tag);
+            CHECK(flash_fifo_push(&fifo, data, sizeof(data)) == FLASH_STATUS_OK);
+        }
+        // Records 0 to 5 fill the first page, popping record 5 also marks that page consumed.
+        for(uint8_t n = 0; n < 5; n++) {
+            CHECK(flash_fifo_pop(&fifo) == FLASH_STATUS_OK);
+        }
+        FLASH_SIM_POWER_CUT(cut, flash_fifo_pop(&fifo));
+        fifo = fifo_mounted();
+        uint8_t got[FLASH_FIFO_MAX_RECORD];
+        CHECK(flash_fifo_peek(&fifo, got, sizeof(got)) == sizeof(data));
+        make_record(data, sizeof(data), got[0] == 5 * 7 ? 5 : 6);
+        CHECK(!memcmp(got, data, sizeof(data)));
+        CHECK(got[0] == 6 * 7 || (flash_sim_cut_happened && got[0] == 5 * 7));
+    }
+}
+int main(void) {
+    test_random_against_model();
+    test_power_cut_during_push();
+    test_power_cut_during_pop();
+    printf("test_fifo: ok\n");
+    return 0;
+}
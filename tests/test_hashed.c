@@ -0,0 +1,149 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_hashed.h: random writes against a model with remounts, a bucket spilling into the overflow page and the
+ * rehash that moves it home, a rehash on a failing flash and power cuts during a rehash.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_hashed.h"
+#define HASHED_ADDR 0x08003B40 // pages 0 to 2 in sector 14, page 3 and up in sector 15
+#define HASHED_SECTOR_3 15
+#define MODEL_BLANK -1
+static int32_t model[65536];
+static struct flash_hashed hashed_mounted(uint8_t n_pages, uint8_t n_buckets) {
+    struct flash_hashed hashed = { .start_addr = HASHED_ADDR, .n_pages = n_pages, .n_buckets = n_buckets };
+    CHECK(flash_hashed_mount(&hashed) == FLASH_STATUS_OK);
+    return hashed;
+}
+static void model_clear(void) {
+    for(uint32_t key = 0; key < 65536; key++) {
+        model[key] = MODEL_BLANK;
+    }
+}
+static void hashed_write(struct flash_hashed *hashed, uint16_t key, uint16_t value) {
+    CHECK(flash_hashed_write(hashed, key, value) == FLASH_STATUS_OK);
+    model[key] = value;
+}
+static void model_check(const struct flash_hashed *hashed) {
+    for(uint32_t key = 0; key < FLASH_HASHED_BLANK; key++) {
+        uint16_t value;
+        uint8_t status = flash_hashed_read(hashed, key, &value);
+        CHECK((status == FLASH_STATUS_EMPTY) == (model[key] == MODEL_BLANK));
+        CHECK(status == FLASH_STATUS_EMPTY || value == model[key]);
+    }
+}
+static void check_same_mount(const struct flash_hashed *hashed) {
+    struct flash_hashed mounted = hashed_mounted(hashed->n_pages, hashed->n_buckets);
+    CHECK(mounted.overflow_page == hashed->overflow_page && mounted.overflowed == hashed->overflowed && mounted.next_seq == hashed->next_seq);
+    CHECK(!memcmp(mounted.bucket_pages, hashed->bucket_pages, hashed->n_buckets));
+}
+static void test_random_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(31);
+    model_clear();
+    struct flash_hashed hashed = hashed_mounted(10, 8);
+    static uint16_t keys[45];
+    for(uint8_t n = 0; n < sizeof(keys) / sizeof(keys[0]); n++) {
+        keys[n] = flash_sim_random() % FLASH_HASHED_BLANK;
+    }
+    for(uint32_t round = 0; round < 30000; round++) {
+        hashed_write(&hashed, keys[flash_sim_random() % (sizeof(keys) / sizeof(keys[0]))], flash_sim_random());
+        if(round % 2000 == 0) {
+            flash_sim_reboot();
+            check_same_mount(&hashed);
+            model_check(&hashed);
+        }
+    }
+    model_check(&hashed);
+    CHECK(flash_hashed_write(&hashed, FLASH_HASHED_BLANK, 1) == FLASH_STATUS_INVALID);
+    struct flash_hashed too_small = { .start_addr = HASHED_ADDR, .n_pages = 9, .n_buckets = 8 };
+    CHECK(flash_hashed_mount(&too_small) == FLASH_STATUS_INVALID);
+}
+// One bucket: keys 0 to 14 fill the home page, keys 100 to 113 spill, then key 0 is rewritten and fills the overflow page. Its home copy
+// is stale now, so a rehash compacts the home page and moves key 100 there.
+static struct flash_hashed overflowing_bucket(void) {
+    flash_sim_init();
+    model_clear();
+    struct flash_hashed hashed = hashed_mounted(4, 1);
+    for(uint16_t key = 0; key < FLASH_HASHED_RECORDS_PER_PAGE; key++) {
+        hashed_write(&hashed, key, key);
+    }
+    CHECK(hashed.overflow_page == FLASH_HASHED_NO_PAGE);
+    for(uint16_t key = 100; key < 114; key++) {
+        hashed_write(&hashed, key, key);
+    }
+    hashed_write(&hashed, 0, 1000);
+    CHECK(hashed.overflowed == 1);
+    CHECK(flash_hashed_page_end(&hashed, hashed.overflow_page) == FLASH_PAGE_SIZE);
+    return hashed;
+}
+static void test_overflow_and_rehash(void) {
+    struct flash_hashed hashed = overflowing_bucket();
+    model_check(&hashed);
+    uint8_t overflow_page = hashed.overflow_page;
+    hashed_write(&hashed, 101, 2000);
+    // Key 100 went home, the other spilled keys and the new write are in a fresh overflow page.
+    CHECK(hashed.overflow_page != overflow_page);
+    CHECK(flash_is_page_erased(flash_hashed_page_addr(&hashed, overflow_page)));
+    CHECK(!flash_hashed_page_find(&hashed, hashed.overflow_page, 100));
+    CHECK(flash_hashed_page_find(&hashed, hashed.bucket_pages[0], 100));
+    CHECK(!flash_hashed_page_find(&hashed, hashed.bucket_pages[0], 0));
+    CHECK(flash_hashed_count_live(&hashed, hashed.bucket_pages[0]) == FLASH_HASHED_RECORDS_PER_PAGE);
+    model_check(&hashed);
+    check_same_mount(&hashed);
+    // More distinct keys than the home and the overflow page hold end in FLASH_STATUS_FULL without losing any.
+    uint8_t status = FLASH_STATUS_OK;
+    uint16_t key;
+    for(key = 200; key < 300 && status == FLASH_STATUS_OK; key++) {
+        status = flash_hashed_write(&hashed, key, key);
+        if(status == FLASH_STATUS_OK) {
+            model[key] = key;
+        }
+    }
+    CHECK(status == FLASH_STATUS_FULL && key < 300);
+    model_check(&hashed);
+}
+static void test_rehash_on_failing_flash(void) {
+    struct flash_hashed hashed = overflowing_bucket();
+    uint8_t overflow_page = hashed.overflow_page;
+    // The first page opened is the home page, the only one in its sector. The rehash compacts it, fails to erase it and stops there
+    // with the flash status instead of going on with a new overflow page.
+    CHECK(hashed.bucket_pages[0] == 3);
+    FLASH->WPR &= ~(1UL << HASHED_SECTOR_3);
+    CHECK(flash_hashed_write(&hashed, 101, 2000) == FLASH_STATUS_WRITE_PROTECTED);
+    CHECK(hashed.overflow_page == overflow_page);
+    FLASH->WPR |= 1UL << HASHED_SECTOR_3;
+    // Nothing was lost, and the rehash goes through on a working flash.
+    hashed = hashed_mounted(4, 1);
+    CHECK(hashed.bucket_pages[0] != 3);
+    model_check(&hashed);
+    hashed_write(&hashed, 101, 2000);
+    model_check(&hashed);
+    check_same_mount(&hashed);
+}
+static void test_power_cut_during_rehash(void) {
+    uint8_t was_cut = 1;
+    for(uint32_t cut = 1; was_cut; cut++) {
+        struct flash_hashed hashed = overflowing_bucket();
+        flash_sim_seed(cut);
+        FLASH_SIM_POWER_CUT(cut, flash_hashed_write(&hashed, 101, 2000));
+        was_cut = flash_sim_cut_happened;
+        CHECK(was_cut || cut > 20);
+        // Every key keeps its newest value, the cut write either went through or left the old one.
+        hashed = hashed_mounted(4, 1);
+        uint16_t value;
+        CHECK(flash_hashed_read(&hashed, 101, &value) == FLASH_STATUS_OK && (value == model[101] || value == 2000));
+        model[101] = value;
+        model_check(&hashed);
+        hashed_write(&hashed, 101, 2001);
+        model_check(&hashed);
+        check_same_mount(&hashed);
+    }
+}
+int main(void) {
+    test_random_against_model();
+    test_overflow_and_rehash();
+    test_rehash_on_failing_flash();
+    test_power_cut_during_rehash();
+    printf("test_hashed: ok\n");
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_hibernate.h: save and resume across slots, torn images and power cuts during a save.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_hibernate.h"
+#define HIBERNATE_ADDR 0x08003C00
+struct state {
+    uint32_t words[50];
+    uint8_t bytes[3];
+};
+static void make_state(struct state *state, uint32_t tag) {
+    for(uint8_t n = 0; n < 50; n++) {
+        state->words[n] = tag * 1000 + n;
+    }
+    state->bytes[0] = tag;
+    state->bytes[1] = tag >> 8;
+    state->bytes[2] = 0x5A;
+}
+static void test_save_and_resume(void) {
+    flash_sim_init();
+    struct flash_hibernate hibernate = { HIBERNATE_ADDR, 12, 4 };
+    struct state saved;
+    struct state resumed;
+    CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, sizeof(resumed)) == FLASH_STATUS_EMPTY);
+    for(uint32_t round = 0; round < 200; round++) {
+        make_state(&saved, round);
+        // Every other save finds its slot prepared and does not erase.
+        if(round % 2) {
+            CHECK(flash_hibernate_prepare(&hibernate) == FLASH_STATUS_OK);
+        }
+        struct flash_sim_stats before = flash_sim_stats;
+        CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+        CHECK(!(round % 2) || flash_sim_stats.erases == before.erases);
+        // The 214-byte image takes four page programs plus the CRC.
+        CHECK(flash_sim_stats.page_programs - before.page_programs == 4);
+        CHECK(flash_sim_stats.programs - before.programs == 1);
+        memset(&resumed, 0, sizeof(resumed));
+        CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, sizeof(resumed)) == FLASH_STATUS_OK);
+        CHECK(!memcmp(&saved, &resumed, sizeof(saved)));
+    }
+    // Another tag or length is never restored.
+    CHECK(flash_hibernate_resume(&hibernate, 2, &resumed, sizeof(resumed)) == FLASH_STATUS_EMPTY);
+    CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, 10) == FLASH_STATUS_EMPTY);
+    CHECK(flash_hibernate_save(&hibernate, FLASH_HIBERNATE_BLANK, &saved, sizeof(saved)) == FLASH_STATUS_INVALID);
+    CHECK(flash_hibernate_save(&hibernate, 1, &saved, 4 * FLASH_PAGE_SIZE) == FLASH_STATUS_INVALID);
+}
+static void test_power_cut_during_save(void) {
+    // Two slots: a save that wrapped onto the older slot after a torn one would erase the only valid image.
+    for(uint32_t cut = 1; cut < 12; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_hibernate hibernate = { HIBERNATE_ADDR, 8, 4 };
+        struct state saved;
+        struct state resumed;
+        make_state(&saved, 1);
+        CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+        make_state(&saved, 2);
+        CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+        // Save 3 is cut, then save 4 is cut as well.
+        make_state(&saved, 3);
+        FLASH_SIM_POWER_CUT(cut, flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)));
+        uint8_t cut_3 = flash_sim_cut_happened;
+        make_state(&saved, 4);
+        FLASH_SIM_POWER_CUT(cut, flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)));
+        uint8_t cut_4 = flash_sim_cut_happened;
+        CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, sizeof(resumed)) == FLASH_STATUS_OK);
+        // The newest save that completed comes back, never an older one.
+        struct state expected;
+        make_state(&expected, !cut_4 ? 4 : !cut_3 ? 3 : 2);
+        CHECK(!memcmp(&expected, &resumed, sizeof(expected)));
+        // Saving goes on normally.
+        make_state(&saved, 5);
+        CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+        CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, sizeof(resumed)) == FLASH_STATUS_OK);
+        CHECK(!memcmp(&saved, &resumed, sizeof(saved)));
+    }
+}
+static void test_corrupt_newest_falls_back(void) {
+    flash_sim_init();
+    struct flash_hibernate hibernate = { HIBERNATE_ADDR, 12, 4 };
+    struct state saved;
+    struct state resumed;
+    make_state(&saved, 1);
+    CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+    make_state(&saved, 2);
+    CHECK(flash_hibernate_save(&hibernate, 1, &saved, sizeof(saved)) == FLASH_STATUS_OK);
+    // A worn cell in the newest image breaks its CRC.
+    flash_sim_wear_out(flash_hibernate_slot_addr(&hibernate, 1) + 100);
+    CHECK(flash_hibernate_resume(&hibernate, 1, &resumed, sizeof(resumed)) == FLASH_STATUS_OK);
+    make_state(&saved, 1);
+    CHECK(!memcmp(&saved, &resumed, sizeof(saved)));
+    // The next save goes over the broken image, not over the valid one.
+    uint16_t seq;
+    CHECK(flash_hibernate_next_slot(&hibernate, &seq) == 1);
+}
+int main(void) {
+    test_save_and_resume();
+    test_power_cut_during_save();
+    test_corrupt_newest_falls_back();
+    printf("test_hibernate: ok\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_slots.h: writes across rollovers, and power cuts during a write and during the rollover erase.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_slots.h"
+#define SLOTS_ADDR 0x08003C00
+#define SLOTS_PAGES 2
+#define SLOTS_TOTAL (SLOTS_PAGES * FLASH_SLOTS_PER_PAGE)
+static void test_write_and_rollover(void) {
+    flash_sim_init();
+    struct flash_slots slots = { SLOTS_ADDR, SLOTS_PAGES };
+    uint16_t value;
+    CHECK(flash_slots_read(&slots, &value) == FLASH_STATUS_EMPTY);
+    for(uint16_t n = 0; n < 1000; n++) {
+        CHECK(flash_slots_write(&slots, n) == FLASH_STATUS_OK);
+        CHECK(flash_slots_read(&slots, &value) == FLASH_STATUS_OK);
+        CHECK(value == n);
+    }
+    // One erase of each page per full round of slots.
+    CHECK(flash_sim_stats.erases == (1000 - 1) / SLOTS_TOTAL * SLOTS_PAGES);
+    // Writing the stored value costs nothing, 0xFFFF cannot be stored.
+    uint32_t programs = flash_sim_stats.programs;
+    CHECK(flash_slots_write(&slots, 999) == FLASH_STATUS_OK);
+    CHECK(flash_sim_stats.programs == programs);
+    CHECK(flash_slots_write(&slots, FLASH_SLOTS_BLANK) == FLASH_STATUS_INVALID);
+}
+static void test_power_cut_during_write(void) {
+    flash_sim_init();
+    struct flash_slots slots = { SLOTS_ADDR, SLOTS_PAGES };
+    uint16_t value;
+    CHECK(flash_slots_write(&slots, 1) == FLASH_STATUS_OK);
+    FLASH_SIM_POWER_CUT(1, flash_slots_write(&slots, 2));
+    CHECK(flash_sim_cut_happened);
+    CHECK(flash_slots_read(&slots, &value) == FLASH_STATUS_OK);
+    CHECK(value == 1);
+}
+static void test_power_cut_during_rollover(void) {
+    for(uint32_t cut = 1; cut <= SLOTS_PAGES + 1; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_slots slots = { SLOTS_ADDR, SLOTS_PAGES };
+        uint16_t value;
+        for(uint16_t n = 0; n < SLOTS_TOTAL; n++) {
+            CHECK(flash_slots_write(&slots, n) == FLASH_STATUS_OK);
+        }
+        // The next write erases every page, then programs the first slot.
+        FLASH_SIM_POWER_CUT(cut, flash_slots_write(&slots, 5000));
+        uint8_t status = flash_slots_read(&slots, &value);
+        if(!flash_sim_cut_happened) {
+            CHECK(status == FLASH_STATUS_OK && value == 5000);
+        } else {
+            // The value may be lost, as documented, but never turns into something that was not written.
+            CHECK(status == FLASH_STATUS_EMPTY || (status == FLASH_STATUS_OK && value < SLOTS_TOTAL));
+        }
+        // Writing goes on from whatever the cut left.
+        for(uint16_t n = 0; n < 3 * SLOTS_TOTAL; n++) {
+            CHECK(flash_slots_write(&slots, 6000 + n) == FLASH_STATUS_OK);
+            CHECK(flash_slots_read(&slots, &value) == FLASH_STATUS_OK);
+            CHECK(value == 6000 + n);
+        }
+    }
+}
+int main(void) {
+    test_write_and_rollover();
+    test_power_cut_during_write();
+    test_power_cut_during_rollover();
+    printf("test_slots: ok\n");
+    return 0;
+}
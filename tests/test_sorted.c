@@ -0,0 +1,144 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_sorted.h: random writes against a model with remounts and compactions, the segment order, a full
+ * segment and power cuts during compaction.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_sorted.h"
+#define SORTED_ADDR 0x08003800
+#define SEGMENT_PAGES 6
+#define TAIL_PAGES 2
+#define MODEL_KEYS 1024
+#define MODEL_BLANK -1
+static int32_t model[MODEL_KEYS];
+static struct flash_sorted sorted_mounted(void) {
+    struct flash_sorted sorted = { .start_addr = SORTED_ADDR, .segment_pages = SEGMENT_PAGES, .tail_pages = TAIL_PAGES };
+    CHECK(flash_sorted_mount(&sorted) == FLASH_STATUS_OK);
+    return sorted;
+}
+static void model_clear(void) {
+    for(uint16_t key = 0; key < MODEL_KEYS; key++) {
+        model[key] = MODEL_BLANK;
+    }
+}
+static void model_check(const struct flash_sorted *sorted) {
+    for(uint16_t key = 0; key < MODEL_KEYS; key++) {
+        uint16_t value;
+        uint8_t status = flash_sorted_read(sorted, key, &value);
+        CHECK((status == FLASH_STATUS_EMPTY) == (model[key] == MODEL_BLANK));
+        CHECK(status == FLASH_STATUS_EMPTY || value == model[key]);
+    }
+}
+// The records of the active segment are in strictly ascending key order and the header table holds the first key of every data page.
+static void check_segment_order(const struct flash_sorted *sorted) {
+    if(sorted->segment == FLASH_SORTED_NO_SEGMENT) {
+        return;
+    }
+    uint32_t addr = flash_sorted_addr(sorted, sorted->segment);
+    for(uint16_t n = 0; n < sorted->count; n++) {
+        uint16_t key = flash_read_16_bits(addr + FLASH_PAGE_SIZE + n * FLASH_SORTED_RECORD_SIZE + 2);
+        CHECK(n == 0 || key > flash_read_16_bits(addr + FLASH_PAGE_SIZE + (n - 1) * FLASH_SORTED_RECORD_SIZE + 2));
+        if(n % FLASH_SORTED_RECORDS_PER_PAGE == 0) {
+            CHECK(flash_read_16_bits(addr + FLASH_SORTED_HEADER_SIZE + n / FLASH_SORTED_RECORDS_PER_PAGE * 2) == key);
+        }
+    }
+}
+static void test_random_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(21);
+    model_clear();
+    struct flash_sorted sorted = sorted_mounted();
+    CHECK(sorted.segment == FLASH_SORTED_NO_SEGMENT && sorted.tail_offset == 0);
+    for(uint32_t round = 0; round < 20000; round++) {
+        // Spread keys with gaps, a third of them written most of the time.
+        uint16_t key = (flash_sim_random() % 2 ? flash_sim_random() % 70 : flash_sim_random() % 20) * 13;
+        uint16_t value = flash_sim_random();
+        CHECK(flash_sorted_write(&sorted, key, value) == FLASH_STATUS_OK);
+        model[key] = value;
+        if(round % 500 == 0) {
+            flash_sim_reboot();
+            struct flash_sorted mounted = sorted_mounted();
+            CHECK(mounted.segment == sorted.segment && mounted.seq == sorted.seq && mounted.count == sorted.count && mounted.tail_offset == sorted.tail_offset);
+            sorted = mounted;
+            model_check(&sorted);
+        }
+        if(round % 3000 == 0) {
+            CHECK(flash_sorted_compact(&sorted) == FLASH_STATUS_OK);
+            CHECK(sorted.tail_offset == 0);
+            check_segment_order(&sorted);
+        }
+    }
+    model_check(&sorted);
+    check_segment_order(&sorted);
+    CHECK(flash_sorted_write(&sorted, FLASH_SORTED_BLANK, 1) == FLASH_STATUS_INVALID);
+}
+static void test_unchanged_write_costs_nothing(void) {
+    flash_sim_init();
+    struct flash_sorted sorted = sorted_mounted();
+    CHECK(flash_sorted_write(&sorted, 7, 42) == FLASH_STATUS_OK);
+    CHECK(flash_sorted_compact(&sorted) == FLASH_STATUS_OK);
+    // Neither a tail record nor a segment record is rewritten with its own value.
+    uint32_t programs = flash_sim_stats.programs;
+    CHECK(flash_sorted_write(&sorted, 7, 42) == FLASH_STATUS_OK);
+    CHECK(flash_sorted_write(&sorted, 8, 1) == FLASH_STATUS_OK);
+    CHECK(flash_sorted_write(&sorted, 8, 1) == FLASH_STATUS_OK);
+    CHECK(flash_sim_stats.programs == programs + 2);
+}
+static void test_full_segment(void) {
+    flash_sim_init();
+    model_clear();
+    struct flash_sorted sorted = sorted_mounted();
+    // Distinct keys in descending order until the segment cannot take the merge.
+    uint16_t capacity = (SEGMENT_PAGES - 1) * FLASH_SORTED_RECORDS_PER_PAGE;
+    uint16_t n_keys = 0;
+    uint8_t status;
+    while((status = flash_sorted_write(&sorted, 1000 - n_keys, n_keys)) == FLASH_STATUS_OK) {
+        model[1000 - n_keys] = n_keys;
+        n_keys++;
+    }
+    CHECK(status == FLASH_STATUS_FULL);
+    CHECK(n_keys >= capacity && n_keys <= capacity + TAIL_PAGES * FLASH_SORTED_RECORDS_PER_PAGE);
+    // Nothing was lost, and existing keys can still be rewritten once the tail has room.
+    model_check(&sorted);
+    check_segment_order(&sorted);
+    CHECK(flash_sorted_compact(&sorted) == FLASH_STATUS_FULL);
+    model_check(&sorted);
+}
+static void test_power_cut_during_compaction(void) {
+    uint8_t was_cut = 1;
+    for(uint32_t cut = 1; was_cut; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        model_clear();
+        struct flash_sorted sorted = sorted_mounted();
+        // A segment, then a tail that rewrites some of its keys and adds new ones.
+        for(uint16_t key = 0; key < 40; key++) {
+            CHECK(flash_sorted_write(&sorted, key * 3, key) == FLASH_STATUS_OK);
+            model[key * 3] = key;
+        }
+        CHECK(flash_sorted_compact(&sorted) == FLASH_STATUS_OK);
+        for(uint16_t n = 0; n < 20; n++) {
+            uint16_t key = n % 2 ? n * 3 : n * 5 + 1;
+            CHECK(flash_sorted_write(&sorted, key, 1000 + n) == FLASH_STATUS_OK);
+            model[key] = 1000 + n;
+        }
+        FLASH_SIM_POWER_CUT(cut, flash_sorted_compact(&sorted));
+        was_cut = flash_sim_cut_happened;
+        // The old segment and the tail, or the new segment: either way every value is the newest one.
+        sorted = sorted_mounted();
+        model_check(&sorted);
+        check_segment_order(&sorted);
+        CHECK(flash_sorted_write(&sorted, 999, 1) == FLASH_STATUS_OK);
+        model[999] = 1;
+        CHECK(flash_sorted_compact(&sorted) == FLASH_STATUS_OK);
+        model_check(&sorted);
+    }
+}
+int main(void) {
+    test_random_against_model();
+    test_unchanged_write_costs_nothing();
+    test_full_segment();
+    test_power_cut_during_compaction();
+    printf("test_sorted: ok\n");
+    return 0;
+}
@@ -0,0 +1,558 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_store.h: writes and resets against a model with remounts, compaction, wear leveling, generation rollover and power cuts.
+ */
+#include "flash_sim.h"
+#define FLASH_STORE_WEAR_SPREAD 20 // level within a few thousand writes
+#include "ch32v003_flash_store.h"
+#define STORE_ADDR 0x08003800
+#define STORE_PAGES 8
+#define GENERATION_ADDR 0x08003E00
+#define EMERGENCY_ADDR 0x08003F00
+#define BAD_PAGES_ADDR 0x08003F40
+#define MODEL_KEYS 128
+#define MODEL_BLANK -1
+static int32_t model[MODEL_KEYS];
+static struct flash_store store_config(void) {
+    struct flash_store store = {
+        .start_addr = STORE_ADDR,
+        .n_pages = STORE_PAGES,
+        .generation_slots = { { GENERATION_ADDR, 1 }, { GENERATION_ADDR + FLASH_PAGE_SIZE, 1 } },
+        .emergency_addr = EMERGENCY_ADDR,
+    };
+    return store;
+}
+static struct flash_store store_mounted(void) {
+    struct flash_store store = store_config();
+    CHECK(flash_store_mount(&store) == FLASH_STATUS_OK);
+    return store;
+}
+// A store that retires the pages that fail.
+static struct flash_store bad_store_mounted(void) {
+    struct flash_store store = store_config();
+    store.bad_pages.start_addr = BAD_PAGES_ADDR;
+    store.bad_pages.n_pages = 1;
+    CHECK(flash_store_mount(&store) == FLASH_STATUS_OK);
+    return store;
+}
+// Wear out a cell of a free page, so the next erase of that page fails.
+static uint8_t wear_out_free_page(const struct flash_store *store) {
+    for(uint8_t page = 0; page < STORE_PAGES; page++) {
+        if(page != store->head_page && !flash_store_page_is_live(store, page) && !flash_store_page_is_bad(store, page)) {
+            flash_sim_wear_out(flash_store_page_addr(store, page) + 20);
+            return page;
+        }
+    }
+    return FLASH_STORE_NO_PAGE;
+}
+static void model_clear(void) {
+    for(uint16_t key = 0; key < MODEL_KEYS; key++) {
+        model[key] = MODEL_BLANK;
+    }
+}
+static void model_check(const struct flash_store *store) {
+    for(uint16_t key = 0; key < MODEL_KEYS; key++) {
+        uint16_t value;
+        uint8_t status = flash_store_read(store, key, &value);
+        CHECK((status == FLASH_STATUS_EMPTY) == (model[key] == MODEL_BLANK));
+        CHECK(status == FLASH_STATUS_EMPTY || value == model[key]);
+    }
+}
+static void test_random_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(5);
+    model_clear();
+    struct flash_store store = store_mounted();
+    for(uint32_t round = 0; round < 30000; round++) {
+        uint32_t choice = flash_sim_random() % 1000;
+        uint16_t key = flash_sim_random() % 40;
+        if(choice < 700) {
+            uint16_t value = flash_sim_random();
+            CHECK(flash_store_write(&store, key, value) == FLASH_STATUS_OK);
+            model[key] = value;
+        } else if(choice < 703) {
+            CHECK(flash_store_reset(&store) == FLASH_STATUS_OK);
+            model_clear();
+        } else if(choice < 750) {
+            uint8_t status = flash_store_gc_step(&store);
+            CHECK(status == FLASH_STATUS_OK || status == FLASH_STATUS_EMPTY);
+        } else if(choice < 760) {
+            // A remount after a reboot finds the same state.
+            flash_sim_reboot();
+            struct flash_store mounted = store_mounted();
+            CHECK(mounted.generation == store.generation);
+            CHECK(mounted.head_page == store.head_page);
+            CHECK(store.head_page == FLASH_STORE_NO_PAGE || mounted.head_offset == store.head_offset);
+            CHECK(store.head_page == FLASH_STORE_NO_PAGE || mounted.next_seq == store.next_seq);
+            store = mounted;
+        }
+        if(round % 64 == 0) {
+            model_check(&store);
+        }
+    }
+    model_check(&store);
+    CHECK(flash_store_write(&store, FLASH_STORE_BLANK, 1) == FLASH_STATUS_INVALID);
+}
+static void test_unchanged_write_costs_nothing(void) {
+    flash_sim_init();
+    struct flash_store store = store_mounted();
+    CHECK(flash_store_write(&store, 1, 42) == FLASH_STATUS_OK);
+    uint32_t programs = flash_sim_stats.programs;
+    CHECK(flash_store_write(&store, 1, 42) == FLASH_STATUS_OK);
+    CHECK(flash_sim_stats.programs == programs);
+}
+static void test_compaction_keeps_live_records(void) {
+    flash_sim_init();
+    struct flash_store store = store_mounted();
+    // 30 keys that never change, then one hot key rewritten until every page went through compaction several times.
+    for(uint16_t key = 0; key < 30; key++) {
+        CHECK(flash_store_write(&store, key, key * 3) == FLASH_STATUS_OK);
+    }
+    for(uint16_t n = 0; n < 2000; n++) {
+        CHECK(flash_store_write(&store, 100, n) == FLASH_STATUS_OK);
+    }
+    CHECK(flash_sim_stats.erases > 2 * STORE_PAGES);
+    flash_sim_reboot();
+    store = store_mounted();
+    for(uint16_t key = 0; key < 30; key++) {
+        uint16_t value;
+        CHECK(flash_store_read(&store, key, &value) == FLASH_STATUS_OK);
+        CHECK(value == key * 3);
+    }
+    uint16_t value;
+    CHECK(flash_store_read(&store, 100, &value) == FLASH_STATUS_OK);
+    CHECK(value == 1999);
+}
+static void test_full_store_does_not_erase(void) {
+    flash_sim_init();
+    struct flash_store store = store_mounted();
+    // Distinct keys until the store is full.
+    uint16_t n_keys = 0;
+    uint8_t status;
+    while((status = flash_store_write(&store, n_keys, n_keys)) == FLASH_STATUS_OK) {
+        n_keys++;
+    }
+    CHECK(status == FLASH_STATUS_FULL);
+    // All pages but the reserve hold live records only.
+    CHECK(n_keys == (STORE_PAGES - 1) * FLASH_STORE_RECORDS_PER_PAGE);
+    // Further writes fail without erasing anything, the data stays.
+    uint32_t erases = flash_sim_stats.erases;
+    CHECK(flash_store_write(&store, 1000, 1) == FLASH_STATUS_FULL);
+    CHECK(flash_store_write(&store, 0, 1) == FLASH_STATUS_FULL);
+    CHECK(flash_sim_stats.erases == erases);
+    for(uint16_t key = 0; key < n_keys; key++) {
+        uint16_t value;
+        CHECK(flash_store_read(&store, key, &value) == FLASH_STATUS_OK && value == key);
+    }
+    // A reset makes room again.
+    CHECK(flash_store_reset(&store) == FLASH_STATUS_OK);
+    CHECK(flash_store_write(&store, 1000, 1) == FLASH_STATUS_OK);
+}
+static void test_level_wear(void) {
+    flash_sim_init();
+    flash_sim_seed(3);
+    model_clear();
+    struct flash_store store = store_mounted();
+    // 40 keys written once fill three pages that compaction alone would never erase.
+    for(uint16_t key = 0; key < 40; key++) {
+        CHECK(flash_store_write(&store, key, key * 3) == FLASH_STATUS_OK);
+        model[key] = key * 3;
+    }
+    uint16_t levels = 0;
+    for(uint32_t round = 0; round < 20000; round++) {
+        uint16_t key = 40 + flash_sim_random() % 3;
+        uint16_t value = flash_sim_random();
+        CHECK(flash_store_write(&store, key, value) == FLASH_STATUS_OK);
+        model[key] = value;
+        uint8_t head_page = store.head_page;
+        uint8_t status = flash_store_gc_step(&store);
+        CHECK(status == FLASH_STATUS_OK || status == FLASH_STATUS_EMPTY);
+        if(store.head_page == head_page) {
+            continue;
+        }
+        // Static records were moved onto the most-worn page, which is sealed: the mount agrees, and the next write opens a less-worn page.
+        levels++;
+        uint8_t worn = store.head_page;
+        CHECK(store.head_offset == FLASH_PAGE_SIZE);
+        flash_sim_reboot();
+        store = store_mounted();
+        CHECK(store.head_page == worn && store.head_offset == FLASH_PAGE_SIZE);
+        CHECK(flash_store_write(&store, key, value + 1) == FLASH_STATUS_OK);
+        model[key] = value + 1;
+        CHECK(store.head_page != worn);
+        CHECK(flash_store_erase_count(&store, store.head_page) < flash_store_erase_count(&store, worn));
+        model_check(&store);
+    }
+    CHECK(levels > 0);
+    model_check(&store);
+    // No page is left far behind the others.
+    uint16_t min_erases = 0xFFFF;
+    uint16_t max_erases = 0;
+    for(uint8_t page = 0; page < STORE_PAGES; page++) {
+        uint16_t erases = flash_store_erase_count(&store, page);
+        min_erases = erases < min_erases ? erases : min_erases;
+        max_erases = erases > max_erases ? erases : max_erases;
+    }
+    CHECK(min_erases > 0);
+    CHECK(max_erases - min_erases <= 2 * FLASH_STORE_WEAR_SPREAD);
+}
+static void test_level_wear_seals_partial_page(void) {
+    flash_sim_init();
+    model_clear();
+    struct flash_store store = store_mounted();
+    for(uint16_t key = 0; key < 6; key++) {
+        CHECK(flash_store_write(&store, key, key) == FLASH_STATUS_OK);
+        model[key] = key;
+    }
+    // Wear every other page, so the half-filled head page is the one left behind.
+    uint8_t cold = store.head_page;
+    flash_session_begin();
+    for(uint8_t n = 0; n <= FLASH_STORE_WEAR_SPREAD; n++) {
+        for(uint8_t page = 0; page < STORE_PAGES; page++) {
+            CHECK(page == cold || flash_store_erase_page(&store, page) == FLASH_STATUS_OK);
+        }
+    }
+    flash_session_end();
+    CHECK(flash_store_gc_step(&store) == FLASH_STATUS_OK);
+    // The records moved onto a worn page, which takes no more: neither now nor after a remount.
+    uint8_t worn = store.head_page;
+    CHECK(worn != cold && store.head_offset == FLASH_PAGE_SIZE);
+    CHECK(flash_store_page_is_live(&store, worn) && !flash_store_page_is_live(&store, cold));
+    model_check(&store);
+    flash_sim_reboot();
+    store = store_mounted();
+    CHECK(store.head_page == worn && store.head_offset == FLASH_PAGE_SIZE);
+    model_check(&store);
+    CHECK(flash_store_write(&store, 10, 10) == FLASH_STATUS_OK);
+    model[10] = 10;
+    CHECK(store.head_page == cold);
+    model_check(&store);
+}
+static void test_bad_pages_against_model(void) {
+    flash_sim_init();
+    flash_sim_seed(11);
+    model_clear();
+    struct flash_store store = bad_store_mounted();
+    uint8_t worn[3];
+    uint8_t n_worn = 0;
+    for(uint32_t round = 0; round < 20000; round++) {
+        // Pages fail one after another; each is retired the next time it is erased and the write goes elsewhere.
+        if(round % 3000 == 1000 && n_worn < 3) {
+            worn[n_worn] = wear_out_free_page(&store);
+            CHECK(worn[n_worn] != FLASH_STORE_NO_PAGE);
+            n_worn++;
+        }
+        uint16_t key = flash_sim_random() % 30;
+        uint16_t value = flash_sim_random();
+        CHECK(flash_store_write(&store, key, value) == FLASH_STATUS_OK);
+        model[key] = value;
+        if(flash_sim_random() % 4 == 0) {
+            uint8_t status = flash_store_gc_step(&store);
+            CHECK(status == FLASH_STATUS_OK || status == FLASH_STATUS_EMPTY || status == FLASH_STATUS_VERIFY_FAILED);
+        }
+        if(round % 997 == 0) {
+            flash_sim_reboot();
+            struct flash_store mounted = bad_store_mounted();
+            CHECK(mounted.head_page == store.head_page && mounted.head_offset == store.head_offset && mounted.next_seq == store.next_seq);
+            store = mounted;
+            model_check(&store);
+        }
+    }
+    model_check(&store);
+    CHECK(flash_store_bad_pages(&store) == 3);
+    for(uint8_t n = 0; n < 3; n++) {
+        CHECK(flash_store_page_is_bad(&store, worn[n]) && !flash_store_page_is_live(&store, worn[n]));
+    }
+}
+static void test_full_after_bad_pages_keeps_data(void) {
+    flash_sim_init();
+    model_clear();
+    struct flash_store store = bad_store_mounted();
+    // Five full pages of distinct keys, then the spare page fails.
+    for(uint16_t key = 0; key < 5 * FLASH_STORE_RECORDS_PER_PAGE; key++) {
+        CHECK(flash_store_write(&store, key, key) == FLASH_STATUS_OK);
+        model[key] = key;
+    }
+    // Overwrite some keys of several pages, so a rewrite in place would have something to win.
+    for(uint16_t key = 0; key < 2 * FLASH_STORE_RECORDS_PER_PAGE; key += 3) {
+        CHECK(flash_store_write(&store, key, key + 1000) == FLASH_STATUS_OK);
+        model[key] = key + 1000;
+    }
+    flash_session_begin();
+    uint8_t page;
+    while(flash_store_count_free(&store, &page)) {
+        CHECK(flash_store_retire_page(&store, page) == FLASH_STATUS_OK);
+    }
+    flash_session_end();
+    // Once the head page is full, no page is free and none can be freed without risking its records: the writes fail and erase nothing.
+    uint16_t key = 0;
+    uint8_t status;
+    while((status = flash_store_write(&store, key, 2000 + key)) == FLASH_STATUS_OK) {
+        model[key] = 2000 + key;
+        key++;
+    }
+    CHECK(status == FLASH_STATUS_FULL);
+    uint32_t erases = flash_sim_stats.erases;
+    uint32_t programs = flash_sim_stats.programs;
+    CHECK(flash_store_write(&store, 1, 1) == FLASH_STATUS_FULL);
+    CHECK(flash_sim_stats.erases == erases && flash_sim_stats.programs == programs);
+    model_check(&store);
+    flash_sim_reboot();
+    store = bad_store_mounted();
+    model_check(&store);
+}
+static void test_power_cut_during_reclaim(void) {
+    uint8_t was_cut = 1;
+    for(uint32_t cut = 1; was_cut; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        model_clear();
+        struct flash_store store = bad_store_mounted();
+        // A first page holding one live record, two pages of live records, then records that supersede the first page and one record
+        // of the second.
+        for(uint16_t n = 0; n < FLASH_STORE_RECORDS_PER_PAGE; n++) {
+            CHECK(flash_store_write(&store, 0, n) == FLASH_STATUS_OK);
+        }
+        for(uint16_t key = 1; key <= 2 * FLASH_STORE_RECORDS_PER_PAGE; key++) {
+            CHECK(flash_store_write(&store, key, key) == FLASH_STATUS_OK);
+            model[key] = key;
+        }
+        CHECK(flash_store_write(&store, 0, 1000) == FLASH_STATUS_OK);
+        CHECK(flash_store_write(&store, 1, 1001) == FLASH_STATUS_OK);
+        model[0] = 1000;
+        model[1] = 1001;
+        while(store.head_offset < FLASH_PAGE_SIZE) {
+            CHECK(flash_store_write(&store, 100, store.head_offset) == FLASH_STATUS_OK);
+            model[100] = store.head_offset - FLASH_STORE_RECORD_SIZE;
+        }
+        // With the spare pages retired, the next write drops the dead page and compacts the second page into it.
+        flash_session_begin();
+        uint8_t page;
+        while(flash_store_count_free(&store, &page)) {
+            CHECK(flash_store_retire_page(&store, page) == FLASH_STATUS_OK);
+        }
+        flash_session_end();
+        FLASH_SIM_POWER_CUT(cut, CHECK(flash_store_write(&store, 101, 5) == FLASH_STATUS_OK));
+        was_cut = flash_sim_cut_happened;
+        // Every older record survives the cut, the new one is there unless the cut got to it first.
+        store = bad_store_mounted();
+        uint16_t value;
+        if(was_cut && flash_store_read(&store, 101, &value) == FLASH_STATUS_EMPTY) {
+            CHECK(flash_store_write(&store, 101, 5) == FLASH_STATUS_OK);
+        }
+        model[101] = 5;
+        model_check(&store);
+    }
+}
+static void test_reset_and_generation_rollover(void) {
+    flash_sim_init();
+    struct flash_store store = store_mounted();
+    CHECK(store.generation == 0);
+    // Enough resets to roll both generation banks over several times.
+    for(uint16_t n = 1; n <= 5 * FLASH_SLOTS_PER_PAGE; n++) {
+        CHECK(flash_store_write(&store, 1, n) == FLASH_STATUS_OK);
+        uint32_t erases = flash_sim_stats.erases;
+        CHECK(flash_store_reset(&store) == FLASH_STATUS_OK);
+        // A reset never erases store pages, at most a generation bank.
+        CHECK(flash_sim_stats.erases - erases <= 1);
+        uint16_t value;
+        CHECK(flash_store_read(&store, 1, &value) == FLASH_STATUS_EMPTY);
+        flash_sim_reboot();
+        store = store_mounted();
+        CHECK(store.generation == n);
+        CHECK(flash_store_read(&store, 1, &value) == FLASH_STATUS_EMPTY);
+        flash_store_gc_step(&store);
+    }
+}
+static void test_power_cut_during_reset(void) {
+    // Cut every operation of resets that roll a generation bank over, and of ones that do not.
+    for(uint16_t resets = FLASH_SLOTS_PER_PAGE * 2 - 2; resets < FLASH_SLOTS_PER_PAGE * 2 + 2; resets++) {
+        for(uint32_t cut = 1; cut <= 3; cut++) {
+            flash_sim_init();
+            flash_sim_seed(resets * 4 + cut);
+            struct flash_store store = store_mounted();
+            for(uint16_t n = 0; n < resets; n++) {
+                CHECK(flash_store_write(&store, 1, n) == FLASH_STATUS_OK);
+                CHECK(flash_store_reset(&store) == FLASH_STATUS_OK);
+            }
+            CHECK(flash_store_write(&store, 2, 7) == FLASH_STATUS_OK);
+            uint16_t generation = store.generation;
+            FLASH_SIM_POWER_CUT(cut, flash_store_reset(&store));
+            store = store_mounted();
+            uint16_t value;
+            if(store.generation == generation) {
+                // The reset did not happen: the data of the current generation is still there.
+                CHECK(flash_sim_cut_happened);
+                CHECK(flash_store_read(&store, 2, &value) == FLASH_STATUS_OK && value == 7);
+            } else {
+                // The reset happened, and no older generation comes back.
+                CHECK(store.generation == generation + 1);
+                CHECK(flash_store_read(&store, 2, &value) == FLASH_STATUS_EMPTY);
+            }
+            CHECK(flash_store_read(&store, 1, &value) == FLASH_STATUS_EMPTY);
+        }
+    }
+}
+static void test_power_cut_during_write(void) {
+    // Cut each operation of a run of writes that goes through page changes and compactions.
+    for(uint32_t cut = 1; cut < 120; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        model_clear();
+        struct flash_store store = store_mounted();
+        for(uint16_t key = 0; key < 20; key++) {
+            CHECK(flash_store_write(&store, key, key) == FLASH_STATUS_OK);
+            model[key] = key;
+        }
+        // Fill the store up to its last free page, so the writes below compact.
+        for(uint16_t n = 0; n < 80; n++) {
+            CHECK(flash_store_write(&store, 30, n) == FLASH_STATUS_OK);
+        }
+        model[30] = 79;
+        uint16_t key = 0;
+        uint16_t value = 0;
+        FLASH_SIM_POWER_CUT(cut, {
+            for(uint16_t n = 0; n < 40; n++) {
+                key = n % 25;
+                value = 1000 + n;
+                CHECK(flash_store_write(&store, key, value) == FLASH_STATUS_OK);
+                model[key] = value;
+            }
+            key = MODEL_KEYS;
+        });
+        store = store_mounted();
+        // The write that was cut is either done or not, everything else is as written.
+        if(key < MODEL_KEYS) {
+            uint16_t read;
+            CHECK(flash_store_read(&store, key, &read) == FLASH_STATUS_OK || model[key] == MODEL_BLANK);
+            if(model[key] != MODEL_BLANK && read == value) {
+                model[key] = value;
+            }
+        }
+        model_check(&store);
+        // The store keeps working.
+        for(uint16_t n = 0; n < 100; n++) {
+            CHECK(flash_store_write(&store, 40, n) == FLASH_STATUS_OK);
+        }
+        model[40] = 99;
+        flash_sim_reboot();
+        store = store_mounted();
+        model_check(&store);
+    }
+}
+static void test_deferred_and_emergency_flush(void) {
+    flash_sim_init();
+    flash_sim_seed(7);
+    model_clear();
+    struct flash_store store = store_mounted();
+    for(uint32_t round = 0; round < 20000; round++) {
+        uint32_t choice = flash_sim_random() % 1000;
+        uint16_t key = flash_sim_random() % 30;
+        uint16_t value = flash_sim_random();
+        if(choice < 400) {
+            CHECK(flash_store_write(&store, key, value) == FLASH_STATUS_OK);
+            model[key] = value;
+        } else if(choice < 800) {
+            CHECK(flash_store_write_deferred(&store, key, value) == FLASH_STATUS_OK);
+            model[key] = value;
+        } else if(choice < 810) {
+            CHECK(flash_store_flush(&store) == FLASH_STATUS_OK);
+            CHECK(store.n_deferred == 0);
+        } else if(choice < 830) {
+            // Brown-out: the PVD aborts, the deferred values go out with one page program and no erase.
+            flash_request_abort();
+            struct flash_sim_stats before = flash_sim_stats;
+            CHECK(flash_store_emergency_flush(&store) == FLASH_STATUS_OK);
+            CHECK(flash_sim_stats.erases == before.erases);
+            CHECK(flash_sim_stats.programs == before.programs);
+            CHECK(flash_sim_stats.page_programs - before.page_programs <= 1);
+            CHECK(flash_abort_requested);
+            flash_clear_abort();
+            flash_sim_reboot();
+            store = store_mounted();
+            CHECK(flash_is_page_erased(EMERGENCY_ADDR));
+        } else if(choice < 832) {
+            CHECK(flash_store_reset(&store) == FLASH_STATUS_OK);
+            model_clear();
+        } else if(choice < 840) {
+            // A reboot without warning loses the deferred values.
+            for(uint8_t n = 0; n < store.n_deferred; n++) {
+                model[store.deferred_keys[n]] = MODEL_BLANK;
+            }
+            flash_sim_reboot();
+            store = store_mounted();
+            for(uint16_t other = 0; other < MODEL_KEYS; other++) {
+                uint16_t stored;
+                if(model[other] == MODEL_BLANK && flash_store_read(&store, other, &stored) == FLASH_STATUS_OK) {
+                    model[other] = stored;
+                }
+            }
+        }
+        if(round % 64 == 0) {
+            model_check(&store);
+        }
+    }
+}
+static void test_power_cut_during_emergency_flush(void) {
+    for(uint32_t cut = 1; cut <= 2; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_store store = store_mounted();
+        CHECK(flash_store_write(&store, 1, 10) == FLASH_STATUS_OK);
+        CHECK(flash_store_write_deferred(&store, 1, 11) == FLASH_STATUS_OK);
+        CHECK(flash_store_write_deferred(&store, 2, 20) == FLASH_STATUS_OK);
+        flash_request_abort();
+        FLASH_SIM_POWER_CUT(cut, flash_store_emergency_flush(&store));
+        store = store_mounted();
+        CHECK(flash_is_page_erased(EMERGENCY_ADDR));
+        uint16_t value;
+        if(flash_sim_cut_happened) {
+            // A torn page fails its CRC and is dropped, the store is as before the flush.
+            CHECK(flash_store_read(&store, 1, &value) == FLASH_STATUS_OK && value == 10);
+            CHECK(flash_store_read(&store, 2, &value) == FLASH_STATUS_EMPTY);
+        } else {
+            CHECK(flash_store_read(&store, 1, &value) == FLASH_STATUS_OK && value == 11);
+            CHECK(flash_store_read(&store, 2, &value) == FLASH_STATUS_OK && value == 20);
+        }
+    }
+}
+static void test_power_cut_during_merge(void) {
+    for(uint32_t cut = 1; cut < 8; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        struct flash_store store = store_mounted();
+        for(uint16_t key = 0; key < 4; key++) {
+            CHECK(flash_store_write_deferred(&store, key, 100 + key) == FLASH_STATUS_OK);
+        }
+        CHECK(flash_store_emergency_flush(&store) == FLASH_STATUS_OK);
+        flash_sim_reboot();
+        // The mount merging the page back is cut short, the next one merges again.
+        store = store_config();
+        FLASH_SIM_POWER_CUT(cut, flash_store_mount(&store));
+        store = store_mounted();
+        CHECK(flash_is_page_erased(EMERGENCY_ADDR));
+        for(uint16_t key = 0; key < 4; key++) {
+            uint16_t value;
+            CHECK(flash_store_read(&store, key, &value) == FLASH_STATUS_OK && value == 100 + key);
+        }
+    }
+}
+int main(void) {
+    test_random_against_model();
+    test_unchanged_write_costs_nothing();
+    test_compaction_keeps_live_records();
+    test_full_store_does_not_erase();
+    test_level_wear();
+    test_level_wear_seals_partial_page();
+    test_bad_pages_against_model();
+    test_full_after_bad_pages_keeps_data();
+    test_power_cut_during_reclaim();
+    test_reset_and_generation_rollover();
+    test_power_cut_during_reset();
+    test_power_cut_during_write();
+    test_deferred_and_emergency_flush();
+    test_power_cut_during_emergency_flush();
+    test_power_cut_during_merge();
+    printf("test_store: ok\n");
+    return 0;
+}
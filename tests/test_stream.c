@@ -0,0 +1,115 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_stream.h: a stream written in random chunks, running past the target, a failing page and a power cut.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_stream.h"
+#define STREAM_ADDR 0x08003C00
+#define STREAM_PAGES 15
+#define SOURCE_LENGTH 900
+static uint8_t source[SOURCE_LENGTH];
+static void make_source(void) {
+    for(uint16_t n = 0; n < SOURCE_LENGTH; n++) {
+        source[n] = (uint8_t)flash_sim_random();
+    }
+}
+// Write the source in random chunks, polling in between like a main loop. Returns the number of bytes taken.
+static uint16_t stream_source(struct flash_stream *stream) {
+    uint16_t offset = 0;
+    uint16_t stalls = 0;
+    while(offset < SOURCE_LENGTH && stalls < 100) {
+        uint16_t length = 1 + flash_sim_random() % 40;
+        if(length > SOURCE_LENGTH - offset) {
+            length = SOURCE_LENGTH - offset;
+        }
+        uint16_t taken = flash_stream_write(stream, source + offset, length);
+        stalls = taken ? 0 : stalls + 1;
+        offset += taken;
+        flash_stream_poll(stream);
+    }
+    return offset;
+}
+static void check_controller_idle(void) {
+    CHECK(!(FLASH->CTLR & (CR_PAGE_PG | CR_PAGE_ER)));
+    CHECK(FLASH->CTLR & FLASH_CTLR_LOCK);
+}
+static void test_stream_in_chunks(void) {
+    flash_sim_init();
+    flash_sim_seed(9);
+    make_source();
+    // A page already in use has to be erased on the way.
+    flash_unlock();
+    flash_program_16(STREAM_ADDR + 2 * FLASH_PAGE_SIZE, 0x1234);
+    flash_lock();
+    struct flash_stream stream = { .start_addr = STREAM_ADDR, .n_pages = STREAM_PAGES };
+    flash_stream_open(&stream);
+    CHECK(stream_source(&stream) == SOURCE_LENGTH);
+    CHECK(flash_stream_close(&stream) == FLASH_STATUS_OK);
+    CHECK(!memcmp((const void*)(uintptr_t)STREAM_ADDR, source, SOURCE_LENGTH));
+    // The last page is padded with 0xFF, the pages after it are left alone.
+    for(uint16_t n = SOURCE_LENGTH; n < STREAM_PAGES * FLASH_PAGE_SIZE; n++) {
+        CHECK(flash_read_8_bits(STREAM_ADDR + n) == 0xFF);
+    }
+    CHECK(flash_sim_stats.erases == 1);
+    CHECK(flash_sim_stats.page_programs == (SOURCE_LENGTH + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE);
+    check_controller_idle();
+}
+static void test_stream_past_the_end(void) {
+    flash_sim_init();
+    make_source();
+    struct flash_stream stream = { .start_addr = STREAM_ADDR, .n_pages = 2 };
+    flash_stream_open(&stream);
+    uint16_t taken = 0;
+    for(uint8_t n = 0; n < 10; n++) {
+        taken += flash_stream_write(&stream, source + n * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+    }
+    // Two pages go in, the third one fails and nothing more is taken.
+    CHECK(taken == 3 * FLASH_PAGE_SIZE);
+    CHECK(flash_stream_poll(&stream) == FLASH_STATUS_FULL);
+    CHECK(flash_stream_close(&stream) == FLASH_STATUS_FULL);
+    CHECK(!memcmp((const void*)(uintptr_t)STREAM_ADDR, source, 2 * FLASH_PAGE_SIZE));
+    CHECK(flash_read_16_bits(STREAM_ADDR + 2 * FLASH_PAGE_SIZE) == 0xFFFF);
+    check_controller_idle();
+}
+static void test_failing_page(void) {
+    flash_sim_init();
+    flash_sim_seed(3);
+    make_source();
+    flash_sim_wear_out(STREAM_ADDR + 4 * FLASH_PAGE_SIZE + 10);
+    struct flash_stream stream = { .start_addr = STREAM_ADDR, .n_pages = STREAM_PAGES };
+    flash_stream_open(&stream);
+    // The status is sticky: the stream stops taking bytes soon after the bad page.
+    CHECK(stream_source(&stream) < 7 * FLASH_PAGE_SIZE);
+    CHECK(flash_stream_close(&stream) == FLASH_STATUS_VERIFY_FAILED);
+    CHECK(!memcmp((const void*)(uintptr_t)STREAM_ADDR, source, 4 * FLASH_PAGE_SIZE));
+    check_controller_idle();
+}
+static void test_power_cut(void) {
+    for(uint32_t cut = 1; cut < 16; cut++) {
+        flash_sim_init();
+        flash_sim_seed(cut);
+        make_source();
+        struct flash_stream stream = { .start_addr = STREAM_ADDR, .n_pages = STREAM_PAGES };
+        FLASH_SIM_POWER_CUT(cut, flash_stream_open(&stream); stream_source(&stream); flash_stream_close(&stream));
+        CHECK(flash_sim_cut_happened);
+        // Every page programmed before the cut holds its data, the cut page is the only torn one.
+        uint8_t page = 0;
+        while(page < SOURCE_LENGTH / FLASH_PAGE_SIZE && !memcmp((const void*)(uintptr_t)(STREAM_ADDR + page * FLASH_PAGE_SIZE), source + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE)) {
+            page++;
+        }
+        CHECK(page == cut - 1);
+        // The stream can simply be sent again.
+        flash_stream_open(&stream);
+        CHECK(stream_source(&stream) == SOURCE_LENGTH);
+        CHECK(flash_stream_close(&stream) == FLASH_STATUS_OK);
+        CHECK(!memcmp((const void*)(uintptr_t)STREAM_ADDR, source, SOURCE_LENGTH));
+    }
+}
+int main(void) {
+    test_stream_in_chunks();
+    test_stream_past_the_end();
+    test_failing_page();
+    test_power_cut();
+    printf("test_stream: ok\n");
+    return 0;
+}
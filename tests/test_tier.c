@@ -0,0 +1,193 @@
+/**
+ * @file
+ * @brief Tests of ch32v003_flash_tier.h against the simulated SPI EEPROM: the driver and its timeout, promotion, decay, random writes
+ * against a model with remounts, the modelled write latency and a power cut while a key cools down.
+ *
+ * SysTick follows the clock of the simulated EEPROM, so the status polls of the driver see the write cycle take its modelled time.
+ */
+#include "flash_sim.h"
+#include "ch32v003_flash_tier.h"
+#include "ch32v003_flash_spi_sim.h"
+#define STORE_ADDR 0x08003800
+#define STORE_PAGES 8
+#define GENERATION_ADDR 0x08003E00
+#define EEPROM_SIZE 32768
+#define BYTE_NS 8000          // 1 MHz SPI
+#define WRITE_CYCLE_NS 5000000 // 25LC256
+#define MODEL_BLANK -1
+static uint8_t eeprom_memory[EEPROM_SIZE];
+static struct flash_spi_sim sim;
+static struct flash_spi_eeprom eeprom = { { flash_spi_sim_select, flash_spi_sim_transfer, &sim }, 0, FLASH_TIER_KEYS, 2 };
+static struct flash_store store;
+static int32_t model[FLASH_TIER_KEYS];
+static uint64_t sim_now_ns(void) {
+    return sim.now_ns;
+}
+// Erase the internal flash and the EEPROM, and mount both tiers.
+static struct flash_tier tier_init(uint32_t write_cycle_ns) {
+    flash_sim_init();
+    memset(eeprom_memory, 0xFF, sizeof(eeprom_memory));
+    struct flash_spi_sim fresh = { .memory = eeprom_memory, .size = EEPROM_SIZE, .page_size = 64, .addr_bytes = 2, .byte_ns = BYTE_NS, .write_cycle_ns = write_cycle_ns };
+    sim = fresh;
+    flash_sim_clock_ns = sim_now_ns;
+    for(uint16_t key = 0; key < FLASH_TIER_KEYS; key++) {
+        model[key] = MODEL_BLANK;
+    }
+    struct flash_tier tier = { .cold = { &flash_tier_store_ops, &store }, .hot = { &flash_tier_eeprom_ops, &eeprom } };
+    struct flash_store config = { .start_addr = STORE_ADDR, .n_pages = STORE_PAGES, .generation_slots = { { GENERATION_ADDR, 1 }, { GENERATION_ADDR + FLASH_PAGE_SIZE, 1 } } };
+    store = config;
+    CHECK(flash_store_mount(&store) == FLASH_STATUS_OK);
+    flash_tier_mount(&tier);
+    CHECK(tier.hot_keys == 0);
+    return tier;
+}
+static void tier_write(struct flash_tier *tier, uint16_t key, uint16_t value) {
+    CHECK(flash_tier_write(tier, key, value) == FLASH_STATUS_OK);
+    model[key] = value;
+}
+static void model_check(const struct flash_tier *tier) {
+    for(uint16_t key = 0; key < FLASH_TIER_KEYS; key++) {
+        uint16_t value;
+        uint8_t status = flash_tier_read(tier, key, &value);
+        CHECK((status == FLASH_STATUS_EMPTY) == (model[key] == MODEL_BLANK));
+        CHECK(status == FLASH_STATUS_EMPTY || value == model[key]);
+    }
+}
+static void test_driver(void) {
+    tier_init(WRITE_CYCLE_NS);
+    uint8_t data[4] = { 1, 2, 3, 4 };
+    uint8_t got[4];
+    uint64_t start = sim.now_ns;
+    CHECK(flash_spi_eeprom_write(&eeprom, 1000, data, sizeof(data)) == FLASH_STATUS_OK);
+    // WREN, WRITE with its address and data, then status polls until the write cycle is over.
+    uint64_t took = sim.now_ns - start;
+    CHECK(sim.writes == 1);
+    CHECK(took >= WRITE_CYCLE_NS && took < WRITE_CYCLE_NS + 20 * BYTE_NS);
+    flash_spi_eeprom_read(&eeprom, 1000, got, sizeof(got));
+    CHECK(!memcmp(got, data, sizeof(data)));
+    // A device that stays busy for longer than FLASH_TIMEOUT_TICKS times out.
+    sim.write_cycle_ns = 50000000;
+    CHECK(flash_spi_eeprom_write(&eeprom, 1000, data, sizeof(data)) == FLASH_STATUS_TIMEOUT);
+}
+static void test_promotion_and_decay(void) {
+    struct flash_tier tier = tier_init(WRITE_CYCLE_NS);
+    // The first writes of a key go to the internal flash, the one that reaches FLASH_TIER_HOT_WRITES goes to the EEPROM.
+    for(uint8_t n = 1; n < FLASH_TIER_HOT_WRITES; n++) {
+        uint32_t programs = flash_sim_stats.programs;
+        tier_write(&tier, 0, n);
+        CHECK(!flash_tier_is_hot(&tier, 0));
+        CHECK(flash_sim_stats.programs > programs);
+    }
+    CHECK(sim.writes == 0);
+    uint32_t programs = flash_sim_stats.programs;
+    tier_write(&tier, 0, 100);
+    CHECK(flash_tier_is_hot(&tier, 0));
+    CHECK(sim.writes == 1);
+    CHECK(flash_sim_stats.programs == programs);
+    // A remount finds the hot key on the EEPROM.
+    struct flash_tier mounted = tier;
+    flash_tier_mount(&mounted);
+    CHECK(mounted.hot_keys == tier.hot_keys);
+    model_check(&mounted);
+    // Writes to other keys close windows; the counter of key 0 halves each time until it is cold and back in the internal flash.
+    uint32_t windows = 0;
+    for(uint16_t n = 0; flash_tier_is_hot(&tier, 0); n++) {
+        tier_write(&tier, 1 + n % 16, n);
+        windows += tier.n_writes == 0;
+        CHECK(windows <= 3);
+    }
+    CHECK(windows >= 2);
+    model_check(&tier);
+    // Its EEPROM record is removed, so a remount leaves it cold.
+    uint16_t value;
+    CHECK(flash_tier_eeprom_read(&eeprom, 0, &value) == FLASH_STATUS_EMPTY);
+    flash_tier_mount(&mounted);
+    CHECK(!flash_tier_is_hot(&mounted, 0));
+    model_check(&mounted);
+}
+static void test_random_against_model(void) {
+    struct flash_tier tier = tier_init(WRITE_CYCLE_NS);
+    flash_sim_seed(7);
+    for(uint32_t round = 0; round < 20000; round++) {
+        // Keys 0 to 2 take most of the writes, then everything calms down.
+        uint16_t key = round < 10000 && flash_sim_random() % 10 < 8 ? flash_sim_random() % 3 : 3 + flash_sim_random() % (FLASH_TIER_KEYS - 3);
+        tier_write(&tier, key, flash_sim_random());
+        if(round == 9000) {
+            CHECK(flash_tier_is_hot(&tier, 0) && flash_tier_is_hot(&tier, 1) && flash_tier_is_hot(&tier, 2));
+            CHECK(__builtin_popcount(tier.hot_keys) == 3);
+            struct flash_tier mounted = tier;
+            flash_tier_mount(&mounted);
+            CHECK(mounted.hot_keys == tier.hot_keys);
+            model_check(&mounted);
+        }
+        if(round % 1000 == 0) {
+            model_check(&tier);
+        }
+    }
+    CHECK(!flash_tier_is_hot(&tier, 0));
+    model_check(&tier);
+    uint16_t value;
+    CHECK(flash_tier_read(&tier, FLASH_TIER_KEYS, &value) == FLASH_STATUS_INVALID);
+    CHECK(flash_tier_write(&tier, FLASH_TIER_KEYS, 1) == FLASH_STATUS_INVALID);
+}
+// Write a hot key over and over and return the simulated time spent on the device.
+static uint64_t hot_writes_ns(uint32_t write_cycle_ns) {
+    struct flash_tier tier = tier_init(write_cycle_ns);
+    for(uint8_t n = 0; n < FLASH_TIER_HOT_WRITES; n++) {
+        tier_write(&tier, 5, n);
+    }
+    CHECK(flash_tier_is_hot(&tier, 5));
+    uint64_t start = sim.now_ns;
+    uint32_t programs = flash_sim_stats.programs;
+    for(uint8_t n = 0; n < 20; n++) {
+        tier_write(&tier, 5, 1000 + n);
+    }
+    CHECK(flash_tier_is_hot(&tier, 5));
+    CHECK(flash_sim_stats.programs == programs);
+    return sim.now_ns - start;
+}
+static void test_modelled_latency(void) {
+    // Each hot write waits for the write cycle of an EEPROM, an FRAM only costs the bytes on the bus.
+    uint64_t eeprom_ns = hot_writes_ns(WRITE_CYCLE_NS);
+    uint64_t fram_ns = hot_writes_ns(0);
+    CHECK(eeprom_ns >= 20ull * WRITE_CYCLE_NS);
+    CHECK(fram_ns < 20ull * 30 * BYTE_NS);
+    CHECK(eeprom_ns - fram_ns >= 20ull * WRITE_CYCLE_NS - 20ull * 30 * BYTE_NS);
+}
+static void test_power_cut_during_decay(void) {
+    uint8_t was_cut = 1;
+    for(uint32_t cut = 1; was_cut; cut++) {
+        struct flash_tier tier = tier_init(0);
+        for(uint8_t n = 0; n < FLASH_TIER_HOT_WRITES; n++) {
+            tier_write(&tier, 0, n);
+        }
+        CHECK(flash_tier_is_hot(&tier, 0));
+        // Calm the key down until the next window is the one that moves it back.
+        while(tier.churn[0] > 1 || tier.n_writes != FLASH_TIER_WINDOW - 1) {
+            tier_write(&tier, 1 + tier.n_writes % 8, tier.n_writes);
+        }
+        // The power fails while the decay copies key 0 into the internal flash.
+        // Cut at every program and erase of that write until it gets through.
+        FLASH_SIM_POWER_CUT(cut, flash_tier_write(&tier, 9, 0x5A5A));
+        was_cut = flash_sim_cut_happened;
+        CHECK(was_cut || cut > 2);
+        CHECK(was_cut || !flash_tier_is_hot(&tier, 0));
+        CHECK(flash_store_mount(&store) == FLASH_STATUS_OK);
+        flash_tier_mount(&tier);
+        // Key 0 keeps its value wherever it ended up.
+        uint16_t value;
+        CHECK(flash_tier_read(&tier, 0, &value) == FLASH_STATUS_OK && value == model[0]);
+        for(uint16_t key = 1; key < 9; key++) {
+            CHECK(flash_tier_read(&tier, key, &value) == FLASH_STATUS_OK && value == model[key]);
+        }
+    }
+}
+int main(void) {
+    test_driver();
+    test_promotion_and_decay();
+    test_random_against_model();
+    test_modelled_latency();
+    test_power_cut_during_decay();
+    printf("test_tier: ok\n");
+    return 0;
+}
@@ -0,0 +1,484 @@
+#!/usr/bin/env python3
+"""
+Decode and check a flash dump of the reserved nonvolatile region.
+
+Reads a raw dump taken with the programmer (a full 16K .bin based at
+FLASH_BASE, a .bin of just the reserved region, or an Intel .hex) and reports:
+
+  - every page of the reserved region: erased, fully or partially programmed
+  - the settings from a settings description (the same JSON flash_image.py uses),
+    flagging values that were never written or are torn across half-words
+  - with --defaults, settings still erased are served from the defaults image
+    (ch32v003_flash_defaults.h) and reported with their default value
+  - the partitions from a partition description (--partitions, a JSON list of
+    the structs the firmware mounts): store, slots, bitset, FIFO, hibernate,
+    sorted and hashed partitions are decoded the way their mount reads them,
+    with per-page sequence numbers, erase counts and generations, and torn
+    records, bad checksums and inconsistent headers are flagged
+  - programmed data that no setting or partition accounts for
+  - optionally the option bytes (--ob, a raw dump of the 16 bytes at 0x1FFFF800),
+    checking every byte against its stored complement
+
+    tools/flash_dump.py unit42.bin --settings settings.json --ob unit42_ob.bin
+    tools/flash_dump.py unit42.bin --flash-length 0x2000 --partitions partitions.json
+
+The exit status is 1 if any problem was flagged, so the tool can gate a
+triage script.
+"""
+import argparse
+import math
+import os
+import struct
+import sys
+
+import flash_layout as fl
+
+OPTION_BYTES = ("RDPR", "USER", "DATA0", "DATA1", "WRPR0", "WRPR1", "WRPR2", "WRPR3")
+BLANK = 0xFFFF
+STORE_FORMAT = 1  # FLASH_STORE_FORMAT
+STORE_HEADER_SIZE = 8
+HASHED_OVERFLOW = 0xFFFE
+HIBERNATE_HEADER_SIZE = 8
+FIFO_REC_WRITTEN = 0x8000
+FIFO_REC_LIVE = 0x4000
+
+
+def load_region(path, start, size):
+    if path.lower().endswith(".hex"):
+        return fl.to_contiguous(fl.read_intel_hex(path), start, start + size)
+    with open(path, "rb") as f:
+        raw = f.read()
+    if len(raw) == fl.FLASH_SIZE:
+        return raw[start - fl.FLASH_BASE:start - fl.FLASH_BASE + size]
+    if len(raw) == size:
+        return raw
+    raise ValueError("%s is %d bytes, expected a full %d byte dump or the %d byte region"
+                     % (path, len(raw), fl.FLASH_SIZE, size))
+
+
+class Report:
+    def __init__(self):
+        self.problems = 0
+
+    def line(self, text):
+        print(text)
+
+    def problem(self, text):
+        self.problems += 1
+        print("  !! " + text)
+
+
+class Flash:
+    """Half-word reads of the region at absolute addresses, like flash_read_16_bits()."""
+
+    def __init__(self, region, start):
+        self.region = region
+        self.start = start
+
+    def hw(self, addr):
+        return struct.unpack_from("<H", self.region, addr - self.start)[0]
+
+    def bytes(self, addr, length):
+        return bytes(self.region[addr - self.start:addr - self.start + length])
+
+    def is_erased(self, addr, length=fl.PAGE_SIZE):
+        return all(b == fl.ERASED_BYTE for b in self.bytes(addr, length))
+
+
+def newer(seq, than):
+    """Sequence numbers wrap, the firmware compares their difference as an int16_t."""
+    return 0 < (seq - than) & 0xFFFF < 0x8000
+
+
+def report_pages(report, region, start, partitions):
+    owners = {}
+    for p in partitions:
+        for label, addr, length in fl.partition_areas(p):
+            for page in range(addr, addr + length, fl.PAGE_SIZE):
+                owners[page] = label
+    report.line("Pages:")
+    for n in range(0, len(region), fl.PAGE_SIZE):
+        page = region[n:n + fl.PAGE_SIZE]
+        halfwords = struct.unpack("<%dH" % (len(page) // 2), page)
+        programmed = sum(1 for hw in halfwords if hw != 0xFFFF)
+        if programmed == 0:
+            state = "erased"
+        elif programmed == len(halfwords):
+            state = "full"
+        else:
+            state = "partial"
+        report.line(("  0x%08X  %-7s  %2d/%d half-words programmed  %s"
+                     % (start + n, state, programmed, len(halfwords), owners.get(start + n, ""))).rstrip())
+
+
+def report_settings(report, region, settings, defaults, covered):
+    report.line("Settings:")
+    for s in settings:
+        size = fl.setting_size(s)
+        covered.update(range(s["offset"], s["offset"] + size))
+        value, raw = fl.decode_setting(s, region)
+        halves = [raw[n:n + 2] for n in range(0, size, 2)]
+        erased = [h == b"\xff\xff" for h in halves]
+        if all(erased) and defaults and "value" in s:
+            # flash_defaults_read_*() fall back to the image, the region holds overrides only.
+            report.line("  %-24s @%-4d %-5s = %s (default)" % (s["name"], s["offset"], s["type"], s["value"]))
+            continue
+        report.line("  %-24s @%-4d %-5s = %s" % (s["name"], s["offset"], s["type"], value))
+        if all(erased):
+            report.problem("%s was never written (erased)" % s["name"])
+        elif any(erased):
+            report.problem("%s is torn: only some of its half-words are programmed" % s["name"])
+        elif s["type"] == "float" and math.isnan(value):
+            report.problem("%s is NaN" % s["name"])
+
+
+def report_stray(report, region, covered):
+    stray = [n for n, b in enumerate(region) if b != fl.ERASED_BYTE and n not in covered]
+    if stray:
+        report.problem("programmed bytes not covered by any setting or partition at offsets %s"
+                       % ", ".join(str(n) for n in stray))
+
+
+def slots_value(flash, addr, pages):
+    """Return (value or None, used slots, slots) the way flash_slots_read() finds them, with the same binary search."""
+    n_slots = pages * fl.PAGE_SIZE // 2
+    low, high = 0, n_slots
+    while low < high:
+        mid = (low + high) // 2
+        if flash.hw(addr + mid * 2) == BLANK:
+            high = mid
+        else:
+            low = mid + 1
+    return (flash.hw(addr + (low - 1) * 2) if low else None), low, n_slots
+
+
+def report_slots(report, flash, p):
+    value, used, n_slots = slots_value(flash, p["addr"], p["pages"])
+    if value is None:
+        report.line("  empty")
+    else:
+        report.line("  value 0x%04X (%d), slot %d of %d" % (value, value, used, n_slots))
+    # A torn erase of the exhausted slots leaves programmed ones behind the blank one; the next write erases again.
+    if any(flash.hw(p["addr"] + n * 2) != BLANK for n in range(used, n_slots)):
+        report.problem("%s has programmed slots after the first blank one (torn erase)" % p["name"])
+
+
+def report_bitset(report, flash, p):
+    flags = []
+    for n in range(p["pages"] * fl.PAGE_SIZE // 2):
+        halfword = flash.hw(p["addr"] + n * 2)
+        flags.extend(n * 16 + bit for bit in range(16) if not halfword & (1 << bit))
+    report.line("  %d of %d flags set%s" % (len(flags), p["pages"] * 512, (": " + ", ".join(map(str, flags))) if flags else ""))
+
+
+def report_store(report, flash, p):
+    name = p["name"]
+    # The generation is the newer of the two banks, 0 while both are blank.
+    banks = [slots_value(flash, bank["addr"], bank["pages"])[0] for bank in p["generation"]]
+    for n, value in enumerate(banks):
+        report.line("  generation bank %d: %s" % (n, "blank" if value is None else value))
+    if banks[1] is not None and (banks[0] is None or newer(banks[1], banks[0])):
+        generation = banks[1]
+    else:
+        generation = banks[0] if banks[0] is not None else 0
+    report.line("  current generation %d" % generation)
+    bad = set()
+    if "bad_pages" in p:
+        for page in range(p["pages"]):
+            if not flash.hw(p["bad_pages"]["addr"] + page // 16 * 2) & (1 << page % 16):
+                bad.add(page)
+    live = []
+    erase_counts = []
+    for page in range(p["pages"]):
+        addr = p["addr"] + page * fl.PAGE_SIZE
+        seq, erases, fmt, gen = (flash.hw(addr + n) for n in range(0, STORE_HEADER_SIZE, 2))
+        erase_counts.append(0 if erases == BLANK else erases)
+        notes = " bad" if page in bad else ""
+        if flash.is_erased(addr):
+            report.line("  page %2d  erased%s" % (page, notes))
+            continue
+        # An erased page gets its erase count back right away, the rest of the header waits for the page to be opened.
+        if fmt == BLANK and gen == BLANK:
+            report.line("  page %2d  free     erases %5d%s" % (page, erase_counts[-1], notes))
+            continue
+        if fmt != STORE_FORMAT or gen != generation:
+            state = "detached" if fmt == 0 else "stale"
+            report.line("  page %2d  %-8s erases %5d  format %d generation %d%s"
+                        % (page, state, erase_counts[-1], fmt, gen, notes))
+            continue
+        records = 0
+        for offset in range(STORE_HEADER_SIZE, fl.PAGE_SIZE, 4):
+            value, key = flash.hw(addr + offset), flash.hw(addr + offset + 2)
+            if key != BLANK:
+                records += 1
+            elif value != BLANK:
+                # The value of the last slot without a key seals the page, anywhere else it is a record cut short.
+                if offset == fl.PAGE_SIZE - 4:
+                    notes += " sealed"
+                else:
+                    report.problem("%s page %d has a torn record at offset %d" % (name, page, offset))
+        report.line("  page %2d  live     erases %5d  seq %5d  %2d records%s" % (page, erase_counts[-1], seq, records, notes))
+        live.append((seq, page))
+    seqs = [seq for seq, page in live]
+    for seq in set(seqs):
+        if seqs.count(seq) > 1:
+            report.problem("%s has several live pages with sequence number %d" % (name, seq))
+    report.line("  erase counts: min %d, max %d, mean %.1f"
+                % (min(erase_counts), max(erase_counts), sum(erase_counts) / len(erase_counts)))
+    if bad:
+        report.line("  bad pages: %s" % ", ".join(map(str, sorted(bad))))
+    # Oldest page first, so the newest record of a key is the last one seen.
+    values = {}
+    if live:
+        head_seq = max(seqs, key=lambda seq: sum(newer(seq, other) for other in seqs))
+        for seq, page in sorted(live, key=lambda entry: (entry[0] - head_seq - 1) & 0xFFFF):
+            addr = p["addr"] + page * fl.PAGE_SIZE
+            for offset in range(STORE_HEADER_SIZE, fl.PAGE_SIZE, 4):
+                if flash.hw(addr + offset + 2) != BLANK:
+                    values[flash.hw(addr + offset + 2)] = flash.hw(addr + offset)
+    report.line("  %d keys" % len(values))
+    for key in sorted(values):
+        report.line("    0x%04X = 0x%04X (%d)" % (key, values[key], values[key]))
+    if p.get("emergency"):
+        addr = p["emergency"]
+        if flash.is_erased(addr):
+            report.line("  emergency page erased")
+        elif flash.hw(addr) != fl.crc16(flash.bytes(addr + 2, fl.PAGE_SIZE - 2)):
+            report.problem("%s emergency page fails its CRC (torn flush), its values are lost" % name)
+        elif flash.hw(addr + 2) != generation:
+            report.line("  emergency page of generation %d, dropped by the next mount" % flash.hw(addr + 2))
+        else:
+            report.line("  emergency page holds values the next mount merges:")
+            for offset in range(STORE_HEADER_SIZE, fl.PAGE_SIZE, 4):
+                if flash.hw(addr + offset + 2) != BLANK:
+                    report.line("    0x%04X = 0x%04X" % (flash.hw(addr + offset + 2), flash.hw(addr + offset)))
+
+
+def report_fifo(report, flash, p):
+    name = p["name"]
+    pending = 0
+    for page in range(p["pages"]):
+        addr = p["addr"] + page * fl.PAGE_SIZE
+        seq, state = flash.hw(addr), flash.hw(addr + 2)
+        if seq == BLANK:
+            report.line("  page %2d  %s" % (page, "erased" if flash.is_erased(addr) else "torn (no sequence number)"))
+            continue
+        report.line("  page %2d  seq %5d  %s" % (page, seq, "consumed" if state == 0 else "in use"))
+        offset = 4
+        while offset + 2 <= fl.PAGE_SIZE:
+            header = flash.hw(addr + offset)
+            if header == BLANK:
+                break
+            length = header & 0xFF
+            size = 2 + ((length + 1) & ~1)
+            if header & FIFO_REC_WRITTEN or offset + size > fl.PAGE_SIZE:
+                report.problem("%s page %d has a bad record header 0x%04X at offset %d" % (name, page, header, offset))
+                break
+            live = header & FIFO_REC_LIVE
+            pending += 1 if live else 0
+            if live and state == 0:
+                report.problem("%s page %d is marked consumed but its record at offset %d is not" % (name, page, offset))
+            report.line("    +%-2d %2d bytes %-8s %s"
+                        % (offset, length, "pending" if live else "consumed", flash.bytes(addr + offset + 2, length).hex()))
+            offset += size
+        # The data of a push goes in before its header, data behind the last header is a push cut short.
+        if offset < fl.PAGE_SIZE and not flash.is_erased(addr + offset, fl.PAGE_SIZE - offset):
+            report.problem("%s page %d has a torn record at offset %d" % (name, page, offset))
+    report.line("  %d records pending" % pending)
+
+
+def report_hibernate(report, flash, p):
+    slot_size = p["slot_pages"] * fl.PAGE_SIZE
+    newest = None
+    for slot in range(p["pages"] // p["slot_pages"]):
+        addr = p["addr"] + slot * slot_size
+        tag, seq, length, crc = (flash.hw(addr + n) for n in range(0, HIBERNATE_HEADER_SIZE, 2))
+        if tag == BLANK:
+            report.line("  slot %d  %s" % (slot, "erased" if flash.is_erased(addr, slot_size) else "blank tag, torn"))
+            continue
+        valid = length <= slot_size - HIBERNATE_HEADER_SIZE and crc == fl.crc16(
+            flash.bytes(addr + HIBERNATE_HEADER_SIZE, length), fl.crc16(flash.bytes(addr, 6)))
+        report.line("  slot %d  tag 0x%04X  seq %5d  %3d bytes  CRC %s" % (slot, tag, seq, length, "ok" if valid else "bad"))
+        if not valid:
+            report.problem("%s slot %d fails its CRC (torn save), resume skips it" % (p["name"], slot))
+        elif newest is None or newer(seq, newest[1]):
+            newest = (slot, seq)
+    report.line("  newest valid image: %s" % ("none" if newest is None else "slot %d" % newest[0]))
+
+
+def read_records(flash, addr, length):
+    """(offset, value, key) of every record slot, value first, the layout the key/value stores share."""
+    return [(offset, flash.hw(addr + offset), flash.hw(addr + offset + 2)) for offset in range(0, length, 4)]
+
+
+def report_sorted(report, flash, p):
+    name = p["name"]
+    segment_size = p["segment_pages"] * fl.PAGE_SIZE
+    capacity = (p["segment_pages"] - 1) * fl.PAGE_SIZE // 4
+    committed = []
+    for segment in range(2):
+        addr = p["addr"] + segment * segment_size
+        seq, count = flash.hw(addr), flash.hw(addr + 2)
+        if seq == BLANK:
+            report.line("  segment %d  %s" % (segment, "erased" if flash.is_erased(addr, segment_size) else "not committed"))
+            continue
+        report.line("  segment %d  seq %5d  %3d records" % (segment, seq, count))
+        committed.append((segment, seq, count))
+    values = {}
+    active = None
+    for segment, seq, count in committed:
+        if active is None or newer(seq, active[1]):
+            active = (segment, seq, count)
+    if len(committed) == 2:
+        report.line("  both segments committed: a compaction lost power after its commit,"
+                    " the next mount erases the tail and segment %d" % (active[0] ^ 1))
+    if active:
+        segment, seq, count = active
+        addr = p["addr"] + segment * segment_size
+        if count > capacity:
+            report.problem("%s segment %d claims %d records, it holds %d" % (name, segment, count, capacity))
+            count = capacity
+        records = read_records(flash, addr + fl.PAGE_SIZE, count * 4)
+        keys = [key for offset, value, key in records]
+        if any(b <= a for a, b in zip(keys, keys[1:])):
+            report.problem("%s segment %d is not in ascending key order" % (name, segment))
+        for n in range(0, count, fl.PAGE_SIZE // 4):
+            if flash.hw(addr + 4 + n // (fl.PAGE_SIZE // 4) * 2) != keys[n]:
+                report.problem("%s segment %d header table does not match data page %d"
+                               % (name, segment, n // (fl.PAGE_SIZE // 4)))
+        values.update((key, value) for offset, value, key in records)
+    # Two committed segments mean the tail is merged already and may be torn, the mount erases it.
+    tail = p["addr"] + 2 * segment_size
+    records = read_records(flash, tail, p["tail_pages"] * fl.PAGE_SIZE)
+    used = [record for record in records if record[1] != BLANK or record[2] != BLANK]
+    report.line("  tail: %d of %d records used" % (len(used), len(records)))
+    if len(committed) < 2:
+        for offset, value, key in records:
+            if key != BLANK:
+                values[key] = value
+            elif value != BLANK:
+                report.problem("%s tail has a torn record at offset %d" % (name, offset))
+    report.line("  %d keys" % len(values))
+    for key in sorted(values):
+        report.line("    0x%04X = 0x%04X (%d)" % (key, values[key], values[key]))
+
+
+def report_hashed(report, flash, p):
+    name = p["name"]
+    n_buckets = p["buckets"]
+    # Of several pages with the same tag the newest one counts, the others wait for their erase.
+    current = {}
+    for page in range(p["pages"]):
+        addr = p["addr"] + page * fl.PAGE_SIZE
+        seq, tag = flash.hw(addr), flash.hw(addr + 2)
+        if tag == HASHED_OVERFLOW or tag < n_buckets:
+            if tag not in current or newer(seq, flash.hw(p["addr"] + current[tag] * fl.PAGE_SIZE)):
+                current[tag] = page
+    values = {}
+    for page in range(p["pages"]):
+        addr = p["addr"] + page * fl.PAGE_SIZE
+        seq, tag = flash.hw(addr), flash.hw(addr + 2)
+        if flash.is_erased(addr):
+            report.line("  page %2d  erased" % page)
+            continue
+        if current.get(tag) != page:
+            report.line("  page %2d  seq %5d  free, waiting for its erase" % (page, seq))
+            continue
+        used = 0
+        for offset, value, key in read_records(flash, addr + 4, fl.PAGE_SIZE - 4):
+            if key == BLANK:
+                if value != BLANK:
+                    report.problem("%s page %d has a torn record at offset %d" % (name, page, offset + 4))
+                continue
+            used += 1
+            bucket = ((key * 0x9E37) & 0xFFFF) * n_buckets >> 16
+            if tag != HASHED_OVERFLOW and bucket != tag:
+                report.problem("%s page %d of bucket %d holds key 0x%04X of bucket %d" % (name, page, tag, key, bucket))
+            # The overflow page is newer than the home pages.
+            if tag == HASHED_OVERFLOW or not values.get(key, (0, False))[1]:
+                values[key] = (value, tag == HASHED_OVERFLOW)
+        report.line("  page %2d  seq %5d  %-8s %2d records"
+                    % (page, seq, "overflow" if tag == HASHED_OVERFLOW else "bucket %d" % tag, used))
+    report.line("  %d keys" % len(values))
+    for key in sorted(values):
+        report.line("    0x%04X = 0x%04X (%d)" % (key, values[key][0], values[key][0]))
+
+
+PARTITION_REPORTS = {
+    "store": report_store,
+    "slots": report_slots,
+    "bitset": report_bitset,
+    "fifo": report_fifo,
+    "hibernate": report_hibernate,
+    "sorted": report_sorted,
+    "hashed": report_hashed,
+}
+
+
+def report_partitions(report, flash, partitions, covered):
+    for p in partitions:
+        report.line("%s %s at 0x%08X:" % (p["type"].capitalize(), p["name"], p["addr"]))
+        PARTITION_REPORTS[p["type"]](report, flash, p)
+        for label, addr, length in fl.partition_areas(p):
+            covered.update(range(addr - flash.start, addr - flash.start + length))
+
+
+def report_option_bytes(report, path):
+    with open(path, "rb") as f:
+        raw = f.read(16)
+    if len(raw) < 16:
+        raise ValueError("%s holds %d bytes, expected the 16 option bytes" % (path, len(raw)))
+    report.line("Option bytes:")
+    for name, (data, inverse) in zip(OPTION_BYTES, struct.iter_unpack("BB", raw)):
+        note = ""
+        if data == 0xFF and inverse == 0xFF:
+            note = "(erased)"
+        elif data ^ inverse != 0xFF:
+            report.problem("%s 0x%02X does not match its complement 0x%02X" % (name, data, inverse))
+            continue
+        report.line("  %-5s 0x%02X %s" % (name, data, note))
+    wrpr = ~(raw[8] | (raw[10] << 8)) & 0xFFFF
+    if wrpr:
+        sectors = [str(n) for n in range(16) if wrpr & (1 << n)]
+        report.line("  write protected 1K sectors: %s" % ", ".join(sectors))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("dump", help="flash dump (.bin or .hex)")
+    parser.add_argument("--settings", help="JSON settings description to decode")
+    parser.add_argument("--defaults", action="store_true",
+                        help="the firmware serves erased settings from the defaults image (ch32v003_flash_defaults.h)")
+    parser.add_argument("--partitions", help="JSON partition description to decode")
+    parser.add_argument("--ob", help="raw dump of the option bytes")
+    parser.add_argument("--ld", default=os.path.join(here, "..", "overrides.ld"),
+                        help="linker script providing FLASH_LENGTH_OVERRIDE (default: overrides.ld)")
+    parser.add_argument("--flash-length", type=lambda v: int(v, 0),
+                        help="FLASH_LENGTH_OVERRIDE value, overrides --ld")
+    args = parser.parse_args()
+
+    length = args.flash_length if args.flash_length is not None else fl.read_flash_length_override(args.ld)
+    start, size = fl.region_start(length), fl.region_size(length)
+    region = load_region(args.dump, start, size)
+    report = Report()
+    report.line("Reserved region 0x%08X-0x%08X (%d bytes)" % (start, start + size - 1, size))
+    partitions = fl.load_partitions(args.partitions) if args.partitions else []
+    fl.check_partition_placement(partitions, start, size)
+    report_pages(report, region, start, partitions)
+    covered = set()
+    if args.settings:
+        settings = fl.load_settings(args.settings)
+        fl.check_setting_placement(settings, size)
+        report_settings(report, region, settings, args.defaults, covered)
+    report_partitions(report, Flash(region, start), partitions, covered)
+    if args.settings or partitions:
+        report_stray(report, region, covered)
+    if args.ob:
+        report_option_bytes(report, args.ob)
+    report.line("%d problem(s) found" % report.problems)
+    sys.exit(1 if report.problems else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Build a factory-provisioned image of the reserved nonvolatile region.
+
+The settings description is a JSON list of {name, offset, type, value} entries,
+where offset is the byte number passed to flash_calculate_runtime_address() and
+type is one of u16, u8x2, float or u32. Bytes not covered by a setting are left
+erased (0xFF), exactly as after flash_erase_page().
+
+The region image is written on its own, or merged with the firmware image so a
+unit is provisioned with a single programmer write:
+
+    tools/flash_image.py settings.json -o region.hex
+    tools/flash_image.py settings.json --firmware flash_storage_main.bin -o factory.hex
+
+Output format follows the extension: .hex for Intel HEX, anything else is raw
+binary (a merged .bin starts at FLASH_BASE, a region-only .bin at the region).
+
+With --defaults-header the same region is written as a C array for
+ch32v003_flash_defaults.h instead, so the defaults live in .rodata and the
+region is only written for values that differ from them:
+
+    tools/flash_image.py settings.json --defaults-header settings_defaults.h
+"""
+import argparse
+import os
+import re
+import sys
+
+import flash_layout as fl
+
+
+def build_region(settings, size):
+    fl.check_setting_placement(settings, size)
+    region = bytearray([fl.ERASED_BYTE] * size)
+    for s in settings:
+        region[s["offset"]:s["offset"] + fl.setting_size(s)] = fl.encode_setting(s)
+    return bytes(region)
+
+
+def write_defaults_header(path, region, name):
+    """Write the region as a const uint16_t array, entry n for byte offset 2n."""
+    # Trailing erased half-words need no entry, flash_defaults_get() treats them as "no default".
+    end = len(region)
+    while end >= 2 and region[end - 2:end] == bytes([fl.ERASED_BYTE] * 2):
+        end -= 2
+    words = [region[n] | region[n + 1] << 8 for n in range(0, end, 2)]
+    guard = re.sub(r"\W", "_", os.path.basename(path)).upper()
+    with open(path, "w") as f:
+        f.write("// Generated by tools/flash_image.py, do not edit.\n")
+        f.write("#ifndef %s\n#define %s\n#include <stdint.h>\n" % (guard, guard))
+        f.write("static const uint16_t %s[%d] = {\n" % (name, max(len(words), 1)))
+        for n in range(0, len(words), 8):
+            f.write("\t" + " ".join("0x%04X," % w for w in words[n:n + 8]) + "\n")
+        f.write("};\n#endif // %s\n" % guard)
+    return len(words)
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("settings", help="JSON settings description")
+    parser.add_argument("-o", "--output", help="output .bin or .hex file")
+    parser.add_argument("--defaults-header", help="output C header with the defaults image for ch32v003_flash_defaults.h")
+    parser.add_argument("--defaults-name", default="flash_defaults_image",
+                        help="name of the array in --defaults-header (default: flash_defaults_image)")
+    parser.add_argument("--firmware", help="firmware .bin or .hex to merge the region into")
+    parser.add_argument("--ld", default=os.path.join(here, "..", "overrides.ld"),
+                        help="linker script providing FLASH_LENGTH_OVERRIDE (default: overrides.ld)")
+    parser.add_argument("--flash-length", type=lambda v: int(v, 0),
+                        help="FLASH_LENGTH_OVERRIDE value, overrides --ld")
+    args = parser.parse_args()
+    if not args.output and not args.defaults_header:
+        parser.error("nothing to do, give -o and/or --defaults-header")
+
+    length = args.flash_length if args.flash_length is not None else fl.read_flash_length_override(args.ld)
+    start = fl.region_start(length)
+    region = build_region(fl.load_settings(args.settings), fl.region_size(length))
+
+    if args.defaults_header:
+        count = write_defaults_header(args.defaults_header, region, args.defaults_name)
+        print("defaults image of %d half-words written to %s" % (count, args.defaults_header))
+    if not args.output:
+        return
+
+    if args.firmware:
+        firmware = fl.read_image(args.firmware)
+        overlap = [a for a in firmware if a >= start and firmware[a] != fl.ERASED_BYTE]
+        if overlap:
+            sys.exit("firmware overlaps the reserved region at 0x%08X" % min(overlap))
+        image = fl.to_contiguous(firmware, fl.FLASH_BASE, start) + region
+        fl.write_image(args.output, image, fl.FLASH_BASE)
+    else:
+        fl.write_image(args.output, region, start)
+
+    print("reserved region 0x%08X-0x%08X (%d bytes) written to %s"
+          % (start, start + len(region) - 1, len(region), args.output))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,245 @@
+"""
+Shared helpers for the host-side flash tools.
+
+This module knows the CH32V003 flash geometry, where the reserved nonvolatile
+region starts (FLASH_LENGTH_OVERRIDE from overrides.ld), how settings are laid
+out in that region and how to read and write raw binary and Intel HEX images.
+It mirrors what ch32v003_flash.h does on the target, so an image built here is
+byte-for-byte what the firmware would have programmed.
+"""
+import json
+import re
+import struct
+
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 16384
+PAGE_SIZE = 64
+ERASED_BYTE = 0xFF
+
+# Settings types and the struct format used to store them (little endian, like the target).
+SETTING_TYPES = {
+    "u16": "<H",     # flash_program_16()
+    "u8x2": "<BB",   # flash_program_2x8_bits(), value given as [byte0, byte1]
+    "float": "<f",   # flash_program_float_value()
+    "u32": "<I",     # two flash_program_16() calls, low half-word first
+}
+
+
+def read_flash_length_override(ld_path):
+    """Return the FLASH_LENGTH_OVERRIDE value PROVIDEd by a linker script."""
+    with open(ld_path) as f:
+        match = re.search(r"FLASH_LENGTH_OVERRIDE\s*=\s*(0x[0-9a-fA-F]+|\d+)", f.read())
+    if not match:
+        raise ValueError("%s does not define FLASH_LENGTH_OVERRIDE" % ld_path)
+    return int(match.group(1), 0)
+
+
+def region_start(flash_length_override):
+    """Address of nonvolatile byte 0, as flash_calculate_runtime_address(0) returns it."""
+    return FLASH_BASE + flash_length_override
+
+
+def region_size(flash_length_override):
+    """Number of bytes reserved for nonvolatile storage."""
+    if flash_length_override <= 0 or flash_length_override >= FLASH_SIZE:
+        raise ValueError("FLASH_LENGTH_OVERRIDE %d leaves no reserved region" % flash_length_override)
+    if flash_length_override % PAGE_SIZE:
+        raise ValueError("FLASH_LENGTH_OVERRIDE %d is not page aligned" % flash_length_override)
+    return FLASH_SIZE - flash_length_override
+
+
+def load_settings(path):
+    """Load a settings description: a JSON list of {name, offset, type, value}."""
+    with open(path) as f:
+        settings = json.load(f)
+    for s in settings:
+        for key in ("name", "offset", "type"):
+            if key not in s:
+                raise ValueError("setting %r is missing %r" % (s, key))
+        if s["type"] not in SETTING_TYPES:
+            raise ValueError("setting %s has unknown type %s" % (s["name"], s["type"]))
+        s["offset"] = int(s["offset"], 0) if isinstance(s["offset"], str) else int(s["offset"])
+    return settings
+
+
+def setting_size(setting):
+    return struct.calcsize(SETTING_TYPES[setting["type"]])
+
+
+def encode_setting(setting):
+    fmt = SETTING_TYPES[setting["type"]]
+    value = setting["value"]
+    if setting["type"] == "u8x2":
+        return struct.pack(fmt, *value)
+    if setting["type"] in ("u16", "u32") and isinstance(value, str):
+        value = int(value, 0)
+    return struct.pack(fmt, value)
+
+
+def decode_setting(setting, region):
+    fmt = SETTING_TYPES[setting["type"]]
+    raw = bytes(region[setting["offset"]:setting["offset"] + setting_size(setting)])
+    value = struct.unpack(fmt, raw)
+    return (list(value) if len(value) > 1 else value[0]), raw
+
+
+def check_setting_placement(settings, size):
+    """Reject settings that are misaligned, out of range or overlapping."""
+    used = {}
+    for s in settings:
+        start, end = s["offset"], s["offset"] + setting_size(s)
+        if start % 2:
+            raise ValueError("setting %s at offset %d is not half-word aligned" % (s["name"], start))
+        if end > size:
+            raise ValueError("setting %s ends at %d, past the %d byte region" % (s["name"], end, size))
+        for n in range(start, end):
+            if n in used:
+                raise ValueError("setting %s overlaps %s at offset %d" % (s["name"], used[n], n))
+            used[n] = s["name"]
+
+
+# Partition types and the keys each one needs besides name, type and addr, see the On-Flash Format section of its header.
+PARTITION_TYPES = {
+    "store": ("pages", "generation"),          # ch32v003_flash_store.h, optional "emergency" and "bad_pages"
+    "slots": ("pages",),                       # ch32v003_flash_slots.h
+    "bitset": ("pages",),                      # ch32v003_flash_bitset.h
+    "fifo": ("pages",),                        # ch32v003_flash_fifo.h
+    "hibernate": ("pages", "slot_pages"),      # ch32v003_flash_hibernate.h
+    "sorted": ("segment_pages", "tail_pages"), # ch32v003_flash_sorted.h
+    "hashed": ("pages", "buckets"),            # ch32v003_flash_hashed.h
+}
+
+
+def _parse_int(value):
+    return int(value, 0) if isinstance(value, str) else int(value)
+
+
+def load_partitions(path):
+    """Load a partition description: a JSON list of {name, type, addr, ...} entries, one per struct the firmware mounts.
+
+    Addresses are absolute, like the start_addr fields. A store names its generation banks as a list of two
+    {addr, pages} entries and optionally its emergency page address and its bad_pages bitset as {addr, pages}.
+    """
+    with open(path) as f:
+        partitions = json.load(f)
+    for p in partitions:
+        for key in ("name", "type", "addr"):
+            if key not in p:
+                raise ValueError("partition %r is missing %r" % (p, key))
+        if p["type"] not in PARTITION_TYPES:
+            raise ValueError("partition %s has unknown type %s" % (p["name"], p["type"]))
+        for key in PARTITION_TYPES[p["type"]]:
+            if key not in p:
+                raise ValueError("%s partition %s is missing %r" % (p["type"], p["name"], key))
+        for key in ("addr", "pages", "slot_pages", "segment_pages", "tail_pages", "buckets", "emergency"):
+            if key in p:
+                p[key] = _parse_int(p[key])
+        for bank in p.get("generation", []) + ([p["bad_pages"]] if "bad_pages" in p else []):
+            bank["addr"], bank["pages"] = _parse_int(bank["addr"]), _parse_int(bank["pages"])
+        if p["type"] == "store" and len(p["generation"]) != 2:
+            raise ValueError("store %s needs two generation banks" % p["name"])
+        if p["type"] == "sorted":
+            p["pages"] = 2 * p["segment_pages"] + p["tail_pages"]
+    return partitions
+
+
+def partition_areas(partition):
+    """Return the (label, addr, size) areas a partition occupies."""
+    name = partition["name"]
+    areas = [(name, partition["addr"], partition["pages"] * PAGE_SIZE)]
+    for n, bank in enumerate(partition.get("generation", [])):
+        areas.append(("%s generation bank %d" % (name, n), bank["addr"], bank["pages"] * PAGE_SIZE))
+    if partition.get("emergency"):
+        areas.append(("%s emergency page" % name, partition["emergency"], PAGE_SIZE))
+    if "bad_pages" in partition:
+        areas.append(("%s bad pages" % name, partition["bad_pages"]["addr"], partition["bad_pages"]["pages"] * PAGE_SIZE))
+    return areas
+
+
+def check_partition_placement(partitions, start, size):
+    """Reject partitions that are not page aligned, lie outside the region or overlap each other."""
+    used = {}
+    for p in partitions:
+        for label, addr, length in partition_areas(p):
+            if addr % PAGE_SIZE or length <= 0:
+                raise ValueError("%s at 0x%08X is not a whole number of aligned pages" % (label, addr))
+            if addr < start or addr + length > start + size:
+                raise ValueError("%s 0x%08X-0x%08X is outside the reserved region 0x%08X-0x%08X, check FLASH_LENGTH_OVERRIDE"
+                                 % (label, addr, addr + length - 1, start, start + size - 1))
+            for page in range(addr, addr + length, PAGE_SIZE):
+                if page in used:
+                    raise ValueError("%s overlaps %s at 0x%08X" % (label, used[page], page))
+                used[page] = label
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16 with polynomial 0x1021, as flash_crc16() computes it."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def read_image(path):
+    """Read a .bin (based at FLASH_BASE) or Intel .hex file into {address: byte}."""
+    if path.lower().endswith(".hex"):
+        return read_intel_hex(path)
+    with open(path, "rb") as f:
+        return {FLASH_BASE + n: b for n, b in enumerate(f.read())}
+
+
+def read_intel_hex(path):
+    memory = {}
+    upper = 0
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(":"):
+                raise ValueError("%s:%d: not an Intel HEX record" % (path, lineno))
+            record = bytes.fromhex(line[1:])
+            if sum(record) & 0xFF:
+                raise ValueError("%s:%d: bad record checksum" % (path, lineno))
+            count, addr, rtype = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + count]
+            if rtype == 0x00:
+                for n, b in enumerate(data):
+                    memory[upper + addr + n] = b
+            elif rtype == 0x01:
+                break
+            elif rtype == 0x02:
+                upper = ((data[0] << 8) | data[1]) << 4
+            elif rtype == 0x04:
+                upper = ((data[0] << 8) | data[1]) << 16
+    return memory
+
+
+def to_contiguous(memory, start, end):
+    """Flatten {address: byte} into bytes covering [start, end), filling gaps with 0xFF."""
+    return bytes(memory.get(a, ERASED_BYTE) for a in range(start, end))
+
+
+def write_intel_hex(path, data, base):
+    def record(rtype, addr, payload):
+        raw = bytes([len(payload), (addr >> 8) & 0xFF, addr & 0xFF, rtype]) + payload
+        return ":%s%02X\n" % (raw.hex().upper(), (-sum(raw)) & 0xFF)
+
+    with open(path, "w") as f:
+        upper = None
+        for n in range(0, len(data), 16):
+            addr = base + n
+            if addr >> 16 != upper:
+                upper = addr >> 16
+                f.write(record(0x04, 0, struct.pack(">H", upper)))
+            f.write(record(0x00, addr & 0xFFFF, data[n:n + 16]))
+        f.write(record(0x01, 0, b""))
+
+
+def write_image(path, data, base):
+    if path.lower().endswith(".hex"):
+        write_intel_hex(path, data, base)
+    else:
+        with open(path, "wb") as f:
+            f.write(data)